@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "math_eval/emit_c.h"
+#include "math_eval/evaluator.h"
+#include "math_eval/symbol_table.h"
+
+/*
+ * Builds a catalogue of formulas into a shared object:
+ *
+ *   aot <formulas> <output.so> [variables...]
+ *
+ * Every line of <formulas> is `name = expression`. Generated functions take
+ * `const struct math_eval_variables *` with the variables in the given order.
+ */
+
+#define MAX_FORMULAS 1024
+#define MAX_VARIABLES 64
+
+static char *trim(char *str) {
+  while (*str == ' ' || *str == '\t') {
+    ++str;
+  }
+
+  char *end = str + strlen(str);
+  while (end > str && strchr(" \t\r\n", end[-1])) {
+    *--end = '\0';
+  }
+
+  return str;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc - 3 > MAX_VARIABLES) {
+    fprintf(stderr, "Usage: %s <formulas> <output.so> [variables...]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *file = fopen(argv[1], "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open '%s'\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  struct symbol_table *table = symbol_table_create();
+  symbol_table_add_builtins(table);
+
+  struct math_eval_c_variable variables[MAX_VARIABLES];
+  const int variables_count = argc - 3;
+
+  for (int i = 0; i < variables_count; ++i) {
+    symbol_table_add_variable(table, argv[3 + i], 0, false);
+
+    variables[i].name = argv[3 + i];
+    variables[i].variable = symbol_table_find_variable(table, argv[3 + i]);
+  }
+
+  static char lines[MAX_FORMULAS][BUFSIZ];
+  struct math_eval_formula formulas[MAX_FORMULAS];
+  int formulas_count = 0;
+
+  bool ok = true;
+  while (ok && formulas_count < MAX_FORMULAS &&
+         fgets(lines[formulas_count], BUFSIZ, file)) {
+    char *line = lines[formulas_count];
+    char *separator = strchr(line, '=');
+    if (!separator) {
+      continue;
+    }
+
+    *separator = '\0';
+
+    struct math_eval_error error;
+    const char *expression = trim(separator + 1);
+    struct math_eval_expression *expr =
+        math_eval_compile(expression, table, &error);
+
+    if (!expr) {
+      fprintf(stderr, "Failed to compile '%s' at offset %d\n", expression,
+              error.offset);
+      ok = false;
+      break;
+    }
+
+    formulas[formulas_count].name = trim(line);
+    formulas[formulas_count].expr = expr;
+    formulas_count += 1;
+  }
+  fclose(file);
+
+  struct math_eval_emit_c_options options = {
+      .variables = variables,
+      .variables_count = variables_count,
+      .style = MATH_EVAL_EMIT_C_STRUCT,
+  };
+
+  struct math_eval_shared_object *object = NULL;
+  if (ok) {
+    object = math_eval_shared_object_build(argv[2], formulas, formulas_count,
+                                           &options);
+    ok = object != NULL;
+  }
+
+  /* Loading it back checks that every formula got exported */
+  for (int i = 0; ok && i < formulas_count; ++i) {
+    if (!math_eval_shared_object_function(object, formulas[i].name)) {
+      fprintf(stderr, "Formula '%s' is missing\n", formulas[i].name);
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    printf("Built %d formulas into %s\n", formulas_count, argv[2]);
+  }
+
+  for (int i = 0; i < formulas_count; ++i) {
+    math_eval_expr_destroy((struct math_eval_expression *)formulas[i].expr);
+  }
+
+  math_eval_shared_object_close(object);
+  symbol_table_destroy(table);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,341 @@
 #include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "math_eval/batch.h"
 #include "math_eval/evaluator.h"
+#include "math_eval/shared_cache.h"
+#include "math_eval/snapshot_table.h"
 #include "math_eval/symbol_table.h"
+#include "math_eval/thread_pool.h"
+#include "math_eval/tokenizer.h"
 
 #if 1
 
+static double seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+/* Parallel batch throughput for 1, 2, 4, ... up to `max_threads` threads */
+static void bench_scaling(const struct math_eval_expression *expr,
+                          struct math_eval_variable *a, int max_threads) {
+  enum { ROWS = 1 << 24 };
+
+  double *values = malloc(sizeof(*values) * ROWS);
+  double *results = malloc(sizeof(*results) * ROWS);
+  struct math_eval_column column = {.variable = a, .values = values};
+
+  for (int i = 0; i < ROWS; ++i) {
+    values[i] = i;
+  }
+
+  for (int threads = 1;; threads *= 2) {
+    if (threads > max_threads) {
+      threads = max_threads;
+    }
+
+    struct math_eval_thread_pool *pool = math_eval_thread_pool_create(threads);
+
+    const double start = seconds();
+    for (int i = 0; i < 8; ++i) {
+      math_eval_expr_batch_parallel(expr, ROWS, &column, 1, results, pool);
+    }
+    const double elapsed = seconds() - start;
+
+    printf("threads: %3d, %.3fs, %.1f Mrows/s\n", threads, elapsed,
+           8.0 * ROWS / elapsed * 1e-6);
+
+    math_eval_thread_pool_destroy(pool);
+    if (threads == max_threads) {
+      break;
+    }
+  }
+
+  free(results);
+  free(values);
+}
+
+struct bench_lookups {
+  struct math_eval_shared_cache *cache;
+  char (*expressions)[64];
+  int expressions_count;
+  double sums[256];
+};
+
+static void bench_lookups_task(void *user_data, size_t index, int worker) {
+  struct bench_lookups *lookups = user_data;
+
+  double sum = 0;
+  for (int i = 0; i < 1 << 21; ++i) {
+    const int expression = (int)((size_t)i * 7 + index) %
+                           lookups->expressions_count;
+    sum += math_eval_shared_cache_eval(
+        lookups->cache, worker, lookups->expressions[expression], NULL);
+  }
+
+  lookups->sums[index % 256] += sum;
+}
+
+/* Shared cache lookups per second for 1, 2, 4, ... up to `max_threads` */
+static void bench_shared_cache(struct symbol_table *table, int max_threads) {
+  enum { EXPRESSIONS = 512 };
+
+  static char expressions[EXPRESSIONS][64];
+  for (int i = 0; i < EXPRESSIONS; ++i) {
+    snprintf(expressions[i], sizeof(expressions[i]), "a * %d + 1 / (a + %d)",
+             i, i + 1);
+  }
+
+  for (int threads = 1;; threads *= 2) {
+    if (threads > max_threads) {
+      threads = max_threads;
+    }
+
+    struct math_eval_thread_pool *pool = math_eval_thread_pool_create(threads);
+    struct bench_lookups lookups = {
+        .cache = math_eval_shared_cache_create(table, MATH_EVAL_COMPILE_DEFAULT,
+                                               2 * EXPRESSIONS, threads),
+        .expressions = expressions,
+        .expressions_count = EXPRESSIONS,
+    };
+
+    /* One task per worker, every worker starts with its own */
+    const double start = seconds();
+    math_eval_thread_pool_run(pool, (size_t)threads, bench_lookups_task,
+                              &lookups);
+    const double elapsed = seconds() - start;
+
+    const struct math_eval_cache_stats stats =
+        math_eval_shared_cache_stats(lookups.cache);
+    printf("threads: %3d, %.3fs, %.1f Mlookups/s, misses: %llu\n", threads,
+           elapsed, (double)(stats.hits + stats.misses) / elapsed * 1e-6,
+           (unsigned long long)stats.misses);
+
+    math_eval_shared_cache_destroy(lookups.cache);
+    math_eval_thread_pool_destroy(pool);
+    if (threads == max_threads) {
+      break;
+    }
+  }
+}
+
+/*
+ * Sums of variables added close together, such as the inputs of one formula,
+ * picked from a table of `count` of them
+ */
+static void bench_variables(int count, int flags) {
+  enum { EXPRESSIONS = 256, TERMS = 20, WINDOW = 32, EVALUATIONS = 1 << 23 };
+
+  struct symbol_table *table = symbol_table_create();
+  for (int i = 0; i < count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "v%d", i);
+    symbol_table_add_variable(table, name, i, false);
+  }
+
+  struct math_eval_expression *exprs[EXPRESSIONS];
+  uint64_t state = 0x9e3779b97f4a7c15u;
+  int lines = 0;
+
+  for (int i = 0; i < EXPRESSIONS; ++i) {
+    char expression[TERMS * 16];
+    int length = 0;
+
+    state = state * 6364136223846793005u + 1442695040888963407u;
+    const int window = (int)((state >> 33) % (uint64_t)(count - WINDOW + 1));
+
+    /* Cache lines holding the values read by the expression */
+    uintptr_t touched[TERMS];
+    int touched_count = 0;
+
+    for (int term = 0; term < TERMS; ++term) {
+      state = state * 6364136223846793005u + 1442695040888963407u;
+      const int variable = window + (int)((state >> 33) % WINDOW);
+
+      char name[32];
+      snprintf(name, sizeof(name), "v%d", variable);
+      length += snprintf(expression + length,
+                         sizeof(expression) - (size_t)length, "%s%s",
+                         term > 0 ? " + " : "", name);
+
+      const uintptr_t line =
+          (uintptr_t)&symbol_table_find_variable(table, name)->value / 64;
+      int seen = 0;
+      while (seen < touched_count && touched[seen] != line) {
+        ++seen;
+      }
+      if (seen == touched_count) {
+        touched[touched_count++] = line;
+      }
+    }
+
+    lines += touched_count;
+    exprs[i] = math_eval_compile_ex(expression, table, flags, NULL);
+  }
+
+  double sum = 0;
+  const double start = seconds();
+  for (int i = 0; i < EVALUATIONS; ++i) {
+    sum += math_eval_expr(exprs[i % EXPRESSIONS]);
+  }
+  const double elapsed = seconds() - start;
+
+  printf("variables: %d, %.1f cache lines and %.1f ns per evaluation (%f)\n",
+         count, (double)lines / EXPRESSIONS, elapsed / EVALUATIONS * 1e9, sum);
+
+  for (int i = 0; i < EXPRESSIONS; ++i) {
+    math_eval_expr_destroy(exprs[i]);
+  }
+  symbol_table_destroy(table);
+}
+
+/*
+ * Table per request: created, given the inputs, used for one expression and
+ * destroyed, with builtins either added to it or looked up in the shared
+ * table
+ */
+static void bench_tables(bool layered) {
+  enum { REQUESTS = 1 << 18 };
+
+  double sum = 0;
+  const double start = seconds();
+  for (int i = 0; i < REQUESTS; ++i) {
+    struct symbol_table *table =
+        layered ? symbol_table_create_child(symbol_table_builtins())
+                : symbol_table_create();
+    if (!layered) {
+      symbol_table_add_builtins(table);
+    }
+
+    symbol_table_add_variable(table, "a", i, false);
+    sum += math_eval("sin(a) * pi + sqrt(a)", table, NULL);
+    symbol_table_destroy(table);
+  }
+  const double elapsed = seconds() - start;
+
+  printf("%s tables: %.0f ns per request (%f)\n",
+         layered ? "layered" : "own", elapsed / REQUESTS * 1e9, sum);
+}
+
+/* Pinning a snapshot to read a variable, and publishing `count` variables */
+static void bench_snapshots(int count) {
+  enum { PINS = 1 << 24, PUBLISHES = 1 << 10 };
+
+  struct math_eval_snapshot_table *snapshots =
+      math_eval_snapshot_table_create(symbol_table_builtins(), 1);
+  struct symbol_table *writer = math_eval_snapshot_table_writer(snapshots);
+  for (int i = 0; i < count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "v%d", i);
+    symbol_table_add_variable(writer, name, i, false);
+  }
+
+  double start = seconds();
+  for (int i = 0; i < PUBLISHES; ++i) {
+    symbol_table_add_variable(writer, "v0", i, false);
+    math_eval_snapshot_table_publish(snapshots);
+  }
+  const double publish = (seconds() - start) / PUBLISHES;
+
+  double sum = 0;
+  start = seconds();
+  for (int i = 0; i < PINS; ++i) {
+    struct symbol_table *table = math_eval_snapshot_table_pin(snapshots, 0);
+    sum += symbol_table_find_variable(table, "v0")->value;
+    math_eval_snapshot_table_unpin(snapshots, 0);
+  }
+  const double pin = (seconds() - start) / PINS;
+
+  printf("snapshots: %d variables, %.0f ns per publish, %.1f ns per pinned "
+         "lookup (%f)\n",
+         count, publish * 1e9, pin * 1e9, sum);
+
+  math_eval_snapshot_table_destroy(snapshots);
+}
+
+/* Tokenizes every line of `input`, `rounds` times */
+static void bench_tokenize(const char *name, const char *input, size_t length,
+                           int rounds) {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer);
+
+  size_t tokens = 0;
+  const double start = seconds();
+
+  for (int round = 0; round < rounds; ++round) {
+    const char *line = input;
+    const char *end = input + length;
+
+    while (line < end) {
+      const char *newline = memchr(line, '\n', (size_t)(end - line));
+      const size_t size = (size_t)((newline ? newline : end) - line);
+
+      tokenizer_read_n(&tokenizer, line, size);
+      while (tokenizer_next(&tokenizer).type != TOK_EOF) {
+        tokens += 1;
+      }
+
+      line += size + 1;
+    }
+  }
+
+  const double elapsed = seconds() - start;
+  printf("%s: %.3fs, %.1f MB/s, %.1f Mtokens/s\n", name, elapsed,
+         (double)length * rounds / elapsed * 1e-6,
+         (double)tokens / elapsed * 1e-6);
+}
+
+/* Tokenizer throughput over the lines of `corpus` and one generated line */
+static void bench_tokenizer(const char *corpus) {
+  FILE *file = fopen(corpus, "rb");
+  if (file) {
+    static char lines[1 << 22];
+    const size_t length = fread(lines, 1, sizeof(lines), file);
+    fclose(file);
+
+    bench_tokenize("corpus", lines, length, 50);
+  }
+
+  /* Long names, numbers and runs of spaces */
+  enum { GENERATED = 1 << 24 };
+
+  static const char *const pieces[] = {
+      "some_rather_long_variable_name_7",
+      " * ",
+      "12345.678901234e-12",
+      "        +          ",
+      "(x_coordinate - y_coordinate) / ",
+      "3.14159265358979",
+      " - ",
+      "sqrt(first_argument_value, 2.5)",
+      " % ",
+  };
+
+  char *generated = malloc(GENERATED);
+  size_t length = 0;
+
+  for (size_t i = 0;; ++i) {
+    const char *piece = pieces[i % (sizeof(pieces) / sizeof(*pieces))];
+    const size_t size = strlen(piece);
+    if (length + size > GENERATED) {
+      break;
+    }
+
+    memcpy(generated + length, piece, size);
+    length += size;
+  }
+
+  bench_tokenize("generated", generated, length, 4);
+  free(generated);
+}
+
 int app(int argc, char **argv) {
   struct symbol_table *table = symbol_table_create();
 
@@ -18,14 +344,149 @@ int app(int argc, char **argv) {
   symbol_table_add_variable(table, "a", 400, false);
   struct math_eval_variable *a = symbol_table_find_variable(table, "a");
 
+  symbol_table_add_variable(table, "b", 3, false);
+
+  int flags = MATH_EVAL_COMPILE_DEFAULT;
+  bool batch = false;
+  bool compile = false;
+  bool one_shot = false;
+  bool shared_cache = false;
+  int max_threads = 0;
+  const char *expression = "1 / (a + 1) + 2 / (a + 2) + 3 / (a + 3)";
+  char sum_expression[1 << 16];
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--bytecode") == 0) {
+      flags |= MATH_EVAL_COMPILE_BYTECODE;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      flags |= MATH_EVAL_COMPILE_JIT;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compile = true;
+    } else if (strcmp(argv[i], "--shared-cache") == 0) {
+      /* With `--threads=`, lookup throughput of the shared cache */
+      shared_cache = true;
+    } else if (strncmp(argv[i], "--tokenize=", 11) == 0) {
+      /* Tokenizer throughput over a corpus, such as tests/test_complete.txt */
+      bench_tokenizer(argv[i] + 11);
+
+      symbol_table_destroy(table);
+      return EXIT_SUCCESS;
+    } else if (strcmp(argv[i], "--one-shot") == 0) {
+      one_shot = true;
+    } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+      symbol_table_cache_enable(table, atoi(argv[i] + 8));
+    } else if (strcmp(argv[i], "--no-cse") == 0) {
+      flags |= MATH_EVAL_COMPILE_NO_CSE;
+    } else if (strcmp(argv[i], "--repetitive") == 0) {
+      /* Gains from common subexpression elimination */
+      expression = "sin(a / 7) + sin(a / 7) ^ 2 + sqrt(sin(a / 7) + 1) * "
+                   "exp(-a / 1000) + exp(-a / 1000)";
+    } else if (strcmp(argv[i], "--literals") == 0) {
+      /* Mostly numbers to read, see `--compile` */
+      expression = "a * 3.141592653589793 + 2.718281828459045 / (a + "
+                   "1.4142135623730951) - 6.02214076e23 * 1.602176634e-19 + "
+                   "0.5772156649015329 * a - 1.2020569031595942 ^ 2.5";
+    } else if (strcmp(argv[i], "--incremental") == 0) {
+      flags |= MATH_EVAL_COMPILE_INCREMENTAL;
+    } else if (strcmp(argv[i], "--mostly-static") == 0) {
+      /* Most of the work reads `b`, which never changes */
+      expression = "a * sin(b) + cos(b) ^ 2 + exp(-b / 1000) * sqrt(b + 1) + "
+                   "log(b + 2) / (b + 5)";
+    } else if (strcmp(argv[i], "--balance") == 0) {
+      flags |= MATH_EVAL_COMPILE_BALANCE;
+    } else if (strncmp(argv[i], "--sum=", 6) == 0) {
+      /* Latency of a long chain of additions */
+      const int terms = atoi(argv[i] + 6);
+
+      int length = snprintf(sum_expression, sizeof(sum_expression), "a");
+      for (int term = 1; term < terms && length < (int)sizeof(sum_expression);
+           ++term) {
+        length += snprintf(sum_expression + length,
+                           sizeof(sum_expression) - (size_t)length,
+                           " + a * %d", term + 1);
+      }
+
+      expression = sum_expression;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      max_threads = atoi(argv[i] + 10);
+    } else if (strcmp(argv[i], "--tables") == 0) {
+      /* Cost of a symbol table per request */
+      bench_tables(false);
+      bench_tables(true);
+
+      symbol_table_destroy(table);
+      return EXIT_SUCCESS;
+    } else if (strncmp(argv[i], "--snapshots=", 12) == 0) {
+      /* Readers and writer of a snapshot table of that many variables */
+      bench_snapshots(atoi(argv[i] + 12));
+
+      symbol_table_destroy(table);
+      return EXIT_SUCCESS;
+    } else if (strncmp(argv[i], "--variables=", 12) == 0) {
+      /* Evaluation over a large table, flags have to come first */
+      bench_variables(atoi(argv[i] + 12), flags);
+
+      symbol_table_destroy(table);
+      return EXIT_SUCCESS;
+    }
+  }
+
   struct math_eval_expression *expr =
-      math_eval_compile("1 / (a + 1) + 2 / (a + 2) + 3 / (a + 3)", table, NULL);
+      math_eval_compile_ex(expression, table, flags, NULL);
+
+  struct math_eval_expr_stats stats;
+  math_eval_expr_stats(expr, &stats);
+  printf("operations: %d, depth: %d\n", stats.operations, stats.depth);
 
   double sum = 0;
 
-  for (int i = 0; i < 1e8; ++i) {
-    a->value = i;
-    sum += math_eval_expr(expr);
+  if (max_threads > 0 && shared_cache) {
+    bench_shared_cache(table, max_threads);
+  } else if (max_threads > 0) {
+    bench_scaling(expr, a, max_threads);
+  } else if (compile) {
+    /* Cost of compiling and freeing rather than evaluating */
+    for (int i = 0; i < 1e6; ++i) {
+      struct math_eval_expression *compiled =
+          math_eval_compile_ex(expression, table, flags, NULL);
+      sum += compiled->type;
+      math_eval_expr_destroy(compiled);
+    }
+  } else if (one_shot) {
+    /* Strings handed to `math_eval` every time, see `--cache=` */
+    for (int i = 0; i < 1e6; ++i) {
+      math_eval_variable_set(a, i);
+      sum += math_eval(expression, table, NULL);
+    }
+
+    const struct math_eval_cache_stats cache = symbol_table_cache_stats(table);
+    printf("cache hits: %llu, misses: %llu\n",
+           (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+  } else if (batch) {
+    enum { ROWS = 1 << 16 };
+
+    static double values[ROWS];
+    static double results[ROWS];
+    struct math_eval_column column = {.variable = a, .values = values};
+
+    for (int i = 0; i < 1e8; i += ROWS) {
+      const int rows = 1e8 - i < ROWS ? (int)1e8 - i : ROWS;
+      for (int j = 0; j < rows; ++j) {
+        values[j] = i + j;
+      }
+
+      math_eval_expr_batch(expr, (size_t)rows, &column, 1, results);
+      for (int j = 0; j < rows; ++j) {
+        sum += results[j];
+      }
+    }
+  } else {
+    for (int i = 0; i < 1e8; ++i) {
+      math_eval_variable_set(a, i);
+      sum += math_eval_expr(expr);
+    }
   }
 
   printf("%f\n", sum);
@@ -0,0 +1,46 @@
+#ifndef MATH_EVAL_BATCH_H
+#define MATH_EVAL_BATCH_H
+
+#include <stddef.h>
+
+#include "evaluator.h"
+#include "symbol_table.h"
+#include "thread_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of rows each instruction processes before dispatching the next one */
+#define MATH_EVAL_BATCH_BLOCK_SIZE 256
+
+/*
+ * Binds `variable` to an array of values, one per row. Variables without a
+ * column keep their current value for every row.
+ */
+struct math_eval_column {
+  const struct math_eval_variable *variable;
+  const double *values;
+};
+
+/* Fails for expressions reading a frame, see `math_eval_compile_frame` */
+bool math_eval_expr_batch(const struct math_eval_expression *expr, size_t n,
+                          const struct math_eval_column *inputs,
+                          int inputs_count, double *out);
+
+/*
+ * Splits rows between the workers of `pool`, or of the default pool when it's
+ * NULL. Every worker has its own scratch stack and results are the same for
+ * any number of workers.
+ */
+bool math_eval_expr_batch_parallel(const struct math_eval_expression *expr,
+                                   size_t n,
+                                   const struct math_eval_column *inputs,
+                                   int inputs_count, double *out,
+                                   struct math_eval_thread_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_BATCH_H */
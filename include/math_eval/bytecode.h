@@ -0,0 +1,110 @@
+#ifndef MATH_EVAL_BYTECODE_H
+#define MATH_EVAL_BYTECODE_H
+
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum math_eval_opcode {
+  MATH_EVAL_OPCODE_NUMBER = 0,
+  MATH_EVAL_OPCODE_VARIABLE,
+  MATH_EVAL_OPCODE_ADD,
+  MATH_EVAL_OPCODE_SUB,
+  MATH_EVAL_OPCODE_DIV,
+  MATH_EVAL_OPCODE_MUL,
+  MATH_EVAL_OPCODE_REM,
+  MATH_EVAL_OPCODE_EXP,
+  MATH_EVAL_OPCODE_NEGATE,
+  MATH_EVAL_OPCODE_CALL,
+  MATH_EVAL_OPCODE_RETURN,
+
+  MATH_EVAL_OPCODE_LOAD,   /* Pushes local `index` */
+  MATH_EVAL_OPCODE_STORE,  /* Copies the top of the stack to local `index` */
+  MATH_EVAL_OPCODE_OUTPUT, /* Pops the top of the stack into output `index` */
+  MATH_EVAL_OPCODE_HALT,
+
+  MATH_EVAL_OPCODE_FRAME, /* Pushes slot `index` of the evaluation frame */
+};
+
+struct math_eval_instruction {
+  enum math_eval_opcode opcode;
+
+  union {
+    double number;                             /* MATH_EVAL_OPCODE_NUMBER */
+    const double *variable;                    /* MATH_EVAL_OPCODE_VARIABLE */
+    const struct math_eval_function *function; /* MATH_EVAL_OPCODE_CALL */
+    int index; /* MATH_EVAL_OPCODE_LOAD, _STORE, _OUTPUT and _FRAME */
+  };
+};
+
+/*
+ * Stack machine program. Instructions are laid out in evaluation order and
+ * `stack_size` is the maximum depth of the value stack. Values used more than
+ * once are kept in `locals_count` locals.
+ */
+struct math_eval_program {
+  int instructions_count;
+  int functions_count;
+  int stack_size;
+  int locals_count;
+  int frame_size; /* Slots read from the frame, 0 when it reads none */
+
+  struct math_eval_instruction *instructions;
+  struct math_eval_function *functions;
+};
+
+struct math_eval_node_program {
+  struct math_eval_expression node;
+
+  struct math_eval_program *program;
+};
+
+/*
+ * Structurally equal subexpressions made of numbers, variables, operators and
+ * builtins are computed once, unless `flags` has MATH_EVAL_COMPILE_NO_CSE.
+ */
+struct math_eval_program *
+math_eval_program_create_ex(const struct math_eval_expression *expr,
+                            int flags);
+struct math_eval_program *
+math_eval_program_create(const struct math_eval_expression *expr);
+
+/* Returns NULL as well when `expr` has no common subexpressions */
+struct math_eval_program *
+math_eval_program_create_shared(const struct math_eval_expression *expr);
+
+/*
+ * Program writing the value of `exprs[i]` to output `i`, subexpressions common
+ * to several expressions are computed once. Ends with MATH_EVAL_OPCODE_HALT.
+ */
+struct math_eval_program *
+math_eval_program_create_fused(const struct math_eval_expression *const *exprs,
+                               int count);
+void math_eval_program_destroy(struct math_eval_program *program);
+
+/* Runs a program ending with MATH_EVAL_OPCODE_RETURN */
+double math_eval_program_run(const struct math_eval_program *program);
+
+/* Same as above, MATH_EVAL_OPCODE_FRAME reads from `frame` */
+double math_eval_program_run_frame(const struct math_eval_program *program,
+                                   const double *frame);
+
+/* Runs a program ending with MATH_EVAL_OPCODE_HALT */
+void math_eval_program_run_outputs(const struct math_eval_program *program,
+                                   double *out);
+
+/* Depth is taken over every output of fused programs */
+void math_eval_program_stats(const struct math_eval_program *program,
+                             struct math_eval_expr_stats *stats);
+
+struct math_eval_expression *
+math_eval_program_node_create(struct math_eval_program *program);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_BYTECODE_H */
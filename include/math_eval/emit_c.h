@@ -0,0 +1,80 @@
+#ifndef MATH_EVAL_EMIT_C_H
+#define MATH_EVAL_EMIT_C_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum math_eval_emit_c_style {
+  /* double name(double a, double b, ...) */
+  MATH_EVAL_EMIT_C_PARAMETERS = 0,
+
+  /*
+   * double name(const struct math_eval_variables *variables), fields are
+   * doubles in the order of `variables`
+   */
+  MATH_EVAL_EMIT_C_STRUCT,
+};
+
+/* Name under which `variable` appears in the generated code */
+struct math_eval_c_variable {
+  const char *name;
+  const struct math_eval_variable *variable;
+};
+
+struct math_eval_emit_c_options {
+  const struct math_eval_c_variable *variables;
+  int variables_count;
+
+  enum math_eval_emit_c_style style;
+};
+
+struct math_eval_formula {
+  const char *name;
+  const struct math_eval_expression *expr;
+};
+
+/* Functions built with `MATH_EVAL_EMIT_C_STRUCT` */
+typedef double (*math_eval_native_fun)(const void *variables);
+
+/* Includes, builtins and the variables struct, once per translation unit */
+bool math_eval_emit_c_prelude(FILE *out,
+                              const struct math_eval_emit_c_options *options);
+
+/*
+ * Writes `expr` as a C function called `name`. Fails on user functions and
+ * on variables that are missing from `options`.
+ */
+bool math_eval_emit_c(FILE *out, const char *name,
+                      const struct math_eval_expression *expr,
+                      const struct math_eval_emit_c_options *options);
+
+struct math_eval_shared_object;
+
+/*
+ * Writes formulas into `path`.c, builds the shared object `path` with the
+ * system C compiler ($CC or cc) and loads it.
+ */
+struct math_eval_shared_object *
+math_eval_shared_object_build(const char *path,
+                              const struct math_eval_formula *formulas,
+                              int formulas_count,
+                              const struct math_eval_emit_c_options *options);
+struct math_eval_shared_object *math_eval_shared_object_open(const char *path);
+void math_eval_shared_object_close(struct math_eval_shared_object *object);
+
+math_eval_native_fun
+math_eval_shared_object_function(struct math_eval_shared_object *object,
+                                 const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_EMIT_C_H */
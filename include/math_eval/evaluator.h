@@ -2,6 +2,9 @@
 #define MATH_EVAL_EVALUATOR_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "symbol_table.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +48,27 @@ enum math_eval_node_type {
   MATH_EVAL_UNARY,
   MATH_EVAL_BINARY,
   MATH_EVAl_VARIABLE,
+  MATH_EVAL_PROGRAM,
+  MATH_EVAL_NATIVE,
+  MATH_EVAL_INCREMENTAL,
+};
+
+enum math_eval_compile_flags {
+  MATH_EVAL_COMPILE_DEFAULT = 0x0,
+  MATH_EVAL_COMPILE_BYTECODE = 0x1, /* Lower the tree into a bytecode program */
+  MATH_EVAL_COMPILE_JIT = 0x2,      /* Generate machine code when available */
+  MATH_EVAL_COMPILE_NO_CSE = 0x4,   /* Evaluate repeated subexpressions again */
+
+  /* Rewrites that ignore NaN, infinities, signed zeros and extra rounding */
+  MATH_EVAL_COMPILE_FAST_MATH = 0x8,
+  /* Multiply by the reciprocal of constant divisors, rounds differently */
+  MATH_EVAL_COMPILE_RECIPROCAL = 0x10,
+  /* Fold constants scattered over chains of + and - or * and / */
+  MATH_EVAL_COMPILE_REASSOCIATE = 0x20,
+  /* Regroup chains of + or * into balanced trees, implies reassociation */
+  MATH_EVAL_COMPILE_BALANCE = 0x40,
+  /* Cache subtrees and only recompute those reading changed variables */
+  MATH_EVAL_COMPILE_INCREMENTAL = 0x80,
 };
 
 struct math_eval_expression {
@@ -54,20 +78,35 @@ struct math_eval_expression {
 };
 
 typedef double (*math_eval_value_fun)(const struct math_eval_expression *);
+typedef double (*math_eval_frame_fun)(const struct math_eval_expression *,
+                                      const double *frame);
+
+/*
+ * Compiled trees live in one allocation in evaluation order, the root first.
+ * Children are referenced by offsets relative to their parent node.
+ */
+static inline const struct math_eval_expression *
+math_eval_expr_at(const struct math_eval_expression *expr, int32_t offset) {
+  const char *node = (const char *)expr + offset;
+  return (const struct math_eval_expression *)(const void *)node;
+}
 
 struct math_eval_node_variable {
   struct math_eval_expression node;
 
   const double *variable;
+  int slot; /* Index in the evaluation frame, -1 when reading `variable` */
 };
 
 struct math_eval_node_function {
   struct math_eval_expression node;
 
   double (*function)(double *);
+  math_kernel kernel;
+  math_derivative derivative;
 
-  struct math_eval_expression **args;
   int args_count;
+  int32_t args[];
 };
 
 struct math_eval_node_number {
@@ -79,7 +118,7 @@ struct math_eval_node_number {
 struct math_eval_node_unary {
   struct math_eval_expression node;
 
-  struct math_eval_expression *arg;
+  int32_t arg;
   enum math_eval_unary_op {
     MATH_EVAL_UNARY_MINUS,
     MATH_EVAL_UNARY_PLUS,
@@ -89,8 +128,8 @@ struct math_eval_node_unary {
 struct math_eval_node_binary {
   struct math_eval_expression node;
 
-  struct math_eval_expression *left;
-  struct math_eval_expression *right;
+  int32_t left;
+  int32_t right;
 
   enum math_eval_arithmetic_operation {
     MATH_EVAL_OP_ADD,
@@ -102,8 +141,20 @@ struct math_eval_node_binary {
   } op;
 };
 
+/*
+ * Evaluates without building the expression unless `table` has a cache.
+ * Expressions calling user functions are read twice then, since the calls
+ * are only made once the whole expression is known to be valid. Compile
+ * those that are evaluated often.
+ */
 double math_eval(const char *expression, struct symbol_table *table,
                  struct math_eval_error *error);
+/*
+ * Variants of `_n` take the first `len` characters of `expression`, which
+ * needn't be terminated, nothing past them is read
+ */
+double math_eval_n(const char *expression, size_t len,
+                   struct symbol_table *table, struct math_eval_error *error);
 
 static inline double math_eval_expr(const struct math_eval_expression *expr) {
   return expr->value(expr);
@@ -112,12 +163,68 @@ static inline double math_eval_expr(const struct math_eval_expression *expr) {
 struct math_eval_expression *math_eval_compile(const char *expression,
                                                struct symbol_table *table,
                                                struct math_eval_error *error);
+struct math_eval_expression *math_eval_compile_n(const char *expression,
+                                                 size_t len,
+                                                 struct symbol_table *table,
+                                                 struct math_eval_error *error);
 struct math_eval_expression *
 math_eval_compile_ast(struct ast_node *ast, const char *expression,
                       struct symbol_table *table,
                       struct math_eval_error *error);
+struct math_eval_expression *math_eval_compile_ex(const char *expression,
+                                                  struct symbol_table *table,
+                                                  int flags,
+                                                  struct math_eval_error *error);
+struct math_eval_expression *
+math_eval_compile_ex_n(const char *expression, size_t len,
+                       struct symbol_table *table, int flags,
+                       struct math_eval_error *error);
+struct math_eval_expression *
+math_eval_compile_ast_ex(struct ast_node *ast, const char *expression,
+                         struct symbol_table *table, int flags,
+                         struct math_eval_error *error);
 void math_eval_expr_destroy(struct math_eval_expression *expression);
 
+/*
+ * Variables read from a frame of values given at evaluation, `names[i]` is
+ * read from `frame[i]`. Names are looked up in the layout before the table.
+ */
+struct math_eval_layout {
+  const char *const *names;
+  int count;
+};
+
+/*
+ * Compiles `expression` against `layout`, the result doesn't keep pointers to
+ * the values of layout variables and can be evaluated with different frames
+ * from any number of threads. MATH_EVAL_COMPILE_INCREMENTAL is ignored.
+ */
+struct math_eval_expression *
+math_eval_compile_frame(const char *expression, struct symbol_table *table,
+                        const struct math_eval_layout *layout, int flags,
+                        struct math_eval_error *error);
+struct math_eval_expression *
+math_eval_compile_frame_n(const char *expression, size_t len,
+                          struct symbol_table *table,
+                          const struct math_eval_layout *layout, int flags,
+                          struct math_eval_error *error);
+
+/*
+ * `frame` holds a value for every name of the layout the expression was
+ * compiled against. `math_eval_expr` returns NaN for expressions reading it.
+ */
+double math_eval_expr_frame(const struct math_eval_expression *expr,
+                            const double *frame);
+
+struct math_eval_expr_stats {
+  int operations; /* Operators and calls evaluated */
+  int depth;      /* Operations on the longest chain of dependent results */
+};
+
+/* Compiling with and without a flag and comparing the stats shows its effect */
+void math_eval_expr_stats(const struct math_eval_expression *expr,
+                          struct math_eval_expr_stats *stats);
+
 void math_eval_init(struct math_eval_allocator *allocator);
 
 #ifdef __cplusplus
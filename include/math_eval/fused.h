@@ -0,0 +1,39 @@
+#ifndef MATH_EVAL_FUSED_H
+#define MATH_EVAL_FUSED_H
+
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set of expressions compiled against one symbol table into a single program.
+ * Subexpressions shared between them, such as `exp(-r*t)` used by several
+ * formulas, are computed once per evaluation. Calls to user functions are
+ * never merged since they may have side effects.
+ */
+struct math_eval_fused;
+
+/*
+ * Compiles `expressions[0..count)`. On failure `error` describes the error
+ * and `failed`, when not NULL, is set to the index of the failing expression.
+ */
+struct math_eval_fused *math_eval_fused_compile(const char *const *expressions,
+                                                int count,
+                                                struct symbol_table *table,
+                                                int *failed,
+                                                struct math_eval_error *error);
+void math_eval_fused_destroy(struct math_eval_fused *fused);
+
+int math_eval_fused_outputs_count(const struct math_eval_fused *fused);
+
+/* Writes the value of expression `i` to `out[i]` */
+void math_eval_fused_eval(const struct math_eval_fused *fused, double *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_FUSED_H */
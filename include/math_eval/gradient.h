@@ -0,0 +1,41 @@
+#ifndef MATH_EVAL_GRADIENT_H
+#define MATH_EVAL_GRADIENT_H
+
+#include "bytecode.h"
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Variables read by `expr` in the order they first appear, left to right.
+ * At most `capacity` of them are written, the count is returned regardless.
+ */
+int math_eval_expr_variables(const struct math_eval_expression *expr,
+                             const struct math_eval_variable **variables,
+                             int capacity);
+
+/*
+ * Returns the value of `expr` and writes its partial derivative by the
+ * variable `i` of `math_eval_expr_variables` to `gradient[i]`. Derivatives
+ * are propagated backwards over a tape of the evaluation. User functions
+ * without a `derivative` are differentiated numerically.
+ *
+ * Trees are lowered to bytecode on every call, compile with
+ * MATH_EVAL_COMPILE_BYTECODE to take many gradients of one expression.
+ * Expressions reading a frame have no gradient and return NaN.
+ */
+double math_eval_expr_gradient(const struct math_eval_expression *expr,
+                               double *gradient);
+
+/* Same as above for a program ending with MATH_EVAL_OPCODE_RETURN */
+double math_eval_program_gradient(const struct math_eval_program *program,
+                                  double *gradient);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_GRADIENT_H */
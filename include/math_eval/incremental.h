@@ -0,0 +1,60 @@
+#ifndef MATH_EVAL_INCREMENTAL_H
+#define MATH_EVAL_INCREMENTAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cached value of a subtree and the variables it depends on */
+struct math_eval_incremental_node {
+  const struct math_eval_expression *expr;
+
+  uint64_t dependencies; /* Bit `i % 63` for the variable `i`, see below */
+  double value;
+
+  int children; /* Index of the first child in `children` */
+};
+
+/*
+ * Expression that only recomputes subtrees depending on variables whose
+ * version changed since the previous evaluation. Nodes are visited from the
+ * last one, children before their parent. Bit 63 of `dependencies`
+ * marks calls to user functions, these are recomputed every time. Evaluation
+ * updates the caches, so one expression can't be evaluated by several
+ * threads at once.
+ */
+struct math_eval_node_incremental {
+  struct math_eval_expression node;
+
+  struct math_eval_expression *tree;
+
+  struct math_eval_incremental_node *nodes; /* Root first */
+  int nodes_count;
+  int *children;
+
+  double *args; /* Arguments of the call being recomputed */
+  int args_size;
+
+  const struct math_eval_variable **variables;
+  uint64_t *versions; /* Versions seen by the previous evaluation */
+  int variables_count;
+
+  bool evaluated;
+};
+
+/* Takes `tree` over, it's destroyed on failure */
+struct math_eval_expression *
+math_eval_incremental_create(struct math_eval_expression *tree);
+void math_eval_incremental_destroy(struct math_eval_node_incremental *node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_INCREMENTAL_H */
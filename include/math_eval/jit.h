@@ -0,0 +1,46 @@
+#ifndef MATH_EVAL_JIT_H
+#define MATH_EVAL_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bytecode.h"
+#include "evaluator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Expression compiled to machine code. `node.value` points straight into the
+ * generated code, `program` is kept for the batch evaluator. `frame_value`
+ * is the same code, programs reading a frame are only called through it.
+ */
+struct math_eval_node_native {
+  struct math_eval_expression node;
+  math_eval_frame_fun frame_value;
+
+  struct math_eval_program *program;
+
+  void *code;
+  size_t code_size;
+};
+
+/* Whether the library was built with the JIT for the running platform */
+bool math_eval_jit_available(void);
+
+/* Returns NULL when the JIT is unavailable or code can not be mapped */
+struct math_eval_expression *
+math_eval_jit_compile(const struct math_eval_expression *expr);
+
+/* Same as above, the native node takes `program` over only on success */
+struct math_eval_expression *
+math_eval_jit_compile_program(struct math_eval_program *program);
+
+void math_eval_jit_destroy(struct math_eval_node_native *native);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_JIT_H */
@@ -0,0 +1,76 @@
+#ifndef MATH_EVAL_KERNELS_H
+#define MATH_EVAL_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum math_eval_isa {
+  MATH_EVAL_ISA_SCALAR = 0,
+  MATH_EVAL_ISA_SSE2,
+  MATH_EVAL_ISA_AVX2,
+  MATH_EVAL_ISA_AVX512,
+};
+
+/*
+ * Block kernels used by the batch evaluator. Binary kernels read the right
+ * operand from the block that follows the left one.
+ */
+struct math_eval_kernels {
+  enum math_eval_isa isa;
+
+  math_kernel add;
+  math_kernel sub;
+  math_kernel div;
+  math_kernel mul;
+  math_kernel rem;
+  math_kernel pow;
+  math_kernel negate;
+
+  math_kernel sin;
+  math_kernel cos;
+  math_kernel exp;
+  math_kernel log;
+  math_kernel sqrt;
+  math_kernel abs;
+  math_kernel floor;
+  math_kernel ceil;
+  math_kernel round;
+  math_kernel min;
+  math_kernel max;
+};
+
+/* Best instruction set supported by the running CPU */
+enum math_eval_isa math_eval_kernels_detect(void);
+
+/* Force kernels for `isa`, returns false if the CPU doesn't support it */
+bool math_eval_kernels_select(enum math_eval_isa isa);
+
+const struct math_eval_kernels *math_eval_kernels_get(void);
+
+const char *math_eval_isa_to_str(enum math_eval_isa isa);
+
+/* Forward to the kernels of the selected instruction set */
+void math_eval_kernel_sin(double *block, size_t n);
+void math_eval_kernel_cos(double *block, size_t n);
+void math_eval_kernel_exp(double *block, size_t n);
+void math_eval_kernel_log(double *block, size_t n);
+void math_eval_kernel_sqrt(double *block, size_t n);
+void math_eval_kernel_pow(double *block, size_t n);
+void math_eval_kernel_abs(double *block, size_t n);
+void math_eval_kernel_floor(double *block, size_t n);
+void math_eval_kernel_ceil(double *block, size_t n);
+void math_eval_kernel_round(double *block, size_t n);
+void math_eval_kernel_min(double *block, size_t n);
+void math_eval_kernel_max(double *block, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_KERNELS_H */
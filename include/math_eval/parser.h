@@ -36,6 +36,12 @@ struct ast_node {
   int size;   /* Length of a token */
 };
 
+struct ast_node_number {
+  struct ast_node node;
+
+  double value; /* As `strtod` reads the token */
+};
+
 struct ast_node_binary {
   struct ast_node node;
 
@@ -65,22 +71,39 @@ struct ast_error {
   enum ast_error_codes codes;
 };
 
+struct ast_arena;
+
 struct parser {
   struct tokenizer tokenizer;
   struct token lookahead;
 
   enum ast_error_codes error_codes;
   int error_offset;
+
+  struct ast_arena *arena; /* Nodes of the tree being read */
+
+  struct ast_node **args; /* Arguments of the calls being read */
+  int args_count;
+  int args_size;
 };
 
 #define ast_cast(ast, type) container_of(ast, type, node)
 
-void ast_node_destroy(struct ast_node *node);
+/* Frees the whole tree, `ast` must be a root built by the parser */
 void ast_destroy(struct ast_node *ast);
 struct ast_node *ast_build(const char *str, struct ast_error *error);
+/* Reads the first `len` characters of `str`, which needn't be terminated */
+struct ast_node *ast_build_n(const char *str, size_t len,
+                             struct ast_error *error);
 
 void parser_init(struct parser *parser);
 struct ast_node *parser_read(struct parser *parser, const char *str);
+struct ast_node *parser_read_n(struct parser *parser, const char *str,
+                               size_t len);
+
+/* Consumes the lookahead, an error is recorded unless it's of `token_types` */
+struct token parser_eat(struct parser *parser, int token_types);
+bool parser_token_is(struct parser *parser, int token_types);
 
 const char *ast_node_type_to_str(enum ast_node_type type);
 
@@ -0,0 +1,50 @@
+#ifndef MATH_EVAL_SHARED_CACHE_H
+#define MATH_EVAL_SHARED_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "evaluator.h"
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct math_eval_shared_cache;
+
+/*
+ * Compiled expressions shared between threads, keyed by their text. Lookups
+ * take no lock: entries are split between shards whose mutex is only taken to
+ * insert or evict, and evicted expressions are freed once no reader can still
+ * be evaluating them.
+ *
+ * Every thread reads through its own reader index in [0, `readers_count`),
+ * the `worker` of a thread pool task fits. Expressions are compiled with
+ * `flags` against `table`, which must not change while the cache is used,
+ * other than variable values. `MATH_EVAL_COMPILE_INCREMENTAL` isn't allowed
+ * since such expressions can't be evaluated by several threads at once.
+ * `capacity` is rounded up to fill every shard.
+ */
+struct math_eval_shared_cache *
+math_eval_shared_cache_create(struct symbol_table *table, int flags,
+                              int capacity, int readers_count);
+void math_eval_shared_cache_destroy(struct math_eval_shared_cache *cache);
+
+/* Evaluates `expression`, compiling it on a miss */
+double math_eval_shared_cache_eval(struct math_eval_shared_cache *cache,
+                                   int reader, const char *expression,
+                                   struct math_eval_error *error);
+
+/* Drops every expression, call after changing the table */
+void math_eval_shared_cache_clear(struct math_eval_shared_cache *cache);
+
+/* Sums of every reader, exact once readers are done */
+struct math_eval_cache_stats
+math_eval_shared_cache_stats(const struct math_eval_shared_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_SHARED_CACHE_H */
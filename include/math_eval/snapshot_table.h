@@ -0,0 +1,56 @@
+#ifndef MATH_EVAL_SNAPSHOT_TABLE_H
+#define MATH_EVAL_SNAPSHOT_TABLE_H
+
+#include <stdbool.h>
+
+#include "symbol_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct math_eval_snapshot_table;
+
+/*
+ * Symbol table changed by one writer while other threads read it. The writer
+ * changes its own table and publishes a read-only copy of it, readers pin the
+ * latest published copy and see it unchanged until they unpin it, even when
+ * newer ones are published meanwhile. Pinning takes no lock and doesn't
+ * allocate, neither do lookups in the pinned table. Copies are freed once no
+ * reader can still hold them.
+ *
+ * Every thread reads through its own reader index in [0, `readers_count`),
+ * the `worker` of a thread pool task fits. Names missing from the table are
+ * looked up in `parent`, which must not change, e.g. `symbol_table_builtins()`.
+ */
+struct math_eval_snapshot_table *
+math_eval_snapshot_table_create(struct symbol_table *parent,
+                                int readers_count);
+void math_eval_snapshot_table_destroy(struct math_eval_snapshot_table *table);
+
+/* Table of the writer, changes aren't seen by readers until published */
+struct symbol_table *
+math_eval_snapshot_table_writer(struct math_eval_snapshot_table *table);
+
+/*
+ * Makes a copy of the writer's table the one readers pin next and frees the
+ * copies no reader holds anymore. Copies the whole table, so changes are best
+ * published together.
+ */
+bool math_eval_snapshot_table_publish(struct math_eval_snapshot_table *table);
+
+/*
+ * Latest published table, read-only. It stays valid until `reader` unpins it,
+ * so do expressions compiled with it. A reader pins one table at a time.
+ */
+struct symbol_table *
+math_eval_snapshot_table_pin(struct math_eval_snapshot_table *table,
+                             int reader);
+void math_eval_snapshot_table_unpin(struct math_eval_snapshot_table *table,
+                                    int reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_SNAPSHOT_TABLE_H */
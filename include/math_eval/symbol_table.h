@@ -2,6 +2,8 @@
 #define MATH_EVAL_SYMBOL_TABLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,26 +11,105 @@ extern "C" {
 
 typedef double (*math_fn)(double *);
 
+/*
+ * Block version of a function. `block` holds `args_count` consecutive blocks
+ * of `MATH_EVAL_BATCH_BLOCK_SIZE` values, results are written to the first
+ * one.
+ */
+typedef void (*math_kernel)(double *block, size_t n);
+
+/* Writes the partial derivative by every argument to `partials` */
+typedef void (*math_derivative)(double *args, double *partials);
+
 struct hash_table;
+struct math_eval_cache;
 
 struct math_eval_function {
   math_fn function;
   int args_count;
+
+  math_kernel kernel;         /* Optional */
+  math_derivative derivative; /* Optional */
 };
 
 struct math_eval_variable {
   double value;
   bool constant;
+
+  /* Bumped on every change seen by incremental expressions */
+  uint64_t version;
 };
 
+static inline void math_eval_variable_set(struct math_eval_variable *variable,
+                                          double value) {
+  variable->value = value;
+  variable->version += 1;
+}
+
+/* Call after writing `value` directly */
+static inline void
+math_eval_variable_mark_dirty(struct math_eval_variable *variable) {
+  variable->version += 1;
+}
+
+/* Chunk `i` of a table holds `MATH_EVAL_VARIABLES_CHUNK << i` variables */
+#define MATH_EVAL_VARIABLES_CHUNK 16
+#define MATH_EVAL_VARIABLES_CHUNKS 27
+
 struct symbol_table {
+  /* Created along with the first symbol of their kind */
   struct hash_table *functions;
-  struct hash_table *variables;
+  struct hash_table *variables; /* Names to indices of `variable_chunks` */
+
+  /* Variables in the order they were added, chunks never move */
+  struct math_eval_variable *variable_chunks[MATH_EVAL_VARIABLES_CHUNKS];
+  int variables_count;
+
+  /* Searched for names missing here, see symbol_table_create_child */
+  struct symbol_table *parent;
+
+  struct math_eval_cache *cache; /* Optional, see symbol_table_cache_enable */
+
+  /* Adding symbols or enabling the cache fails, lookups don't write */
+  bool read_only;
+};
+
+struct math_eval_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+
+  int size;
+  int capacity;
 };
 
 struct symbol_table *symbol_table_create(void);
 void symbol_table_destroy(struct symbol_table *table);
 
+/*
+ * Table whose lookups fall through to `parent` for names it doesn't have,
+ * symbols added to it hide those of the parent. Only the table itself is
+ * allocated. `parent` has to outlive it, and the child can only have a cache
+ * when its parents are read-only.
+ */
+struct symbol_table *symbol_table_create_child(struct symbol_table *parent);
+
+/*
+ * Read-only table of the builtin functions and constants, shared by the whole
+ * process. Nothing can be added to it and it's safe to use from any thread.
+ * Its symbols live in read-only memory, writing the variables found in it
+ * faults.
+ * Usually the parent of tables created for a single evaluation:
+ *
+ *   symbol_table_create_child(symbol_table_builtins())
+ */
+struct symbol_table *symbol_table_builtins(void);
+
+/*
+ * Copy of the functions and variables of `table` under the same parent,
+ * variables keep their index. The cache isn't copied.
+ */
+struct symbol_table *symbol_table_clone(struct symbol_table *table);
+
 void symbol_table_add_builtins(struct symbol_table *table);
 
 struct math_eval_variable *
@@ -37,8 +118,34 @@ struct math_eval_function *
 symbol_table_find_function(struct symbol_table *table, const char *key);
 bool symbol_table_add_function(struct symbol_table *table, const char *key,
                                struct math_eval_function fc);
+/*
+ * Adding a variable that already exists updates it in place, expressions
+ * compiled before see the new value. Adding to a read-only table fails.
+ */
 bool symbol_table_add_variable(struct symbol_table *table, const char *key,
                                double var, bool constant);
+
+/*
+ * Variables are numbered from 0 in the order they are added, -1 if missing.
+ * Indices are those of the table itself, parents aren't searched.
+ */
+int symbol_table_find_variable_index(struct symbol_table *table,
+                                     const char *key);
+struct math_eval_variable *
+symbol_table_variable_at(struct symbol_table *table, int index);
+
+/*
+ * Keeps up to `capacity` expressions compiled by `math_eval` with the table,
+ * the least recently used one is dropped first. 0 disables the cache. Cached
+ * expressions are dropped when a variable or function is replaced or hidden.
+ * Evaluation updates the cache, so one table can't be used by several threads
+ * at once. Fails for read-only tables and for children of writable ones.
+ */
+bool symbol_table_cache_enable(struct symbol_table *table, int capacity);
+void symbol_table_cache_clear(struct symbol_table *table);
+struct math_eval_cache_stats
+symbol_table_cache_stats(const struct symbol_table *table);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,41 @@
+#ifndef MATH_EVAL_THREAD_POOL_H
+#define MATH_EVAL_THREAD_POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs task `index` on worker `worker`, workers are numbered from 0 */
+typedef void (*math_eval_task)(void *user_data, size_t index, int worker);
+
+struct math_eval_thread_pool;
+
+/*
+ * Pool of `workers_count` workers, the thread calling
+ * `math_eval_thread_pool_run` is one of them. Without thread support every
+ * task runs on the calling thread.
+ */
+struct math_eval_thread_pool *math_eval_thread_pool_create(int workers_count);
+void math_eval_thread_pool_destroy(struct math_eval_thread_pool *pool);
+
+/* Shared pool with a worker per online CPU, created on first use */
+struct math_eval_thread_pool *math_eval_thread_pool_default(void);
+
+int math_eval_thread_pool_size(const struct math_eval_thread_pool *pool);
+
+/*
+ * Runs tasks [0, tasks_count) and returns once all of them are done. Every
+ * worker starts with a contiguous range of tasks and steals half of another
+ * worker's range when its own runs out. Must not be called from a task.
+ */
+void math_eval_thread_pool_run(struct math_eval_thread_pool *pool,
+                               size_t tasks_count, math_eval_task task,
+                               void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !MATH_EVAL_THREAD_POOL_H */
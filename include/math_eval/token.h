@@ -31,6 +31,8 @@ struct token {
   int size;
   int offset;
   enum token_type type;
+
+  double value; /* Of a number, read while tokenizing */
 };
 
 const char *token_type_to_str(enum token_type type);
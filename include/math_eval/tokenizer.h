@@ -18,6 +18,8 @@ struct tokenizer {
 void tokenizer_init(struct tokenizer *tok);
 
 void tokenizer_read(struct tokenizer *tokenizer, const char *str);
+/* Reads no further than `len` characters, `str` needn't be terminated */
+void tokenizer_read_n(struct tokenizer *tokenizer, const char *str, size_t len);
 struct token tokenizer_next(struct tokenizer *tokenizer);
 
 #ifdef __cplusplus
@@ -0,0 +1,298 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/batch.h"
+#include "math_eval/bytecode.h"
+#include "math_eval/evaluator.h"
+#include "math_eval/incremental.h"
+#include "math_eval/jit.h"
+#include "math_eval/kernels.h"
+#include "math_eval/parser.h"
+#include "math_eval/thread_pool.h"
+
+#define BLOCK_SIZE MATH_EVAL_BATCH_BLOCK_SIZE
+
+struct batch_state {
+  const struct math_eval_program *program;
+
+  const double **columns; /* Column per instruction, NULL when not bound */
+  double *stack;          /* `stack_size` blocks of `BLOCK_SIZE` rows */
+  double *locals;         /* `locals_count` blocks */
+};
+
+#define BATCH_BINARY(opcode, kernel)                                           \
+  case opcode: {                                                               \
+    /* Right operand block directly follows the left one */                    \
+    sp -= BLOCK_SIZE;                                                          \
+    kernels->kernel(sp - BLOCK_SIZE, count);                                   \
+    break;                                                                     \
+  }
+
+static void batch_run_block(const struct batch_state *state, size_t offset,
+                            size_t count, double *out) {
+  const struct math_eval_instruction *instructions =
+      state->program->instructions;
+  const struct math_eval_kernels *kernels = math_eval_kernels_get();
+  double *sp = state->stack;
+
+  for (const struct math_eval_instruction *ip = instructions;; ++ip) {
+    switch (ip->opcode) {
+    case MATH_EVAL_OPCODE_NUMBER: {
+      for (size_t i = 0; i < count; ++i) {
+        sp[i] = ip->number;
+      }
+
+      sp += BLOCK_SIZE;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_VARIABLE: {
+      const double *column = state->columns[ip - instructions];
+      if (column) {
+        memcpy(sp, column + offset, sizeof(*sp) * count);
+      } else {
+        const double value = *ip->variable;
+        for (size_t i = 0; i < count; ++i) {
+          sp[i] = value;
+        }
+      }
+
+      sp += BLOCK_SIZE;
+      break;
+    }
+
+      BATCH_BINARY(MATH_EVAL_OPCODE_ADD, add)
+      BATCH_BINARY(MATH_EVAL_OPCODE_SUB, sub)
+      BATCH_BINARY(MATH_EVAL_OPCODE_DIV, div)
+      BATCH_BINARY(MATH_EVAL_OPCODE_MUL, mul)
+      BATCH_BINARY(MATH_EVAL_OPCODE_REM, rem)
+      BATCH_BINARY(MATH_EVAL_OPCODE_EXP, pow)
+
+    case MATH_EVAL_OPCODE_NEGATE: {
+      kernels->negate(sp - BLOCK_SIZE, count);
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_CALL: {
+      const struct math_eval_function *function = ip->function;
+      const int args_count = function->args_count;
+
+      sp -= BLOCK_SIZE * (size_t)args_count;
+
+      if (function->kernel && args_count > 0) {
+        function->kernel(sp, count);
+
+        sp += BLOCK_SIZE;
+        break;
+      }
+
+      /* Gather one row of arguments at a time */
+      double args[args_count > 0 ? args_count : 1];
+      for (size_t i = 0; i < count; ++i) {
+        for (int j = 0; j < args_count; ++j) {
+          args[j] = sp[BLOCK_SIZE * (size_t)j + i];
+        }
+
+        sp[i] = function->function(args);
+      }
+
+      sp += BLOCK_SIZE;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_LOAD: {
+      memcpy(sp, state->locals + BLOCK_SIZE * (size_t)ip->index,
+             sizeof(*sp) * count);
+
+      sp += BLOCK_SIZE;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_STORE: {
+      memcpy(state->locals + BLOCK_SIZE * (size_t)ip->index, sp - BLOCK_SIZE,
+             sizeof(*sp) * count);
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_RETURN: {
+      memcpy(out, sp - BLOCK_SIZE, sizeof(*out) * count);
+      return;
+    }
+
+    case MATH_EVAL_OPCODE_OUTPUT:
+    case MATH_EVAL_OPCODE_HALT:
+      assert(0 && "Batch evaluation expects a single result");
+      return;
+
+    case MATH_EVAL_OPCODE_FRAME:
+      assert(0 && "Columns are bound to variables, not to frame slots");
+      return;
+    }
+  }
+}
+
+static const double *
+batch_find_column(const struct math_eval_column *inputs, int inputs_count,
+                  const double *variable) {
+  for (int i = 0; i < inputs_count; ++i) {
+    if (&inputs[i].variable->value == variable) {
+      return inputs[i].values;
+    }
+  }
+
+  return NULL;
+}
+
+/* Tasks are whole blocks, results don't depend on how rows are split */
+#define BATCH_MAX_TASK_BLOCKS 64
+#define BATCH_TASKS_PER_WORKER 8
+
+struct batch_job {
+  const struct math_eval_program *program;
+  const double **columns;
+
+  double *stacks; /* Scratch stack and locals of every worker */
+  size_t stack_size;
+
+  size_t n;
+  size_t task_rows;
+  double *out;
+};
+
+static void batch_run_task(void *user_data, size_t index, int worker) {
+  const struct batch_job *job = user_data;
+
+  struct batch_state state = {
+      .program = job->program,
+      .columns = job->columns,
+      .stack = job->stacks + job->stack_size * (size_t)worker,
+  };
+  state.locals = state.stack + (size_t)job->program->stack_size * BLOCK_SIZE;
+
+  const size_t begin = index * job->task_rows;
+  const size_t end =
+      job->n - begin < job->task_rows ? job->n : begin + job->task_rows;
+
+  for (size_t offset = begin; offset < end; offset += BLOCK_SIZE) {
+    const size_t count = end - offset < BLOCK_SIZE ? end - offset : BLOCK_SIZE;
+    batch_run_block(&state, offset, count, job->out + offset);
+  }
+}
+
+static bool batch_evaluate(const struct math_eval_expression *expr, size_t n,
+                           const struct math_eval_column *inputs,
+                           int inputs_count, double *out,
+                           struct math_eval_thread_pool *pool) {
+  assert(expr != NULL);
+  assert(out != NULL);
+
+  if (expr->type == MATH_EVAL_NUMBER) {
+    const double value = math_eval_expr(expr);
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = value;
+    }
+
+    return true;
+  }
+
+  /* Tree expressions are lowered once for the whole batch */
+  struct math_eval_program *lowered = NULL;
+  const struct math_eval_program *program;
+
+  if (expr->type == MATH_EVAL_PROGRAM) {
+    program = ast_cast(expr, struct math_eval_node_program)->program;
+  } else if (expr->type == MATH_EVAL_NATIVE) {
+    program = ast_cast(expr, struct math_eval_node_native)->program;
+  } else {
+    if (expr->type == MATH_EVAL_INCREMENTAL) {
+      expr = ast_cast(expr, struct math_eval_node_incremental)->tree;
+    }
+
+    lowered = math_eval_program_create(expr);
+    if (!lowered) {
+      return false;
+    }
+
+    program = lowered;
+  }
+
+  /* Columns are bound to variables, frame slots have nothing to read */
+  if (program->frame_size > 0) {
+    return false;
+  }
+
+  const size_t workers_count =
+      pool ? (size_t)math_eval_thread_pool_size(pool) : 1;
+  const size_t blocks = (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  size_t task_blocks = blocks / (workers_count * BATCH_TASKS_PER_WORKER);
+  if (task_blocks < 1) {
+    task_blocks = 1;
+  } else if (task_blocks > BATCH_MAX_TASK_BLOCKS) {
+    task_blocks = BATCH_MAX_TASK_BLOCKS;
+  }
+
+  struct batch_job job = {
+      .program = program,
+      .columns =
+          yu_calloc((size_t)program->instructions_count, sizeof(*job.columns)),
+      .stack_size =
+          (size_t)(program->stack_size + program->locals_count) * BLOCK_SIZE,
+      .n = n,
+      .task_rows = task_blocks * BLOCK_SIZE,
+      .out = out,
+  };
+  job.stacks = yu_calloc(job.stack_size * workers_count, sizeof(double));
+
+  bool ok = job.columns && job.stacks;
+  if (ok) {
+    for (int i = 0; i < program->instructions_count; ++i) {
+      const struct math_eval_instruction *instruction =
+          &program->instructions[i];
+
+      if (instruction->opcode == MATH_EVAL_OPCODE_VARIABLE) {
+        job.columns[i] =
+            batch_find_column(inputs, inputs_count, instruction->variable);
+      }
+    }
+
+    const size_t tasks_count = (blocks + task_blocks - 1) / task_blocks;
+    if (pool) {
+      math_eval_thread_pool_run(pool, tasks_count, batch_run_task, &job);
+    } else {
+      for (size_t i = 0; i < tasks_count; ++i) {
+        batch_run_task(&job, i, 0);
+      }
+    }
+  }
+
+  yu_free(job.stacks);
+  yu_free(job.columns);
+  math_eval_program_destroy(lowered);
+
+  return ok;
+}
+
+bool math_eval_expr_batch(const struct math_eval_expression *expr, size_t n,
+                          const struct math_eval_column *inputs,
+                          int inputs_count, double *out) {
+  return batch_evaluate(expr, n, inputs, inputs_count, out, NULL);
+}
+
+bool math_eval_expr_batch_parallel(const struct math_eval_expression *expr,
+                                   size_t n,
+                                   const struct math_eval_column *inputs,
+                                   int inputs_count, double *out,
+                                   struct math_eval_thread_pool *pool) {
+  if (!pool) {
+    pool = math_eval_thread_pool_default();
+    if (!pool) {
+      return false;
+    }
+  }
+
+  return batch_evaluate(expr, n, inputs, inputs_count, out, pool);
+}
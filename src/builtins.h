@@ -0,0 +1,84 @@
+#ifndef MATH_EVAL_BUILTINS_H
+#define MATH_EVAL_BUILTINS_H
+
+#include <math.h>
+
+#include "math_eval/symbol_table.h"
+
+#include "float_compare.h"
+
+/*
+ * Builtin functions as expressions over `args`. The symbol table and the C
+ * emitter both expand these, so generated code computes the same values.
+ * `derivative` writes the partial derivatives by each argument to `partials`.
+ *
+ * X(name, args_count, expression, kernel, derivative)
+ */
+#define MATH_EVAL_BUILTINS(X)                                                  \
+  X(min, 2, fmin(args[0], args[1]), math_eval_kernel_min,                      \
+    partials[0] = args[0] <= args[1] ? 1.0 : 0.0;                              \
+    partials[1] = 1.0 - partials[0])                                           \
+  X(max, 2, fmax(args[0], args[1]), math_eval_kernel_max,                      \
+    partials[0] = args[0] >= args[1] ? 1.0 : 0.0;                              \
+    partials[1] = 1.0 - partials[0])                                           \
+  X(logn, 2, log(args[1]) / log(args[0]), NULL,                                \
+    partials[0] = -log(args[1]) / (args[0] * log(args[0]) * log(args[0]));     \
+    partials[1] = 1.0 / (args[1] * log(args[0])))                              \
+  X(log, 1, log(args[0]), math_eval_kernel_log, partials[0] = 1.0 / args[0])   \
+  X(ceil, 1, ceil(args[0]), math_eval_kernel_ceil, partials[0] = 0.0)          \
+  X(floor, 1, floor(args[0]), math_eval_kernel_floor, partials[0] = 0.0)       \
+  X(abs, 1, fabs(args[0]), math_eval_kernel_abs,                               \
+    partials[0] = args[0] > 0.0 ? 1.0 : args[0] < 0.0 ? -1.0 : 0.0)            \
+  X(cos, 1, cos(args[0]), math_eval_kernel_cos, partials[0] = -sin(args[0]))   \
+  X(sin, 1, sin(args[0]), math_eval_kernel_sin, partials[0] = cos(args[0]))    \
+  X(exp, 1, exp(args[0]), math_eval_kernel_exp, partials[0] = exp(args[0]))    \
+  X(round, 1, round(args[0]), math_eval_kernel_round, partials[0] = 0.0)       \
+  X(pow, 2, pow(args[0], args[1]), math_eval_kernel_pow,                       \
+    builtin_pow_derivative(args, partials))                                    \
+  X(sqrt, 1, sqrt(args[0]), math_eval_kernel_sqrt,                             \
+    partials[0] = 0.5 / sqrt(args[0]))                                         \
+  X(tan, 1, tan(args[0]), NULL,                                                \
+    partials[0] = 1.0 / (cos(args[0]) * cos(args[0])))                         \
+  X(ncr, 2, (double)builtin_ncr((int)args[0], (int)args[1]), NULL,             \
+    partials[0] = partials[1] = 0.0)
+
+/* Partial derivatives of `pow(x, y)`, also used for the `^` operator */
+static inline void builtin_pow_derivative(const double *args,
+                                          double *partials) {
+  const double x = args[0];
+  const double y = args[1];
+
+  /* `x ^ 0` is constant even where `x ^ -1` isn't finite */
+  partials[0] = math_eval_float_equal(y, 0.0) ? 0.0 : y * pow(x, y - 1.0);
+  partials[1] = x > 0.0 ? pow(x, y) * log(x) : 0.0;
+}
+
+/* Definitions the builtin expressions depend on */
+#define MATH_EVAL_BUILTIN_HELPERS                                              \
+  static size_t builtin_ncr(int n, int r) {                                    \
+    if (r > n) {                                                               \
+      return 0;                                                                \
+    }                                                                          \
+    if (r * 2 > n) {                                                           \
+      r = n - r;                                                               \
+    }                                                                          \
+    if (r == 0) {                                                              \
+      return 1;                                                                \
+    }                                                                          \
+                                                                               \
+    size_t result = (size_t)n;                                                 \
+    for (int i = 2; i <= r; ++i) {                                             \
+      result *= (size_t)(n - i + 1);                                           \
+      result /= (size_t)i;                                                     \
+    }                                                                          \
+    return result;                                                             \
+  }
+
+/* Name of the builtin implemented by `function`, NULL for user functions */
+const char *math_eval_builtin_name(math_fn function);
+
+/* Builtin called `name` regardless of what a symbol table binds it to */
+bool math_eval_builtin_find(const char *name,
+                            struct math_eval_function *function);
+
+#endif /* !MATH_EVAL_BUILTINS_H */
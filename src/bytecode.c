@@ -0,0 +1,825 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/bytecode.h"
+#include "math_eval/evaluator.h"
+#include "math_eval/parser.h"
+
+#include "builtins.h"
+
+/* Computed goto is a GNU extension, fall back to `switch` elsewhere */
+#if defined(__GNUC__)
+#define MATH_EVAL_THREADED_DISPATCH
+#endif
+
+/* Node of the expression DAG, equal subtrees share one value */
+struct program_value {
+  const struct math_eval_expression *expr;
+  size_t hash;
+
+  int operands;       /* Index of the first operand in `operands` */
+  int operands_count;
+
+  int uses;  /* Parents and outputs referencing the value */
+  int local; /* Slot holding the value once computed, -1 before that */
+};
+
+struct program_builder {
+  struct math_eval_program *program; /* NULL while measuring */
+  bool cse;
+
+  int instructions_count;
+  int functions_count;
+  int locals_count;
+  int depth;
+  int stack_size;
+  int frame_size;
+
+  struct program_value *values;
+  int values_count;
+
+  int *operands;
+  int operands_count;
+
+  int *buckets; /* Open addressing table of value indices, -1 if empty */
+  size_t buckets_mask;
+
+  /* Written instead of the program while measuring */
+  struct math_eval_instruction measured;
+};
+
+static int program_count_nodes(const struct math_eval_expression *expr) {
+  switch (expr->type) {
+  case MATH_EVAL_UNARY:
+    return 1 + program_count_nodes(math_eval_expr_at(
+                   expr, ast_cast(expr, struct math_eval_node_unary)->arg));
+
+  case MATH_EVAL_BINARY: {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+
+    return 1 + program_count_nodes(math_eval_expr_at(expr, binary->left)) +
+           program_count_nodes(math_eval_expr_at(expr, binary->right));
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    int count = 1;
+    for (int i = 0; i < fun->args_count; ++i) {
+      count += program_count_nodes(math_eval_expr_at(expr, fun->args[i]));
+    }
+    return count;
+  }
+
+  case MATH_EVAL_NUMBER:
+  case MATH_EVAl_VARIABLE:
+    return 1;
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    assert(0 && "Program can not be nested");
+    break;
+  }
+
+  return 0;
+}
+
+static inline size_t program_hash_combine(size_t hash, uint64_t value) {
+  hash ^= (size_t)value + 0x9e3779b97f4a7c15u + (hash << 6) + (hash >> 2);
+  return hash;
+}
+
+/* Everything that identifies a node, except for its operands */
+static size_t program_hash_node(const struct math_eval_expression *expr) {
+  size_t hash = program_hash_combine(0, (uint64_t)expr->type);
+
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER: {
+    uint64_t bits;
+    memcpy(&bits, &ast_cast(expr, struct math_eval_node_number)->value,
+           sizeof(bits));
+    return program_hash_combine(hash, bits);
+  }
+
+  case MATH_EVAl_VARIABLE: {
+    const struct math_eval_node_variable *var =
+        ast_cast(expr, struct math_eval_node_variable);
+    return program_hash_combine(
+        program_hash_combine(hash, (uintptr_t)var->variable),
+        (uint64_t)var->slot);
+  }
+
+  case MATH_EVAL_UNARY:
+    return program_hash_combine(
+        hash, (uint64_t)ast_cast(expr, struct math_eval_node_unary)->op);
+
+  case MATH_EVAL_BINARY:
+    return program_hash_combine(
+        hash, (uint64_t)ast_cast(expr, struct math_eval_node_binary)->op);
+
+  case MATH_EVAL_FUNCTION:
+    return program_hash_combine(
+        hash, (uintptr_t)ast_cast(expr, struct math_eval_node_function)
+                  ->function);
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    break;
+  }
+
+  return hash;
+}
+
+static bool program_same_node(const struct math_eval_expression *a,
+                              const struct math_eval_expression *b) {
+  if (a->type != b->type) {
+    return false;
+  }
+
+  switch (a->type) {
+  case MATH_EVAL_NUMBER:
+    /* Bitwise, so that 0.0 and -0.0 stay apart */
+    return memcmp(&ast_cast(a, struct math_eval_node_number)->value,
+                  &ast_cast(b, struct math_eval_node_number)->value,
+                  sizeof(double)) == 0;
+
+  case MATH_EVAl_VARIABLE:
+    return ast_cast(a, struct math_eval_node_variable)->variable ==
+               ast_cast(b, struct math_eval_node_variable)->variable &&
+           ast_cast(a, struct math_eval_node_variable)->slot ==
+               ast_cast(b, struct math_eval_node_variable)->slot;
+
+  case MATH_EVAL_UNARY:
+    return ast_cast(a, struct math_eval_node_unary)->op ==
+           ast_cast(b, struct math_eval_node_unary)->op;
+
+  case MATH_EVAL_BINARY:
+    return ast_cast(a, struct math_eval_node_binary)->op ==
+           ast_cast(b, struct math_eval_node_binary)->op;
+
+  case MATH_EVAL_FUNCTION:
+    return ast_cast(a, struct math_eval_node_function)->function ==
+           ast_cast(b, struct math_eval_node_function)->function;
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    break;
+  }
+
+  return false;
+}
+
+/* Calls to user functions may have side effects and are never merged */
+static inline bool program_is_pure(const struct math_eval_expression *expr) {
+  return expr->type != MATH_EVAL_FUNCTION ||
+         math_eval_builtin_name(
+             ast_cast(expr, struct math_eval_node_function)->function) != NULL;
+}
+
+static int program_find_value(const struct program_builder *builder,
+                              const struct math_eval_expression *expr,
+                              size_t hash, const int *operands,
+                              int operands_count, size_t *bucket) {
+  for (*bucket = hash & builder->buckets_mask;;
+       *bucket = (*bucket + 1) & builder->buckets_mask) {
+    const int index = builder->buckets[*bucket];
+    if (index < 0) {
+      return -1;
+    }
+
+    const struct program_value *value = &builder->values[index];
+    if (value->hash == hash && value->operands_count == operands_count &&
+        program_same_node(value->expr, expr) &&
+        memcmp(&builder->operands[value->operands], operands,
+               sizeof(int) * (size_t)operands_count) == 0) {
+      return index;
+    }
+  }
+}
+
+/* Returns the value computed by `expr`, adding it to the DAG if it's new */
+static int program_number_value(struct program_builder *builder,
+                                const struct math_eval_expression *expr) {
+  int operands[AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS];
+  int operands_count = 0;
+
+  switch (expr->type) {
+  case MATH_EVAL_UNARY: {
+    const struct math_eval_node_unary *unary =
+        ast_cast(expr, struct math_eval_node_unary);
+
+    const int arg =
+        program_number_value(builder, math_eval_expr_at(expr, unary->arg));
+    if (unary->op == MATH_EVAL_UNARY_PLUS) {
+      return arg;
+    }
+
+    operands[operands_count++] = arg;
+    break;
+  }
+
+  case MATH_EVAL_BINARY: {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+
+    operands[operands_count++] =
+        program_number_value(builder, math_eval_expr_at(expr, binary->left));
+    operands[operands_count++] =
+        program_number_value(builder, math_eval_expr_at(expr, binary->right));
+    break;
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    for (int i = 0; i < fun->args_count; ++i) {
+      operands[operands_count++] =
+          program_number_value(builder, math_eval_expr_at(expr, fun->args[i]));
+    }
+    break;
+  }
+
+  case MATH_EVAL_NUMBER:
+  case MATH_EVAl_VARIABLE:
+    break;
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    assert(0 && "Program can not be nested");
+    break;
+  }
+
+  size_t hash = program_hash_node(expr);
+  for (int i = 0; i < operands_count; ++i) {
+    hash = program_hash_combine(hash, (uint64_t)operands[i]);
+  }
+
+  const bool shared = builder->cse && program_is_pure(expr);
+
+  size_t bucket = 0;
+  if (shared) {
+    const int found = program_find_value(builder, expr, hash, operands,
+                                         operands_count, &bucket);
+    if (found >= 0) {
+      return found;
+    }
+  }
+
+  const int index = builder->values_count++;
+  struct program_value *value = &builder->values[index];
+
+  value->expr = expr;
+  value->hash = hash;
+  value->operands = builder->operands_count;
+  value->operands_count = operands_count;
+
+  for (int i = 0; i < operands_count; ++i) {
+    builder->operands[builder->operands_count++] = operands[i];
+    builder->values[operands[i]].uses += 1;
+  }
+
+  if (shared) {
+    builder->buckets[bucket] = index;
+  }
+
+  return index;
+}
+
+static inline struct math_eval_instruction *
+program_emit(struct program_builder *builder, enum math_eval_opcode opcode,
+             int stack_change) {
+  builder->depth += stack_change;
+  if (builder->depth > builder->stack_size) {
+    builder->stack_size = builder->depth;
+  }
+
+  /* Nothing is written while measuring */
+  struct math_eval_instruction *instruction =
+      builder->program
+          ? &builder->program->instructions[builder->instructions_count]
+          : &builder->measured;
+
+  builder->instructions_count += 1;
+  instruction->opcode = opcode;
+  return instruction;
+}
+
+static inline enum math_eval_opcode
+program_opcode_from_op(enum math_eval_arithmetic_operation op) {
+  switch (op) {
+  case MATH_EVAL_OP_ADD:
+    return MATH_EVAL_OPCODE_ADD;
+  case MATH_EVAL_OP_SUB:
+    return MATH_EVAL_OPCODE_SUB;
+  case MATH_EVAL_OP_DIV:
+    return MATH_EVAL_OPCODE_DIV;
+  case MATH_EVAL_OP_MUL:
+    return MATH_EVAL_OPCODE_MUL;
+  case MATH_EVAL_OP_REM:
+    return MATH_EVAL_OPCODE_REM;
+  case MATH_EVAL_OP_EXP:
+    return MATH_EVAL_OPCODE_EXP;
+  }
+
+  assert(0);
+  return MATH_EVAL_OPCODE_ADD;
+}
+
+static void program_lower(struct program_builder *builder, int index) {
+  struct program_value *value = &builder->values[index];
+
+  if (value->local >= 0) {
+    program_emit(builder, MATH_EVAL_OPCODE_LOAD, 1)->index = value->local;
+    return;
+  }
+
+  for (int i = 0; i < value->operands_count; ++i) {
+    program_lower(builder, builder->operands[value->operands + i]);
+  }
+
+  const struct math_eval_expression *expr = value->expr;
+
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER:
+    program_emit(builder, MATH_EVAL_OPCODE_NUMBER, 1)->number =
+        ast_cast(expr, struct math_eval_node_number)->value;
+    return;
+
+  case MATH_EVAl_VARIABLE: {
+    const struct math_eval_node_variable *var =
+        ast_cast(expr, struct math_eval_node_variable);
+
+    if (var->slot >= 0) {
+      program_emit(builder, MATH_EVAL_OPCODE_FRAME, 1)->index = var->slot;
+      if (var->slot >= builder->frame_size) {
+        builder->frame_size = var->slot + 1;
+      }
+    } else {
+      program_emit(builder, MATH_EVAL_OPCODE_VARIABLE, 1)->variable =
+          var->variable;
+    }
+    return;
+  }
+
+  case MATH_EVAL_UNARY:
+    program_emit(builder, MATH_EVAL_OPCODE_NEGATE, 0);
+    break;
+
+  case MATH_EVAL_BINARY:
+    program_emit(builder,
+                 program_opcode_from_op(
+                     ast_cast(expr, struct math_eval_node_binary)->op),
+                 -1);
+    break;
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    struct math_eval_function *function = NULL;
+    if (builder->program) {
+      function = &builder->program->functions[builder->functions_count];
+      function->function = fun->function;
+      function->args_count = fun->args_count;
+      function->kernel = fun->kernel;
+      function->derivative = fun->derivative;
+    }
+
+    builder->functions_count += 1;
+    program_emit(builder, MATH_EVAL_OPCODE_CALL, 1 - fun->args_count)
+        ->function = function;
+    break;
+  }
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    assert(0 && "Program can not be nested");
+    return;
+  }
+
+  /* Leaves are as cheap to reload as a local, only keep computed values */
+  if (value->uses > 1) {
+    value->local = builder->locals_count++;
+    program_emit(builder, MATH_EVAL_OPCODE_STORE, 0)->index = value->local;
+  }
+}
+
+static void program_lower_roots(struct program_builder *builder,
+                                const int *roots, int roots_count,
+                                bool outputs) {
+  builder->instructions_count = 0;
+  builder->functions_count = 0;
+  builder->locals_count = 0;
+  builder->depth = 0;
+  builder->stack_size = 0;
+  builder->frame_size = 0;
+
+  for (int i = 0; i < builder->values_count; ++i) {
+    builder->values[i].local = -1;
+  }
+
+  for (int i = 0; i < roots_count; ++i) {
+    program_lower(builder, roots[i]);
+
+    if (outputs) {
+      program_emit(builder, MATH_EVAL_OPCODE_OUTPUT, -1)->index = i;
+    }
+  }
+
+  program_emit(builder, outputs ? MATH_EVAL_OPCODE_HALT
+                                : MATH_EVAL_OPCODE_RETURN,
+               0);
+}
+
+enum program_build_flags {
+  PROGRAM_BUILD_CSE = 0x1,
+  /* Each result is written by MATH_EVAL_OPCODE_OUTPUT instead of returned */
+  PROGRAM_BUILD_OUTPUTS = 0x2,
+  /* Nothing is built unless some computed value is used more than once */
+  PROGRAM_BUILD_SHARED_ONLY = 0x4,
+};
+
+static bool program_has_shared(const struct program_builder *builder) {
+  for (int i = 0; i < builder->values_count; ++i) {
+    const struct program_value *value = &builder->values[i];
+    if (value->uses > 1 && value->operands_count > 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static struct math_eval_program *
+program_build(const struct math_eval_expression *const *exprs, int count,
+              int flags) {
+  const bool outputs = flags & PROGRAM_BUILD_OUTPUTS;
+  assert(outputs || count == 1);
+
+  int nodes_count = 0;
+  for (int i = 0; i < count; ++i) {
+    nodes_count += program_count_nodes(exprs[i]);
+  }
+
+  size_t buckets_count = 16;
+  while (buckets_count < 2 * (size_t)nodes_count) {
+    buckets_count *= 2;
+  }
+
+  /* Values, operands, buckets and roots share one scratch allocation */
+  const size_t values_size = sizeof(struct program_value) * (size_t)nodes_count;
+  const size_t ints_count = (size_t)nodes_count + buckets_count + (size_t)count;
+
+  char *scratch = yu_calloc(1, values_size + sizeof(int) * ints_count);
+  if (!scratch) {
+    return NULL;
+  }
+
+  struct program_builder builder = {
+      .cse = flags & PROGRAM_BUILD_CSE,
+      .values = (struct program_value *)(void *)scratch,
+      .operands = (int *)(void *)(scratch + values_size),
+      .buckets_mask = buckets_count - 1,
+  };
+  builder.buckets = builder.operands + nodes_count;
+
+  int *roots = builder.buckets + buckets_count;
+  memset(builder.buckets, -1, buckets_count * sizeof(int));
+
+  for (int i = 0; i < count; ++i) {
+    roots[i] = program_number_value(&builder, exprs[i]);
+    builder.values[roots[i]].uses += 1;
+  }
+
+  struct math_eval_program *program = NULL;
+
+  if (!(flags & PROGRAM_BUILD_SHARED_ONLY) || program_has_shared(&builder)) {
+    program_lower_roots(&builder, roots, count, outputs);
+
+    /* Program, instructions and functions share one allocation */
+    const int instructions_count = builder.instructions_count;
+    const int functions_count = builder.functions_count;
+
+    size_t instructions_size =
+        sizeof(struct math_eval_instruction) * (size_t)instructions_count;
+    size_t functions_size =
+        sizeof(struct math_eval_function) * (size_t)functions_count;
+
+    program =
+        yu_calloc(1, sizeof(*program) + instructions_size + functions_size);
+    if (program) {
+      program->instructions_count = instructions_count;
+      program->functions_count = functions_count;
+      program->locals_count = builder.locals_count;
+      program->stack_size = builder.stack_size;
+      program->frame_size = builder.frame_size;
+      program->instructions =
+          (struct math_eval_instruction *)(void *)(program + 1);
+      program->functions =
+          (struct math_eval_function *)(void *)(program->instructions +
+                                                instructions_count);
+
+      builder.program = program;
+      program_lower_roots(&builder, roots, count, outputs);
+
+      assert(builder.instructions_count == instructions_count);
+      assert(builder.functions_count == functions_count);
+    }
+  }
+
+  yu_free(scratch);
+  return program;
+}
+
+struct math_eval_program *
+math_eval_program_create_ex(const struct math_eval_expression *expr,
+                            int flags) {
+  assert(expr != NULL);
+  return program_build(
+      &expr, 1, flags & MATH_EVAL_COMPILE_NO_CSE ? 0 : PROGRAM_BUILD_CSE);
+}
+
+struct math_eval_program *
+math_eval_program_create(const struct math_eval_expression *expr) {
+  return math_eval_program_create_ex(expr, MATH_EVAL_COMPILE_DEFAULT);
+}
+
+struct math_eval_program *
+math_eval_program_create_shared(const struct math_eval_expression *expr) {
+  assert(expr != NULL);
+  return program_build(&expr, 1,
+                       PROGRAM_BUILD_CSE | PROGRAM_BUILD_SHARED_ONLY);
+}
+
+struct math_eval_program *
+math_eval_program_create_fused(const struct math_eval_expression *const *exprs,
+                               int count) {
+  assert(exprs != NULL);
+  assert(count > 0);
+  return program_build(exprs, count, PROGRAM_BUILD_CSE | PROGRAM_BUILD_OUTPUTS);
+}
+
+void math_eval_program_destroy(struct math_eval_program *program) {
+  yu_free(program);
+}
+
+#ifdef MATH_EVAL_THREADED_DISPATCH
+#define VM_CASE(name) vm_##name
+#define VM_DISPATCH() goto *dispatch_table[ip->opcode]
+#else
+#define VM_CASE(name) case MATH_EVAL_OPCODE_##name
+#define VM_DISPATCH() goto dispatch
+#endif
+
+#define VM_NEXT()                                                              \
+  do {                                                                         \
+    ++ip;                                                                      \
+    VM_DISPATCH();                                                             \
+  } while (0)
+
+#define VM_BINARY(name, expression)                                            \
+  VM_CASE(name) : {                                                            \
+    const double right = *--sp;                                                \
+    const double left = sp[-1];                                                \
+                                                                               \
+    sp[-1] = (expression);                                                     \
+    VM_NEXT();                                                                 \
+  }
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+static double program_execute(const struct math_eval_program *program,
+                              const double *frame, double *out) {
+  double stack[program->stack_size];
+  double locals[program->locals_count > 0 ? program->locals_count : 1];
+  double *sp = stack;
+
+  const struct math_eval_instruction *ip = program->instructions;
+
+#ifdef MATH_EVAL_THREADED_DISPATCH
+  static const void *const dispatch_table[] = {
+      [MATH_EVAL_OPCODE_NUMBER] = &&vm_NUMBER,
+      [MATH_EVAL_OPCODE_VARIABLE] = &&vm_VARIABLE,
+      [MATH_EVAL_OPCODE_ADD] = &&vm_ADD,
+      [MATH_EVAL_OPCODE_SUB] = &&vm_SUB,
+      [MATH_EVAL_OPCODE_DIV] = &&vm_DIV,
+      [MATH_EVAL_OPCODE_MUL] = &&vm_MUL,
+      [MATH_EVAL_OPCODE_REM] = &&vm_REM,
+      [MATH_EVAL_OPCODE_EXP] = &&vm_EXP,
+      [MATH_EVAL_OPCODE_NEGATE] = &&vm_NEGATE,
+      [MATH_EVAL_OPCODE_CALL] = &&vm_CALL,
+      [MATH_EVAL_OPCODE_RETURN] = &&vm_RETURN,
+      [MATH_EVAL_OPCODE_LOAD] = &&vm_LOAD,
+      [MATH_EVAL_OPCODE_STORE] = &&vm_STORE,
+      [MATH_EVAL_OPCODE_OUTPUT] = &&vm_OUTPUT,
+      [MATH_EVAL_OPCODE_HALT] = &&vm_HALT,
+      [MATH_EVAL_OPCODE_FRAME] = &&vm_FRAME,
+  };
+
+  VM_DISPATCH();
+#else
+dispatch:
+  switch (ip->opcode)
+#endif
+  {
+    VM_CASE(NUMBER) : {
+      *sp++ = ip->number;
+      VM_NEXT();
+    }
+
+    VM_CASE(VARIABLE) : {
+      *sp++ = *ip->variable;
+      VM_NEXT();
+    }
+
+    VM_CASE(FRAME) : {
+      *sp++ = frame[ip->index];
+      VM_NEXT();
+    }
+
+    VM_BINARY(ADD, left + right)
+    VM_BINARY(SUB, left - right)
+    VM_BINARY(DIV, left / right)
+    VM_BINARY(MUL, left * right)
+    VM_BINARY(REM, fmod(left, right))
+    VM_BINARY(EXP, pow(left, right))
+
+    VM_CASE(NEGATE) : {
+      sp[-1] = -sp[-1];
+      VM_NEXT();
+    }
+
+    VM_CASE(CALL) : {
+      const struct math_eval_function *function = ip->function;
+
+      /* Arguments are already laid out on the stack in order */
+      sp -= function->args_count;
+      *sp = function->function(sp);
+      ++sp;
+      VM_NEXT();
+    }
+
+    VM_CASE(RETURN) : {
+      return sp[-1];
+    }
+
+    VM_CASE(LOAD) : {
+      *sp++ = locals[ip->index];
+      VM_NEXT();
+    }
+
+    VM_CASE(STORE) : {
+      locals[ip->index] = sp[-1];
+      VM_NEXT();
+    }
+
+    VM_CASE(OUTPUT) : {
+      out[ip->index] = *--sp;
+      VM_NEXT();
+    }
+
+    VM_CASE(HALT) : {
+      return NAN;
+    }
+  }
+
+  assert(0 && "Unreachable");
+  return NAN;
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+double math_eval_program_run(const struct math_eval_program *program) {
+  assert(program->frame_size == 0);
+  return program_execute(program, NULL, NULL);
+}
+
+double math_eval_program_run_frame(const struct math_eval_program *program,
+                                   const double *frame) {
+  assert(frame != NULL || program->frame_size == 0);
+  return program_execute(program, frame, NULL);
+}
+
+void math_eval_program_run_outputs(const struct math_eval_program *program,
+                                   double *out) {
+  assert(out != NULL);
+  program_execute(program, NULL, out);
+}
+
+void math_eval_program_stats(const struct math_eval_program *program,
+                             struct math_eval_expr_stats *stats) {
+  /* Same walk as the VM, with depths in place of values */
+  int stack[program->stack_size > 0 ? program->stack_size : 1];
+  int locals[program->locals_count > 0 ? program->locals_count : 1];
+  int *sp = stack;
+
+  *stats = (struct math_eval_expr_stats){0};
+
+  for (int i = 0; i < program->instructions_count; ++i) {
+    const struct math_eval_instruction *ip = &program->instructions[i];
+
+    switch (ip->opcode) {
+    case MATH_EVAL_OPCODE_NUMBER:
+    case MATH_EVAL_OPCODE_VARIABLE:
+    case MATH_EVAL_OPCODE_FRAME:
+      *sp++ = 0;
+      break;
+
+    case MATH_EVAL_OPCODE_ADD:
+    case MATH_EVAL_OPCODE_SUB:
+    case MATH_EVAL_OPCODE_DIV:
+    case MATH_EVAL_OPCODE_MUL:
+    case MATH_EVAL_OPCODE_REM:
+    case MATH_EVAL_OPCODE_EXP: {
+      const int right = *--sp;
+      sp[-1] = (sp[-1] > right ? sp[-1] : right) + 1;
+      stats->operations += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_NEGATE:
+      sp[-1] += 1;
+      stats->operations += 1;
+      break;
+
+    case MATH_EVAL_OPCODE_CALL: {
+      int depth = 0;
+      for (int j = 0; j < ip->function->args_count; ++j) {
+        const int arg = *--sp;
+        depth = arg > depth ? arg : depth;
+      }
+
+      *sp++ = depth + 1;
+      stats->operations += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_LOAD:
+      *sp++ = locals[ip->index];
+      break;
+
+    case MATH_EVAL_OPCODE_STORE:
+      locals[ip->index] = sp[-1];
+      break;
+
+    case MATH_EVAL_OPCODE_RETURN:
+    case MATH_EVAL_OPCODE_OUTPUT: {
+      const int depth = ip->opcode == MATH_EVAL_OPCODE_OUTPUT ? *--sp : sp[-1];
+      stats->depth = depth > stats->depth ? depth : stats->depth;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_HALT:
+      break;
+    }
+  }
+}
+
+static double math_eval_program_value(const struct math_eval_expression *expr) {
+  const struct math_eval_node_program *node =
+      ast_cast(expr, struct math_eval_node_program);
+
+  return math_eval_program_run(node->program);
+}
+
+/* Programs reading a frame are only evaluated by `math_eval_expr_frame` */
+static double
+math_eval_program_no_frame(const struct math_eval_expression *expr) {
+  (void)expr;
+  return NAN;
+}
+
+struct math_eval_expression *
+math_eval_program_node_create(struct math_eval_program *program) {
+  assert(program != NULL);
+
+  struct math_eval_node_program *node = yu_calloc(1, sizeof(*node));
+  if (!node) {
+    return NULL;
+  }
+
+  node->program = program;
+  node->node.type = MATH_EVAL_PROGRAM;
+  node->node.value = program->frame_size > 0 ? math_eval_program_no_frame
+                                             : math_eval_program_value;
+
+  return &node->node;
+}
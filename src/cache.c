@@ -0,0 +1,273 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "cache.h"
+
+struct cache_entry {
+  char *expression; /* Terminated copy of the key */
+  size_t length;
+  size_t hash;
+  struct math_eval_expression *expr;
+
+  int newer; /* Neighbours in order of use, -1 at both ends */
+  int older;
+  int next; /* Next entry of the same bucket */
+};
+
+/*
+ * Compiled expressions keyed by their text. Entries are chained in buckets of
+ * indices and kept in a list from the most to the least recently used, a full
+ * cache reuses the entry of the last one.
+ */
+struct math_eval_cache {
+  struct cache_entry *entries;
+  int entries_count;
+  int capacity;
+
+  int *buckets;
+  size_t buckets_mask;
+
+  int newest;
+  int oldest;
+
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct math_eval_cache *math_eval_cache_create(int capacity) {
+  assert(capacity > 0);
+
+  size_t buckets_count = 1;
+  while (buckets_count < (size_t)capacity * 2) {
+    buckets_count *= 2;
+  }
+
+  struct math_eval_cache *cache = yu_calloc(1, sizeof(*cache));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->capacity = capacity;
+  cache->buckets_mask = buckets_count - 1;
+  cache->entries = yu_calloc((size_t)capacity, sizeof(*cache->entries));
+  cache->buckets = yu_calloc(buckets_count, sizeof(*cache->buckets));
+
+  if (!cache->entries || !cache->buckets) {
+    math_eval_cache_destroy(cache);
+    return NULL;
+  }
+
+  math_eval_cache_clear(cache);
+  return cache;
+}
+
+void math_eval_cache_destroy(struct math_eval_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  if (cache->entries && cache->buckets) {
+    math_eval_cache_clear(cache);
+  }
+
+  yu_free(cache->buckets);
+  yu_free(cache->entries);
+  yu_free(cache);
+}
+
+void math_eval_cache_clear(struct math_eval_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  for (int i = 0; i < cache->entries_count; ++i) {
+    math_eval_expr_destroy(cache->entries[i].expr);
+    yu_free(cache->entries[i].expression);
+  }
+
+  for (size_t i = 0; i <= cache->buckets_mask; ++i) {
+    cache->buckets[i] = -1;
+  }
+
+  cache->entries_count = 0;
+  cache->newest = -1;
+  cache->oldest = -1;
+}
+
+static void cache_unlink(struct math_eval_cache *cache, int index) {
+  struct cache_entry *entry = &cache->entries[index];
+
+  if (entry->newer >= 0) {
+    cache->entries[entry->newer].older = entry->older;
+  } else {
+    cache->newest = entry->older;
+  }
+
+  if (entry->older >= 0) {
+    cache->entries[entry->older].newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+}
+
+static void cache_push(struct math_eval_cache *cache, int index) {
+  struct cache_entry *entry = &cache->entries[index];
+
+  entry->newer = -1;
+  entry->older = cache->newest;
+
+  if (cache->newest >= 0) {
+    cache->entries[cache->newest].newer = index;
+  } else {
+    cache->oldest = index;
+  }
+  cache->newest = index;
+}
+
+/* Removes the least recently used entry, returns its index */
+static int cache_evict(struct math_eval_cache *cache) {
+  const int index = cache->oldest;
+  struct cache_entry *entry = &cache->entries[index];
+
+  int *link = &cache->buckets[entry->hash & cache->buckets_mask];
+  while (*link != index) {
+    link = &cache->entries[*link].next;
+  }
+  *link = entry->next;
+
+  cache_unlink(cache, index);
+
+  math_eval_expr_destroy(entry->expr);
+  yu_free(entry->expression);
+  return index;
+}
+
+/* FNV-1a, keys aren't terminated */
+static size_t cache_hash(const char *expression, size_t len) {
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)expression[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+
+  return (size_t)hash;
+}
+
+const struct math_eval_expression *
+math_eval_cache_find(struct math_eval_cache *cache, const char *expression,
+                     size_t len) {
+  assert(cache != NULL);
+  assert(expression != NULL || len == 0);
+
+  const size_t hash = cache_hash(expression, len);
+
+  int index = cache->buckets[hash & cache->buckets_mask];
+  for (; index >= 0; index = cache->entries[index].next) {
+    const struct cache_entry *entry = &cache->entries[index];
+    if (entry->hash == hash && entry->length == len &&
+        memcmp(entry->expression, expression, len) == 0) {
+      break;
+    }
+  }
+
+  if (index < 0) {
+    cache->misses += 1;
+    return NULL;
+  }
+
+  cache->hits += 1;
+  if (index != cache->newest) {
+    cache_unlink(cache, index);
+    cache_push(cache, index);
+  }
+
+  return cache->entries[index].expr;
+}
+
+bool math_eval_cache_insert(struct math_eval_cache *cache,
+                            const char *expression, size_t len,
+                            struct math_eval_expression *expr) {
+  assert(cache != NULL);
+  assert(expression != NULL || len == 0);
+  assert(expr != NULL);
+
+  char *copy = yu_calloc(len + 1, sizeof(*copy));
+  if (!copy) {
+    return false;
+  }
+
+  memcpy(copy, expression, len);
+
+  const int index = cache->entries_count < cache->capacity
+                        ? cache->entries_count++
+                        : cache_evict(cache);
+
+  struct cache_entry *entry = &cache->entries[index];
+  entry->expression = copy;
+  entry->length = len;
+  entry->hash = cache_hash(expression, len);
+  entry->expr = expr;
+
+  int *bucket = &cache->buckets[entry->hash & cache->buckets_mask];
+  entry->next = *bucket;
+  *bucket = index;
+
+  cache_push(cache, index);
+  return true;
+}
+
+bool symbol_table_cache_enable(struct symbol_table *table, int capacity) {
+  assert(table != NULL);
+  assert(capacity >= 0);
+
+  /* Shared between threads */
+  if (table->read_only) {
+    return false;
+  }
+
+  /* Writable parents would change without dropping cached expressions */
+  for (const struct symbol_table *parent = table->parent; parent;
+       parent = parent->parent) {
+    if (!parent->read_only) {
+      return false;
+    }
+  }
+
+  struct math_eval_cache *cache = NULL;
+  if (capacity > 0) {
+    cache = math_eval_cache_create(capacity);
+    if (!cache) {
+      return false;
+    }
+  }
+
+  math_eval_cache_destroy(table->cache);
+  table->cache = cache;
+  return true;
+}
+
+void symbol_table_cache_clear(struct symbol_table *table) {
+  assert(table != NULL);
+
+  math_eval_cache_clear(table->cache);
+}
+
+struct math_eval_cache_stats
+symbol_table_cache_stats(const struct symbol_table *table) {
+  assert(table != NULL);
+
+  const struct math_eval_cache *cache = table->cache;
+  if (!cache) {
+    return (struct math_eval_cache_stats){0};
+  }
+
+  return (struct math_eval_cache_stats){
+      .hits = cache->hits,
+      .misses = cache->misses,
+      .size = cache->entries_count,
+      .capacity = cache->capacity,
+  };
+}
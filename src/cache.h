@@ -0,0 +1,26 @@
+#ifndef MATH_EVAL_CACHE_H
+#define MATH_EVAL_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "math_eval/evaluator.h"
+#include "math_eval/symbol_table.h"
+
+struct math_eval_cache *math_eval_cache_create(int capacity);
+void math_eval_cache_destroy(struct math_eval_cache *cache);
+
+/* Destroys every cached expression, counters are kept */
+void math_eval_cache_clear(struct math_eval_cache *cache);
+
+/* Compiled `expression` or NULL, a hit makes it the most recently used */
+const struct math_eval_expression *
+math_eval_cache_find(struct math_eval_cache *cache, const char *expression,
+                     size_t len);
+
+/* Takes `expr` over on success, evicting the least recently used one if full */
+bool math_eval_cache_insert(struct math_eval_cache *cache,
+                            const char *expression, size_t len,
+                            struct math_eval_expression *expr);
+
+#endif /* !MATH_EVAL_CACHE_H */
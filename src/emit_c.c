@@ -0,0 +1,404 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/bytecode.h"
+#include "math_eval/emit_c.h"
+#include "math_eval/incremental.h"
+#include "math_eval/jit.h"
+#include "math_eval/log.h"
+#include "math_eval/parser.h"
+
+#include "builtins.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MATH_EVAL_SHARED_OBJECTS
+#include <dlfcn.h>
+#endif
+
+#define STRINGIFY(...) #__VA_ARGS__
+#define EXPAND_STRINGIFY(...) STRINGIFY(__VA_ARGS__)
+
+#define BUILTIN_SOURCE(name, args_count, expression, kernel, derivative)       \
+  "static inline double math_eval_builtin_" #name "(const double *args) {\n"   \
+  "  return " #expression ";\n"                                                \
+  "}\n\n"
+
+/* Same definitions the symbol table is built from */
+static const char builtins_source[] =
+    EXPAND_STRINGIFY(MATH_EVAL_BUILTIN_HELPERS) "\n\n" MATH_EVAL_BUILTINS(
+        BUILTIN_SOURCE);
+
+#define EMIT_C_STRUCT_NAME "math_eval_variables"
+
+/* Optimizer must not contract or reorder, results have to match the library */
+#define EMIT_C_COMPILER_FLAGS "-O2 -fPIC -shared -ffp-contract=off"
+
+struct emit_c_state {
+  FILE *out;
+  const struct math_eval_emit_c_options *options;
+
+  int *stack; /* Instruction index of every value on the stack */
+  int depth;
+
+  int *locals; /* Instruction index of the value in every local */
+};
+
+static const char *emit_c_variable_name(const struct emit_c_state *state,
+                                        const double *variable) {
+  for (int i = 0; i < state->options->variables_count; ++i) {
+    const struct math_eval_c_variable *var = &state->options->variables[i];
+    if (&var->variable->value == variable) {
+      return var->name;
+    }
+  }
+
+  return NULL;
+}
+
+static void emit_c_number(FILE *out, double value) {
+  if (isnan(value)) {
+    fprintf(out, "NAN");
+  } else if (isinf(value)) {
+    fprintf(out, value < 0 ? "-INFINITY" : "INFINITY");
+  } else {
+    /* Hexadecimal literals are exact */
+    fprintf(out, "%a", value);
+  }
+}
+
+static bool emit_c_instruction(struct emit_c_state *state, int index,
+                               const struct math_eval_instruction *ip) {
+  FILE *out = state->out;
+
+  switch (ip->opcode) {
+  case MATH_EVAL_OPCODE_NUMBER:
+    fprintf(out, "  const double t%d = ", index);
+    emit_c_number(out, ip->number);
+    fprintf(out, ";\n");
+    break;
+
+  case MATH_EVAL_OPCODE_VARIABLE: {
+    const char *name = emit_c_variable_name(state, ip->variable);
+    if (!name) {
+      MATH_EVAL_LOG_ERROR("Variable is not bound to a C name");
+      return false;
+    }
+
+    if (state->options->style == MATH_EVAL_EMIT_C_STRUCT) {
+      fprintf(out, "  const double t%d = variables->%s;\n", index, name);
+    } else {
+      fprintf(out, "  const double t%d = %s;\n", index, name);
+    }
+    break;
+  }
+
+  case MATH_EVAL_OPCODE_ADD:
+  case MATH_EVAL_OPCODE_SUB:
+  case MATH_EVAL_OPCODE_DIV:
+  case MATH_EVAL_OPCODE_MUL: {
+    static const char operators[] = {
+        [MATH_EVAL_OPCODE_ADD] = '+',
+        [MATH_EVAL_OPCODE_SUB] = '-',
+        [MATH_EVAL_OPCODE_DIV] = '/',
+        [MATH_EVAL_OPCODE_MUL] = '*',
+    };
+
+    state->depth -= 2;
+    fprintf(out, "  const double t%d = t%d %c t%d;\n", index,
+            state->stack[state->depth], operators[ip->opcode],
+            state->stack[state->depth + 1]);
+    break;
+  }
+
+  case MATH_EVAL_OPCODE_REM:
+  case MATH_EVAL_OPCODE_EXP:
+    state->depth -= 2;
+    fprintf(out, "  const double t%d = %s(t%d, t%d);\n", index,
+            ip->opcode == MATH_EVAL_OPCODE_REM ? "fmod" : "pow",
+            state->stack[state->depth], state->stack[state->depth + 1]);
+    break;
+
+  case MATH_EVAL_OPCODE_NEGATE:
+    state->depth -= 1;
+    fprintf(out, "  const double t%d = -t%d;\n", index,
+            state->stack[state->depth]);
+    break;
+
+  case MATH_EVAL_OPCODE_CALL: {
+    const char *name = math_eval_builtin_name(ip->function->function);
+    if (!name) {
+      MATH_EVAL_LOG_ERROR("Only builtin functions can be emitted as C");
+      return false;
+    }
+
+    const int args_count = ip->function->args_count;
+    state->depth -= args_count;
+
+    fprintf(out, "  const double t%d = math_eval_builtin_%s((const double[]){",
+            index, name);
+    for (int i = 0; i < args_count; ++i) {
+      fprintf(out, i == 0 ? "t%d" : ", t%d", state->stack[state->depth + i]);
+    }
+    fprintf(out, args_count == 0 ? "0});\n" : "});\n");
+    break;
+  }
+
+  /* Locals are only names for temporaries that already exist */
+  case MATH_EVAL_OPCODE_LOAD:
+    state->stack[state->depth++] = state->locals[ip->index];
+    return true;
+
+  case MATH_EVAL_OPCODE_STORE:
+    state->locals[ip->index] = state->stack[state->depth - 1];
+    return true;
+
+  case MATH_EVAL_OPCODE_RETURN:
+    fprintf(out, "  return t%d;\n", state->stack[state->depth - 1]);
+    return true;
+
+  case MATH_EVAL_OPCODE_OUTPUT:
+  case MATH_EVAL_OPCODE_HALT:
+    assert(0 && "Generated functions return a single result");
+    return false;
+
+  case MATH_EVAL_OPCODE_FRAME:
+    MATH_EVAL_LOG_ERROR("Frame slots can not be emitted as C");
+    return false;
+  }
+
+  state->stack[state->depth++] = index;
+  return true;
+}
+
+bool math_eval_emit_c_prelude(FILE *out,
+                              const struct math_eval_emit_c_options *options) {
+  assert(out != NULL);
+  assert(options != NULL);
+
+  fprintf(out, "/* Generated by math-eval */\n\n");
+  fprintf(out, "#include <math.h>\n#include <stddef.h>\n\n");
+
+  if (options->style == MATH_EVAL_EMIT_C_STRUCT) {
+    fprintf(out, "struct " EMIT_C_STRUCT_NAME " {\n");
+    for (int i = 0; i < options->variables_count; ++i) {
+      fprintf(out, "  double %s;\n", options->variables[i].name);
+    }
+
+    /* Empty structs are not valid C */
+    if (options->variables_count == 0) {
+      fprintf(out, "  double unused;\n");
+    }
+    fprintf(out, "};\n\n");
+  }
+
+  fprintf(out, "%s", builtins_source);
+  return !ferror(out);
+}
+
+bool math_eval_emit_c(FILE *out, const char *name,
+                      const struct math_eval_expression *expr,
+                      const struct math_eval_emit_c_options *options) {
+  assert(out != NULL);
+  assert(name != NULL);
+  assert(expr != NULL);
+  assert(options != NULL);
+
+  /* Tree expressions are lowered, emitting one temporary per instruction */
+  struct math_eval_program *lowered = NULL;
+  const struct math_eval_program *program;
+
+  if (expr->type == MATH_EVAL_PROGRAM) {
+    program = ast_cast(expr, struct math_eval_node_program)->program;
+  } else if (expr->type == MATH_EVAL_NATIVE) {
+    program = ast_cast(expr, struct math_eval_node_native)->program;
+  } else {
+    if (expr->type == MATH_EVAL_INCREMENTAL) {
+      expr = ast_cast(expr, struct math_eval_node_incremental)->tree;
+    }
+
+    lowered = math_eval_program_create(expr);
+    if (!lowered) {
+      return false;
+    }
+
+    program = lowered;
+  }
+
+  struct emit_c_state state = {
+      .out = out,
+      .options = options,
+      .stack = yu_calloc((size_t)program->stack_size, sizeof(int)),
+      .locals = yu_calloc((size_t)program->locals_count + 1, sizeof(int)),
+  };
+
+  bool ok = state.stack && state.locals;
+  if (ok) {
+    if (options->style == MATH_EVAL_EMIT_C_STRUCT) {
+      fprintf(out, "double %s(const struct " EMIT_C_STRUCT_NAME
+                   " *variables) {\n",
+              name);
+    } else {
+      fprintf(out, "double %s(", name);
+      for (int i = 0; i < options->variables_count; ++i) {
+        fprintf(out, i == 0 ? "double %s" : ", double %s",
+                options->variables[i].name);
+      }
+      fprintf(out, options->variables_count == 0 ? "void) {\n" : ") {\n");
+    }
+
+    for (int i = 0; ok && i < program->instructions_count; ++i) {
+      ok = emit_c_instruction(&state, i, &program->instructions[i]);
+    }
+
+    fprintf(out, "}\n\n");
+  }
+
+  yu_free(state.locals);
+  yu_free(state.stack);
+  math_eval_program_destroy(lowered);
+
+  return ok && !ferror(out);
+}
+
+#ifdef MATH_EVAL_SHARED_OBJECTS
+
+struct math_eval_shared_object {
+  void *handle;
+};
+
+static bool shared_object_write_source(
+    const char *source, const struct math_eval_formula *formulas,
+    int formulas_count, const struct math_eval_emit_c_options *options) {
+  FILE *out = fopen(source, "w");
+  if (!out) {
+    MATH_EVAL_LOG_ERROR("Failed to open '%s'", source);
+    return false;
+  }
+
+  bool ok = math_eval_emit_c_prelude(out, options);
+  for (int i = 0; ok && i < formulas_count; ++i) {
+    ok = math_eval_emit_c(out, formulas[i].name, formulas[i].expr, options);
+  }
+
+  return fclose(out) == 0 && ok;
+}
+
+struct math_eval_shared_object *
+math_eval_shared_object_build(const char *path,
+                              const struct math_eval_formula *formulas,
+                              int formulas_count,
+                              const struct math_eval_emit_c_options *options) {
+  assert(path != NULL);
+  assert(formulas != NULL || formulas_count == 0);
+
+  const char *compiler = getenv("CC");
+  if (!compiler || *compiler == '\0') {
+    compiler = "cc";
+  }
+
+  const size_t path_size = strlen(path);
+  const size_t command_size =
+      strlen(compiler) + sizeof(EMIT_C_COMPILER_FLAGS) + 2 * path_size + 32;
+
+  char *source = yu_calloc(path_size + sizeof(".c"), 1);
+  char *command = yu_calloc(command_size, 1);
+
+  bool ok = source && command;
+  if (ok) {
+    snprintf(source, path_size + sizeof(".c"), "%s.c", path);
+    snprintf(command, command_size,
+             "%s " EMIT_C_COMPILER_FLAGS " -o \"%s\" \"%s\" -lm", compiler,
+             path, source);
+
+    ok = shared_object_write_source(source, formulas, formulas_count, options);
+  }
+
+  if (ok && system(command) != 0) {
+    MATH_EVAL_LOG_ERROR("Failed to compile '%s'", source);
+    ok = false;
+  }
+
+  yu_free(command);
+  yu_free(source);
+
+  return ok ? math_eval_shared_object_open(path) : NULL;
+}
+
+struct math_eval_shared_object *math_eval_shared_object_open(const char *path) {
+  assert(path != NULL);
+
+  struct math_eval_shared_object *object = yu_calloc(1, sizeof(*object));
+  if (!object) {
+    return NULL;
+  }
+
+  object->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!object->handle) {
+    MATH_EVAL_LOG_ERROR("Failed to load '%s': %s", path, dlerror());
+    yu_free(object);
+    return NULL;
+  }
+
+  return object;
+}
+
+void math_eval_shared_object_close(struct math_eval_shared_object *object) {
+  if (object) {
+    dlclose(object->handle);
+    yu_free(object);
+  }
+}
+
+math_eval_native_fun
+math_eval_shared_object_function(struct math_eval_shared_object *object,
+                                 const char *name) {
+  assert(object != NULL);
+  assert(name != NULL);
+
+  void *symbol = dlsym(object->handle, name);
+
+  /* POSIX guarantees data and function pointers convert losslessly */
+  math_eval_native_fun function = NULL;
+  memcpy(&function, &symbol, sizeof(function));
+
+  return function;
+}
+
+#else
+
+struct math_eval_shared_object *
+math_eval_shared_object_build(const char *path,
+                              const struct math_eval_formula *formulas,
+                              int formulas_count,
+                              const struct math_eval_emit_c_options *options) {
+  (void)path;
+  (void)formulas;
+  (void)formulas_count;
+  (void)options;
+
+  MATH_EVAL_LOG_ERROR("Shared objects are not supported on this platform");
+  return NULL;
+}
+
+struct math_eval_shared_object *math_eval_shared_object_open(const char *path) {
+  (void)path;
+  return NULL;
+}
+
+void math_eval_shared_object_close(struct math_eval_shared_object *object) {
+  (void)object;
+}
+
+math_eval_native_fun
+math_eval_shared_object_function(struct math_eval_shared_object *object,
+                                 const char *name) {
+  (void)object;
+  (void)name;
+  return NULL;
+}
+
+#endif /* MATH_EVAL_SHARED_OBJECTS */
@@ -0,0 +1,89 @@
+#include <assert.h>
+
+#include "datastructs/memory.h"
+
+#include "epoch.h"
+
+bool math_eval_epoch_init(struct math_eval_epoch *epoch, int readers_count,
+                          void (*destroy)(struct math_eval_retired *)) {
+  assert(readers_count > 0);
+  assert(destroy != NULL);
+
+  atomic_init(&epoch->epoch, 0);
+  epoch->readers_count = readers_count;
+  epoch->retired = NULL;
+  epoch->destroy = destroy;
+
+  epoch->readers = yu_calloc((size_t)readers_count, sizeof(*epoch->readers));
+  if (!epoch->readers) {
+    return false;
+  }
+
+  for (int i = 0; i < readers_count; ++i) {
+    atomic_init(&epoch->readers[i].epoch, MATH_EVAL_EPOCH_IDLE);
+  }
+
+  return true;
+}
+
+void math_eval_epoch_destroy(struct math_eval_epoch *epoch) {
+  while (epoch->retired) {
+    struct math_eval_retired *retired = epoch->retired;
+    epoch->retired = retired->next;
+    epoch->destroy(retired);
+  }
+
+  yu_free(epoch->readers);
+  epoch->readers = NULL;
+}
+
+/* Moves the epoch on when possible and destroys what no reader can hold */
+static void epoch_reclaim(struct math_eval_epoch *epoch) {
+  atomic_thread_fence(memory_order_seq_cst);
+
+  uint64_t current = atomic_load_explicit(&epoch->epoch, memory_order_relaxed);
+
+  bool quiescent = true;
+  for (int i = 0; quiescent && i < epoch->readers_count; ++i) {
+    const uint64_t seen =
+        atomic_load_explicit(&epoch->readers[i].epoch, memory_order_acquire);
+    quiescent = seen == MATH_EVAL_EPOCH_IDLE || seen == current;
+  }
+
+  if (quiescent) {
+    current += 1;
+    atomic_store_explicit(&epoch->epoch, current, memory_order_relaxed);
+  }
+
+  struct math_eval_retired **link = &epoch->retired;
+  while (*link) {
+    struct math_eval_retired *retired = *link;
+
+    if (retired->epoch + 2 <= current) {
+      *link = retired->next;
+      epoch->destroy(retired);
+    } else {
+      link = &retired->next;
+    }
+  }
+}
+
+void math_eval_epoch_retire(struct math_eval_epoch *epoch,
+                            struct math_eval_retired *retired) {
+  /* Unreachable before the epoch is read, pairs with `math_eval_epoch_enter` */
+  atomic_thread_fence(memory_order_seq_cst);
+  const uint64_t current =
+      atomic_load_explicit(&epoch->epoch, memory_order_relaxed);
+
+  while (retired) {
+    struct math_eval_retired *next = retired->next;
+
+    retired->epoch = current;
+    retired->next = epoch->retired;
+    epoch->retired = retired;
+
+    retired = next;
+  }
+
+  epoch_reclaim(epoch);
+}
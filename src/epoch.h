@@ -0,0 +1,79 @@
+#ifndef MATH_EVAL_EPOCH_H
+#define MATH_EVAL_EPOCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Epoch of a reader holding nothing */
+#define MATH_EVAL_EPOCH_IDLE UINT64_MAX
+
+/* Embedded in whatever is retired */
+struct math_eval_retired {
+  struct math_eval_retired *next;
+  uint64_t epoch;
+};
+
+/* Padded to a cache line, only its own thread writes to it */
+struct math_eval_epoch_reader {
+  _Atomic uint64_t epoch;
+
+  char padding[64 - sizeof(uint64_t)];
+};
+
+/*
+ * Epoch based reclamation for structures read without locks. Readers enter
+ * before reading anything that can be retired and leave once done with it.
+ * Retired objects are destroyed two epochs later. The epoch only moves on when
+ * every reader inside entered during the current one, so no reader can still
+ * hold an object by then.
+ *
+ * Retiring, and so reclaiming, has to be serialized by the caller.
+ */
+struct math_eval_epoch {
+  _Atomic uint64_t epoch;
+
+  struct math_eval_epoch_reader *readers;
+  int readers_count;
+
+  struct math_eval_retired *retired;
+  void (*destroy)(struct math_eval_retired *retired);
+};
+
+bool math_eval_epoch_init(struct math_eval_epoch *epoch, int readers_count,
+                          void (*destroy)(struct math_eval_retired *));
+
+/* Destroys everything retired, no reader may be inside */
+void math_eval_epoch_destroy(struct math_eval_epoch *epoch);
+
+/*
+ * Retires `retired` and the objects chained after it, already unreachable for
+ * readers that enter from now on, then destroys what no reader can hold.
+ */
+void math_eval_epoch_retire(struct math_eval_epoch *epoch,
+                            struct math_eval_retired *retired);
+
+static inline void math_eval_epoch_enter(struct math_eval_epoch *epoch,
+                                         int reader) {
+  atomic_store_explicit(
+      &epoch->readers[reader].epoch,
+      atomic_load_explicit(&epoch->epoch, memory_order_relaxed),
+      memory_order_relaxed);
+
+  /* Announced before anything is read, pairs with `math_eval_epoch_retire` */
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void math_eval_epoch_leave(struct math_eval_epoch *epoch,
+                                         int reader) {
+  atomic_store_explicit(&epoch->readers[reader].epoch, MATH_EVAL_EPOCH_IDLE,
+                        memory_order_release);
+}
+
+static inline bool math_eval_epoch_inside(const struct math_eval_epoch *epoch,
+                                          int reader) {
+  return atomic_load_explicit(&epoch->readers[reader].epoch,
+                              memory_order_relaxed) != MATH_EVAL_EPOCH_IDLE;
+}
+
+#endif /* !MATH_EVAL_EPOCH_H */
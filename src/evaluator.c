@@ -5,12 +5,21 @@
 
 #include "datastructs/memory.h"
 
+#include "math_eval/bytecode.h"
 #include "math_eval/evaluator.h"
+#include "math_eval/incremental.h"
+#include "math_eval/jit.h"
+#include "math_eval/kernels.h"
 #include "math_eval/log.h"
 #include "math_eval/parser.h"
 #include "math_eval/symbol_table.h"
 
-inline enum math_eval_arithmetic_operation
+#include "builtins.h"
+#include "cache.h"
+#include "float_compare.h"
+#include "one_shot.h"
+
+static inline enum math_eval_arithmetic_operation
 ast_op_to_arithmetic_op(const char op) {
   switch (op) {
   case '+':
@@ -34,8 +43,10 @@ ast_op_to_arithmetic_op(const char op) {
 #define MATH_EVAL_BINARY_FUN                                                   \
   const struct math_eval_node_binary *binary =                                 \
       ast_cast(expr, struct math_eval_node_binary);                            \
-  const struct math_eval_expression *left = binary->left;                      \
-  const struct math_eval_expression *right = binary->right
+  const struct math_eval_expression *left =                                    \
+      math_eval_expr_at(expr, binary->left);                                   \
+  const struct math_eval_expression *right =                                   \
+      math_eval_expr_at(expr, binary->right)
 
 static inline double
 math_eval_binary_add(const struct math_eval_expression *expr) {
@@ -111,8 +122,10 @@ math_eval_unary_value(const struct math_eval_expression *expr) {
   const struct math_eval_node_unary *unary =
       ast_cast(expr, struct math_eval_node_unary);
 
-  const double arg = unary->arg->value(unary->arg);
-  return unary->op == MATH_EVAL_UNARY_MINUS ? -arg : arg;
+  const struct math_eval_expression *arg = math_eval_expr_at(expr, unary->arg);
+
+  const double value = arg->value(arg);
+  return unary->op == MATH_EVAL_UNARY_MINUS ? -value : value;
 }
 
 static inline double
@@ -122,7 +135,8 @@ math_eval_function_value(const struct math_eval_expression *expr) {
 
   double args[fun->args_count];
   for (int i = 0; i < fun->args_count; ++i) {
-    const struct math_eval_expression *arg = fun->args[i];
+    const struct math_eval_expression *arg =
+        math_eval_expr_at(expr, fun->args[i]);
 
     args[i] = arg->value(arg);
   }
@@ -149,17 +163,78 @@ math_eval_evaluate_binary(enum math_eval_arithmetic_operation op, double left,
   }
 }
 
-static inline struct math_eval_expression *
-math_eval_number_create(double value) {
-  struct math_eval_node_number *number = yu_calloc(1, sizeof(*number));
-  if (!number) {
-    return NULL;
+/* Compiled tree under construction, nodes are addressed by their offsets */
+struct expr_arena {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+#define EXPR_ARENA_ALIGNMENT sizeof(double)
+#define EXPR_ARENA_INITIAL_CAPACITY 256
+
+static inline void *expr_arena_at(const struct expr_arena *arena,
+                                  int32_t offset) {
+  return arena->data + offset;
+}
+
+/* Returns offset of `size` zeroed bytes, -1 on failure */
+static int32_t expr_arena_allocate(struct expr_arena *arena, size_t size) {
+  size = (size + EXPR_ARENA_ALIGNMENT - 1) & ~(EXPR_ARENA_ALIGNMENT - 1);
+
+  if (arena->size + size > INT32_MAX) {
+    return -1;
   }
 
+  if (arena->size + size > arena->capacity) {
+    size_t capacity = arena->capacity ? arena->capacity * 2
+                                      : EXPR_ARENA_INITIAL_CAPACITY;
+    while (capacity < arena->size + size) {
+      capacity *= 2;
+    }
+
+    /* Custom allocators have no reallocate, see `math_eval_init` */
+    char *data = yu_calloc(1, capacity);
+    if (!data) {
+      return -1;
+    }
+
+    if (arena->data) {
+      memcpy(data, arena->data, arena->size);
+      yu_free(arena->data);
+    }
+
+    arena->data = data;
+    arena->capacity = capacity;
+  }
+
+  const int32_t offset = (int32_t)arena->size;
+  memset(arena->data + offset, 0, size);
+
+  arena->size += size;
+  return offset;
+}
+
+static int32_t math_eval_number_create(struct expr_arena *arena,
+                                       double value) {
+  const int32_t offset =
+      expr_arena_allocate(arena, sizeof(struct math_eval_node_number));
+  if (offset < 0) {
+    return -1;
+  }
+
+  struct math_eval_node_number *number = expr_arena_at(arena, offset);
   number->value = value;
   number->node.type = MATH_EVAL_NUMBER;
   number->node.value = math_eval_number_value;
-  return &number->node;
+  return offset;
+}
+
+/* Replaces the subtree at `offset` and everything after it with a number */
+static inline int32_t math_eval_fold(struct expr_arena *arena, int32_t offset,
+                                     double value) {
+  arena->size = (size_t)offset;
+  return math_eval_number_create(arena, value);
 }
 
 #define EXPR_VALUE_BUFFER(buffer, ast)                                         \
@@ -175,98 +250,452 @@ static inline void math_eval_set_error(struct math_eval_error *error,
   error->size = ast->size;
 }
 
-static struct math_eval_expression *
-ast_construct_expression_tree(struct ast_node *ast, const char *expression,
+/* Moves the subtree at `from`, which ends the arena, down to `offset` */
+static int32_t expr_arena_move(struct expr_arena *arena, int32_t offset,
+                               int32_t from) {
+  memmove(arena->data + offset, arena->data + from,
+          arena->size - (size_t)from);
+  arena->size -= (size_t)(from - offset);
+  return offset;
+}
+
+/* Appends a copy of a subtree, relative offsets keep it valid anywhere */
+static int32_t expr_arena_append(struct expr_arena *arena, const char *nodes,
+                                 size_t size) {
+  const int32_t offset = expr_arena_allocate(arena, size);
+  if (offset >= 0) {
+    memcpy(arena->data + offset, nodes, size);
+  }
+
+  return offset;
+}
+
+static void math_eval_binary_init(struct expr_arena *arena, int32_t offset,
+                                  enum math_eval_arithmetic_operation op,
+                                  int32_t left, int32_t right) {
+  struct math_eval_node_binary *binary = expr_arena_at(arena, offset);
+
+  binary->op = op;
+  binary->left = left - offset;
+  binary->right = right - offset;
+
+  binary->node.type = MATH_EVAL_BINARY;
+  binary->node.value = math_eval_binary_value_from_op(op);
+}
+
+/* Largest |n| of `x ^ n` expanded into multiplications under fast math */
+#define MATH_EVAL_MAX_EXPANDED_POWER 16
+
+/* Appends `base ^ exponent`, halves of even powers are squared */
+static int32_t math_eval_power_create(struct expr_arena *arena,
+                                      const char *base, size_t base_size,
+                                      unsigned exponent) {
+  assert(exponent > 0);
+
+  if (exponent == 1) {
+    return expr_arena_append(arena, base, base_size);
+  }
+
+  const int32_t offset =
+      expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+  if (offset < 0) {
+    return -1;
+  }
+
+  const unsigned left_exponent = exponent % 2 ? exponent - 1 : exponent / 2;
+
+  const int32_t left =
+      math_eval_power_create(arena, base, base_size, left_exponent);
+  if (left < 0) {
+    return -1;
+  }
+
+  const int32_t right = math_eval_power_create(arena, base, base_size,
+                                               exponent - left_exponent);
+  if (right < 0) {
+    return -1;
+  }
+
+  math_eval_binary_init(arena, offset, MATH_EVAL_OP_MUL, left, right);
+  return offset;
+}
+
+static int32_t math_eval_sqrt_create(struct expr_arena *arena,
+                                     const char *base, size_t base_size) {
+  struct math_eval_function sqrt_fn;
+  if (!math_eval_builtin_find("sqrt", &sqrt_fn)) {
+    return -1;
+  }
+
+  const int32_t offset = expr_arena_allocate(
+      arena, sizeof(struct math_eval_node_function) + sizeof(int32_t));
+  if (offset < 0) {
+    return -1;
+  }
+
+  const int32_t arg = expr_arena_append(arena, base, base_size);
+  if (arg < 0) {
+    return -1;
+  }
+
+  struct math_eval_node_function *fun = expr_arena_at(arena, offset);
+
+  fun->function = sqrt_fn.function;
+  fun->kernel = sqrt_fn.kernel;
+  fun->derivative = sqrt_fn.derivative;
+  fun->args_count = 1;
+  fun->args[0] = arg - offset;
+  fun->node.type = MATH_EVAL_FUNCTION;
+  fun->node.value = math_eval_function_value;
+
+  return offset;
+}
+
+static int32_t math_eval_power_expand_positive(struct expr_arena *arena,
+                                               const char *base,
+                                               size_t base_size,
+                                               double exponent) {
+  if (math_eval_float_equal(exponent, 0.5)) {
+    return math_eval_sqrt_create(arena, base, base_size);
+  }
+
+  return math_eval_power_create(arena, base, base_size, (unsigned)exponent);
+}
+
+/*
+ * Replaces everything from `offset` with `base ^ exponent`. Integer powers
+ * become multiplications and a half power becomes a square root.
+ */
+static int32_t math_eval_power_expand(struct expr_arena *arena, int32_t offset,
+                                      int32_t base, int32_t base_end,
+                                      double exponent) {
+  /* Base is copied out, the rewritten tree takes its place */
+  const size_t base_size = (size_t)(base_end - base);
+  char *nodes = yu_calloc(1, base_size);
+  if (!nodes) {
+    return -1;
+  }
+
+  memcpy(nodes, arena->data + base, base_size);
+  arena->size = (size_t)offset;
+
+  int32_t result;
+  if (exponent < 0) {
+    /* 1 / base ^ -exponent */
+    result = expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+
+    const int32_t one = result < 0 ? -1 : math_eval_number_create(arena, 1);
+    const int32_t power =
+        one < 0 ? -1
+                : math_eval_power_expand_positive(arena, nodes, base_size,
+                                                  -exponent);
+    if (power < 0) {
+      result = -1;
+    } else {
+      math_eval_binary_init(arena, result, MATH_EVAL_OP_DIV, one, power);
+    }
+  } else {
+    result =
+        math_eval_power_expand_positive(arena, nodes, base_size, exponent);
+  }
+
+  yu_free(nodes);
+  return result;
+}
+
+/* Whether dropping the subtree can't skip a call to a user function */
+static bool math_eval_is_pure(const struct math_eval_expression *expr) {
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER:
+  case MATH_EVAl_VARIABLE:
+    return true;
+
+  case MATH_EVAL_UNARY:
+    return math_eval_is_pure(math_eval_expr_at(
+        expr, ast_cast(expr, struct math_eval_node_unary)->arg));
+
+  case MATH_EVAL_BINARY: {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+
+    return math_eval_is_pure(math_eval_expr_at(expr, binary->left)) &&
+           math_eval_is_pure(math_eval_expr_at(expr, binary->right));
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    if (!math_eval_builtin_name(fun->function)) {
+      return false;
+    }
+
+    for (int i = 0; i < fun->args_count; ++i) {
+      if (!math_eval_is_pure(math_eval_expr_at(expr, fun->args[i]))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    break;
+  }
+
+  return false;
+}
+
+/* Whether `x * (1 / divisor)` rounds exactly like `x / divisor` */
+static bool math_eval_reciprocal_is_exact(double divisor) {
+  int exponent;
+  const double reciprocal = 1 / divisor;
+
+  /* Only powers of two have exact reciprocals */
+  return isfinite(reciprocal) && !math_eval_float_equal(reciprocal, 0) &&
+         math_eval_float_equal(fabs(frexp(divisor, &exponent)), 0.5) &&
+         math_eval_float_equal(fabs(frexp(reciprocal, &exponent)), 0.5);
+}
+
+/*
+ * Rewrites `left op right` built at `offset`, `right` ends the arena. Returns
+ * false when nothing applies, otherwise `result` is the new subtree or -1.
+ */
+static bool math_eval_simplify_binary(struct expr_arena *arena, int32_t offset,
+                                      enum math_eval_arithmetic_operation op,
+                                      int32_t left, int32_t right, int flags,
+                                      int32_t *result) {
+  const bool fast = flags & MATH_EVAL_COMPILE_FAST_MATH;
+
+  const struct math_eval_expression *left_expr = expr_arena_at(arena, left);
+  const struct math_eval_expression *right_expr = expr_arena_at(arena, right);
+
+  const bool left_number = left_expr->type == MATH_EVAL_NUMBER;
+  const bool right_number = right_expr->type == MATH_EVAL_NUMBER;
+
+  const double l = left_number ? left_expr->value(left_expr) : (double)NAN;
+  const double r = right_number ? right_expr->value(right_expr) : (double)NAN;
+
+  /* Replacing the node with one of its operands */
+  bool keep_left = false;
+  bool keep_right = false;
+
+  switch (op) {
+  case MATH_EVAL_OP_ADD:
+    /* -0 + 0 is +0, so only adding -0 is an identity for every x */
+    keep_left = math_eval_float_equal(r, 0) && (fast || signbit(r));
+    keep_right = math_eval_float_equal(l, 0) && (fast || signbit(l));
+    break;
+
+  case MATH_EVAL_OP_SUB:
+    keep_left = math_eval_float_equal(r, 0) && (fast || !signbit(r));
+    break;
+
+  case MATH_EVAL_OP_MUL:
+    keep_left = math_eval_float_equal(r, 1);
+    keep_right = math_eval_float_equal(l, 1);
+
+    /* NaN, infinities and the sign of zero are lost */
+    if (fast &&
+        (math_eval_float_equal(r, 0) || math_eval_float_equal(l, 0)) &&
+        math_eval_is_pure(math_eval_float_equal(r, 0) ? left_expr
+                                                      : right_expr)) {
+      *result = math_eval_fold(arena, offset, 0);
+      return true;
+    }
+    break;
+
+  case MATH_EVAL_OP_DIV:
+    keep_left = math_eval_float_equal(r, 1);
+    break;
+
+  case MATH_EVAL_OP_REM:
+    break;
+
+  case MATH_EVAL_OP_EXP: {
+    if (!right_number) {
+      break;
+    }
+
+    keep_left = math_eval_float_equal(r, 1);
+
+    /* pow(x, 0) is 1 even for NaN */
+    if (math_eval_float_equal(r, 0) && math_eval_is_pure(left_expr)) {
+      *result = math_eval_fold(arena, offset, 1);
+      return true;
+    }
+
+    /*
+     * x * x and 1 / x are correctly rounded, so they are exact x ^ 2 and
+     * x ^ -1. Longer products round more than once and sqrt differs from
+     * pow for -0 and -inf.
+     */
+    const bool expand =
+        math_eval_float_equal(r, 2) || math_eval_float_equal(r, -1) ||
+        (fast && (math_eval_float_equal(fabs(r), 0.5) ||
+                  (math_eval_float_equal(r, trunc(r)) &&
+                   fabs(r) <= MATH_EVAL_MAX_EXPANDED_POWER)));
+
+    /* Products copy the base, which mustn't call a user function twice */
+    const bool single_copy = math_eval_float_equal(fabs(r), 1) ||
+                             math_eval_float_equal(fabs(r), 0.5);
+
+    if (expand && !keep_left && !math_eval_float_equal(r, 0) &&
+        (single_copy || math_eval_is_pure(left_expr))) {
+      *result = math_eval_power_expand(arena, offset, left, right, r);
+      return true;
+    }
+    break;
+  }
+  }
+
+  if (keep_left) {
+    arena->size = (size_t)right;
+    *result = expr_arena_move(arena, offset, left);
+    return true;
+  }
+
+  if (keep_right) {
+    *result = expr_arena_move(arena, offset, right);
+    return true;
+  }
+
+  return false;
+}
+
+/* Slot of `name` in `layout`, -1 when it isn't there */
+static int math_eval_layout_find(const struct math_eval_layout *layout,
+                                 const char *name) {
+  for (int i = 0; layout && i < layout->count; ++i) {
+    if (strcmp(layout->names[i], name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Nodes are appended parent first, so a subtree always occupies the end of
+ * the arena while it's being built and folding it just truncates the arena.
+ */
+static int32_t
+ast_construct_expression_tree(struct expr_arena *arena, struct ast_node *ast,
+                              const char *expression,
                               struct symbol_table *table,
+                              const struct math_eval_layout *layout, int flags,
                               struct math_eval_error *error) {
   switch (ast->type) {
 
-  case AST_NUMBER: {
-    EXPR_VALUE_BUFFER(buffer, ast);
-    return math_eval_number_create(atof(buffer));
-  }
+  case AST_NUMBER:
+    return math_eval_number_create(
+        arena, ast_cast(ast, struct ast_node_number)->value);
 
   case AST_BINARY: {
     struct ast_node_binary *ast_binary = ast_cast(ast, struct ast_node_binary);
 
+    const int32_t offset =
+        expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+    if (offset < 0) {
+      return -1;
+    }
+
+    const int32_t left = ast_construct_expression_tree(
+        arena, ast_binary->left, expression, table, layout, flags, error);
+    if (left < 0) {
+      return -1;
+    }
+
+    const int32_t right = ast_construct_expression_tree(
+        arena, ast_binary->right, expression, table, layout, flags, error);
+    if (right < 0) {
+      return -1;
+    }
+
     enum math_eval_arithmetic_operation op =
         ast_op_to_arithmetic_op(expression[ast->offset]);
-    struct math_eval_expression *left = ast_construct_expression_tree(
-        ast_binary->left, expression, table, error);
-    struct math_eval_expression *right = ast_construct_expression_tree(
-        ast_binary->right, expression, table, error);
 
-    if (left->type == MATH_EVAL_NUMBER && right->type == MATH_EVAL_NUMBER) {
-      /* E.g 2 + 2 = 4 or 3 * 9 = 27 */
+    const struct math_eval_expression *left_expr = expr_arena_at(arena, left);
+    const struct math_eval_expression *right_expr = expr_arena_at(arena, right);
 
-      double result =
-          math_eval_evaluate_binary(op, left->value(left), right->value(right));
+    if (left_expr->type == MATH_EVAL_NUMBER &&
+        right_expr->type == MATH_EVAL_NUMBER) {
+      /* E.g 2 + 2 = 4 or 3 * 9 = 27 */
+      double result = math_eval_evaluate_binary(
+          op, left_expr->value(left_expr), right_expr->value(right_expr));
 
-      struct math_eval_expression *expr = math_eval_number_create(result);
+      return math_eval_fold(arena, offset, result);
+    }
 
-      /* Remove branches */
-      math_eval_expr_destroy(left);
-      math_eval_expr_destroy(right);
+    if (op == MATH_EVAL_OP_DIV && right_expr->type == MATH_EVAL_NUMBER) {
+      struct math_eval_node_number *divisor = expr_arena_at(arena, right);
 
-      return expr;
+      /* Subnormal divisors have no finite reciprocal */
+      const bool reciprocal = (flags & MATH_EVAL_COMPILE_RECIPROCAL) &&
+                              isnormal(divisor->value) &&
+                              isfinite(1 / divisor->value);
+      if (reciprocal || math_eval_reciprocal_is_exact(divisor->value)) {
+        divisor->value = 1 / divisor->value;
+        op = MATH_EVAL_OP_MUL;
+      }
     }
 
-    struct math_eval_node_binary *binary = yu_calloc(1, sizeof(*binary));
-    if (!binary) {
-      return NULL;
+    int32_t simplified;
+    if (math_eval_simplify_binary(arena, offset, op, left, right, flags,
+                                  &simplified)) {
+      return simplified;
     }
 
-    binary->op = op;
-    binary->left = left;
-    binary->right = right;
-
-    binary->node.type = MATH_EVAL_BINARY;
-    binary->node.value = math_eval_binary_value_from_op(binary->op);
-
-    return &binary->node;
+    math_eval_binary_init(arena, offset, op, left, right);
+    return offset;
   }
 
   case AST_UNARY: {
     struct ast_node_unary *ast_unary = ast_cast(ast, struct ast_node_unary);
+    const bool minus = expression[ast->offset] == '-';
+
+    const int32_t offset =
+        expr_arena_allocate(arena, sizeof(struct math_eval_node_unary));
+    if (offset < 0) {
+      return -1;
+    }
 
-    struct math_eval_expression *arg =
-        ast_construct_expression_tree(ast_unary->arg, expression, table, error);
+    const int32_t arg = ast_construct_expression_tree(
+        arena, ast_unary->arg, expression, table, layout, flags, error);
+    if (arg < 0) {
+      return -1;
+    }
 
-    if (arg->type == MATH_EVAL_NUMBER) {
-      struct math_eval_node_number *number =
-          ast_cast(arg, struct math_eval_node_number);
+    struct math_eval_expression *arg_expr = expr_arena_at(arena, arg);
 
-      double result = arg->value(arg);
+    if (arg_expr->type == MATH_EVAL_NUMBER) {
+      double result = arg_expr->value(arg_expr);
 
-      number->value = expression[ast->offset] == '-' ? -result : result;
-      return arg;
+      return math_eval_fold(arena, offset, minus ? -result : result);
     }
 
-    if (arg->type == MATH_EVAL_UNARY) {
+    if (arg_expr->type == MATH_EVAL_UNARY) {
       struct math_eval_node_unary *unary =
-          ast_cast(arg, struct math_eval_node_unary);
+          ast_cast(arg_expr, struct math_eval_node_unary);
 
-      if (expression[ast->offset] == '-') {
+      if (minus) {
         unary->op = unary->op == MATH_EVAL_UNARY_PLUS ? MATH_EVAL_UNARY_MINUS
                                                       : MATH_EVAL_UNARY_PLUS;
       }
 
-      return arg;
+      /* Offsets are relative, so the subtree can be moved as is */
+      return expr_arena_move(arena, offset, arg);
     }
 
-    struct math_eval_node_unary *unary = yu_calloc(1, sizeof(*unary));
-    if (!unary) {
-      return NULL;
-    }
+    struct math_eval_node_unary *unary = expr_arena_at(arena, offset);
 
-    unary->arg =
-        ast_construct_expression_tree(ast_unary->arg, expression, table, error);
-    unary->op = expression[ast->offset] == '-' ? MATH_EVAL_UNARY_MINUS
-                                               : MATH_EVAL_UNARY_PLUS;
+    unary->arg = arg - offset;
+    unary->op = minus ? MATH_EVAL_UNARY_MINUS : MATH_EVAL_UNARY_PLUS;
     unary->node.type = MATH_EVAL_UNARY;
     unary->node.value = math_eval_unary_value;
 
-    return &unary->node;
+    return offset;
   }
 
   case AST_CALL: {
@@ -278,7 +707,7 @@ ast_construct_expression_tree(struct ast_node *ast, const char *expression,
       math_eval_set_error(error, EVAL_ERR_NO_FUNCTION, ast);
 
       MATH_EVAL_LOG_ERROR("Function with name '%s' doesn't exist", buffer);
-      return NULL;
+      return -1;
     }
 
     struct ast_node_function *ast_fun = ast_cast(ast, struct ast_node_function);
@@ -291,173 +720,961 @@ ast_construct_expression_tree(struct ast_node *ast, const char *expression,
 
       MATH_EVAL_LOG_ERROR(
           "Function with the name '%s' expects %d arguments, but got %d",
-          buffer, fncall->args_count, ast_fun->args_size);
-      return NULL;
+          buffer, fncall->args_count, ast_fun->args_count);
+      return -1;
     }
 
-    struct math_eval_expression *args[AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS];
+    const int args_count = fncall->args_count;
 
-    bool constant_function = true;
-    for (int i = 0; i < fncall->args_count; ++i) {
-      struct math_eval_expression *arg = ast_construct_expression_tree(
-          ast_fun->args[i], expression, table, error);
+    const int32_t offset = expr_arena_allocate(
+        arena, sizeof(struct math_eval_node_function) +
+                   sizeof(int32_t) * (size_t)args_count);
+    if (offset < 0) {
+      return -1;
+    }
 
-      args[i] = arg;
+    int32_t args[args_count > 0 ? args_count : 1];
 
+    bool constant_function = true;
+    for (int i = 0; i < args_count; ++i) {
+      args[i] = ast_construct_expression_tree(
+          arena, ast_fun->args[i], expression, table, layout, flags, error);
+      if (args[i] < 0) {
+        return -1;
+      }
+
+      const struct math_eval_expression *arg = expr_arena_at(arena, args[i]);
       if (arg->type != MATH_EVAL_NUMBER) {
         constant_function = false;
       }
     }
 
     if (constant_function) {
-      double args_computed[AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS];
-      for (int i = 0; i < fncall->args_count; ++i) {
-        struct math_eval_expression *arg = args[i];
+      double args_computed[args_count > 0 ? args_count : 1];
+      for (int i = 0; i < args_count; ++i) {
+        const struct math_eval_expression *arg = expr_arena_at(arena, args[i]);
 
         args_computed[i] = arg->value(arg);
-        math_eval_expr_destroy(arg);
       }
 
-      double result = fncall->function(args_computed);
-
-      return math_eval_number_create(result);
+      return math_eval_fold(arena, offset, fncall->function(args_computed));
     }
 
-    struct math_eval_node_function *fun = yu_calloc(1, sizeof(*fun));
-    if (!fun) {
-      return NULL;
+    /* Builtin pow is rewritten just like the `^` operator */
+    int32_t simplified;
+    if (fncall->kernel == math_eval_kernel_pow && args_count == 2 &&
+        math_eval_simplify_binary(arena, offset, MATH_EVAL_OP_EXP, args[0],
+                                  args[1], flags, &simplified)) {
+      return simplified;
     }
 
+    struct math_eval_node_function *fun = expr_arena_at(arena, offset);
+
     fun->function = fncall->function;
-    fun->args_count = ast_fun->args_count;
-    fun->args = yu_calloc((size_t)fun->args_count, sizeof(*fun->args));
+    fun->kernel = fncall->kernel;
+    fun->derivative = fncall->derivative;
+    fun->args_count = args_count;
     fun->node.type = MATH_EVAL_FUNCTION;
     fun->node.value = math_eval_function_value;
 
-    memcpy(fun->args, args, sizeof(args[0]) * (size_t)fun->args_count);
+    for (int i = 0; i < args_count; ++i) {
+      fun->args[i] = args[i] - offset;
+    }
 
-    return &fun->node;
+    return offset;
   }
 
   case AST_IDENTIFIER: {
     EXPR_VALUE_BUFFER(buffer, ast);
 
+    const int slot = math_eval_layout_find(layout, buffer);
+
     struct math_eval_variable *variable =
-        symbol_table_find_variable(table, buffer);
-    if (!variable) {
+        slot < 0 ? symbol_table_find_variable(table, buffer) : NULL;
+    if (slot < 0 && !variable) {
       math_eval_set_error(error, EVAL_ERR_NO_VARIABLE, ast);
 
       MATH_EVAL_LOG_ERROR("Variable with name '%s' doesn't exist", buffer);
-      return NULL;
+      return -1;
     }
 
-    if (variable->constant) {
-      return math_eval_number_create(variable->value);
+    if (variable && variable->constant) {
+      return math_eval_number_create(arena, variable->value);
     }
 
-    struct math_eval_node_variable *var = yu_calloc(1, sizeof(*var));
-    if (!var) {
-      return NULL;
+    const int32_t offset =
+        expr_arena_allocate(arena, sizeof(struct math_eval_node_variable));
+    if (offset < 0) {
+      return -1;
     }
 
-    var->variable = &variable->value;
+    struct math_eval_node_variable *var = expr_arena_at(arena, offset);
+
+    var->variable = variable ? &variable->value : NULL;
+    var->slot = slot;
     var->node.type = MATH_EVAl_VARIABLE;
     var->node.value = math_eval_variable_value;
 
-    return &var->node;
+    return offset;
+  }
+  }
+
+  return -1;
+}
+
+static int math_eval_tree_stats(const struct math_eval_expression *expr,
+                                int *operations) {
+  int depth = 0;
+
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER:
+  case MATH_EVAl_VARIABLE:
+    return 0;
+
+  case MATH_EVAL_UNARY: {
+    const struct math_eval_node_unary *unary =
+        ast_cast(expr, struct math_eval_node_unary);
+    depth = math_eval_tree_stats(math_eval_expr_at(expr, unary->arg),
+                                 operations);
+
+    if (unary->op == MATH_EVAL_UNARY_PLUS) {
+      return depth;
+    }
+    break;
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    for (int i = 0; i < fun->args_count; ++i) {
+      const int arg = math_eval_tree_stats(
+          math_eval_expr_at(expr, fun->args[i]), operations);
+      depth = arg > depth ? arg : depth;
+    }
+    break;
+  }
+
+  case MATH_EVAL_BINARY: {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+    const int left = math_eval_tree_stats(
+        math_eval_expr_at(expr, binary->left), operations);
+    const int right = math_eval_tree_stats(
+        math_eval_expr_at(expr, binary->right), operations);
+
+    depth = left > right ? left : right;
+    break;
+  }
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    assert(0 && "Programs don't nest in trees");
+    return 0;
+  }
+
+  *operations += 1;
+  return depth + 1;
+}
+
+/* Operand of an associative chain such as `a - b + c` or `a * b / c` */
+struct chain_term {
+  const struct math_eval_expression *expr; /* NULL for `value` */
+  double value;
+
+  bool inverse; /* Subtracted or divided by */
+};
+
+struct chain {
+  bool multiplicative;
+
+  struct chain_term *terms;
+  int terms_count;
+  int terms_capacity;
+
+  /* Sum or product of the constants, divisors are multiplied separately */
+  int constants_count;
+  double constant;
+  double divisor;
+  bool divided;
+};
+
+static inline bool
+chain_op_is_multiplicative(enum math_eval_arithmetic_operation op) {
+  return op == MATH_EVAL_OP_MUL || op == MATH_EVAL_OP_DIV;
+}
+
+static inline bool
+chain_op_is_associative(enum math_eval_arithmetic_operation op) {
+  return op != MATH_EVAL_OP_REM && op != MATH_EVAL_OP_EXP;
+}
+
+static bool chain_is_link(bool multiplicative,
+                          const struct math_eval_expression *expr) {
+  if (expr->type != MATH_EVAL_BINARY) {
+    return false;
+  }
+
+  const enum math_eval_arithmetic_operation op =
+      ast_cast(expr, struct math_eval_node_binary)->op;
+  return chain_op_is_associative(op) &&
+         chain_op_is_multiplicative(op) == multiplicative;
+}
+
+static bool chain_push(struct chain *chain, struct chain_term term) {
+  if (chain->terms_count == chain->terms_capacity) {
+    const int capacity = chain->terms_capacity ? chain->terms_capacity * 2 : 8;
+    struct chain_term *terms = yu_calloc((size_t)capacity, sizeof(*terms));
+    if (!terms) {
+      return false;
+    }
+
+    if (chain->terms) {
+      memcpy(terms, chain->terms,
+             sizeof(*terms) * (size_t)chain->terms_count);
+      yu_free(chain->terms);
+    }
+
+    chain->terms = terms;
+    chain->terms_capacity = capacity;
+  }
+
+  chain->terms[chain->terms_count++] = term;
+  return true;
+}
+
+/* Flattens every link of the chain below `expr`, constants are combined */
+static bool chain_collect(struct chain *chain,
+                          const struct math_eval_expression *expr,
+                          bool inverse) {
+  if (chain_is_link(chain->multiplicative, expr)) {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+    const bool right_inverse =
+        binary->op == MATH_EVAL_OP_SUB || binary->op == MATH_EVAL_OP_DIV;
+
+    return chain_collect(chain, math_eval_expr_at(expr, binary->left),
+                         inverse) &&
+           chain_collect(chain, math_eval_expr_at(expr, binary->right),
+                         inverse != right_inverse);
+  }
+
+  if (expr->type != MATH_EVAL_NUMBER) {
+    return chain_push(chain, (struct chain_term){expr, 0, inverse});
+  }
+
+  const double value = math_eval_expr(expr);
+
+  /* Starting from -0 keeps the sign of a lone zero */
+  if (chain->constants_count == 0) {
+    chain->constant = chain->multiplicative ? 1 : -0.0;
+  }
+
+  if (!chain->multiplicative) {
+    chain->constant += inverse ? -value : value;
+  } else if (inverse) {
+    chain->divisor = chain->divided ? chain->divisor * value : value;
+    chain->divided = true;
+  } else {
+    chain->constant *= value;
   }
+
+  chain->constants_count += 1;
+  return true;
+}
+
+static int32_t math_eval_rebuild(struct expr_arena *arena,
+                                 const struct math_eval_expression *expr,
+                                 int flags);
+
+static int32_t chain_emit_term(struct expr_arena *arena,
+                               const struct chain_term *term, int flags) {
+  return term->expr ? math_eval_rebuild(arena, term->expr, flags)
+                    : math_eval_number_create(arena, term->value);
+}
+
+/* Appends `terms[0] op terms[1] op ... terms[count - 1]`, left to right */
+static int32_t chain_emit_terms(struct expr_arena *arena,
+                                const struct chain *chain, int count,
+                                int flags) {
+  const struct chain_term *last = &chain->terms[count - 1];
+  if (count == 1) {
+    return chain_emit_term(arena, last, flags);
+  }
+
+  const int32_t offset =
+      expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+  if (offset < 0) {
+    return -1;
+  }
+
+  const int32_t left = chain_emit_terms(arena, chain, count - 1, flags);
+  const int32_t right = left < 0 ? -1 : chain_emit_term(arena, last, flags);
+  if (right < 0) {
+    return -1;
+  }
+
+  const enum math_eval_arithmetic_operation op =
+      chain->multiplicative
+          ? (last->inverse ? MATH_EVAL_OP_DIV : MATH_EVAL_OP_MUL)
+          : (last->inverse ? MATH_EVAL_OP_SUB : MATH_EVAL_OP_ADD);
+
+  math_eval_binary_init(arena, offset, op, left, right);
+  return offset;
+}
+
+/* Node of the balanced shape of a chain, leaves refer to chain terms */
+struct chain_plan {
+  int left; /* -1 for leaves */
+  int right;
+  int term;
+
+  int depth;
+  bool inverse; /* Sum or product of inverse terms only */
+};
+
+static int chain_plan_compare(const void *left, const void *right) {
+  const struct chain_plan *a = left;
+  const struct chain_plan *b = right;
+
+  if (a->depth != b->depth) {
+    return a->depth < b->depth ? -1 : 1;
+  }
+
+  return a->term < b->term ? -1 : a->term > b->term;
+}
+
+static int32_t chain_emit_plan(struct expr_arena *arena,
+                               const struct chain *chain,
+                               const struct chain_plan *plan, int node,
+                               int flags) {
+  if (plan[node].left < 0) {
+    return chain_emit_term(arena, &chain->terms[plan[node].term], flags);
+  }
+
+  int first = plan[node].left;
+  int second = plan[node].right;
+  if (plan[first].inverse && !plan[second].inverse) {
+    first = plan[node].right;
+    second = plan[node].left;
+  }
+
+  /* `a - b` when only the right side is inverse, `a + b` otherwise */
+  const bool subtract = !plan[first].inverse && plan[second].inverse;
+  const enum math_eval_arithmetic_operation op =
+      chain->multiplicative ? (subtract ? MATH_EVAL_OP_DIV : MATH_EVAL_OP_MUL)
+                            : (subtract ? MATH_EVAL_OP_SUB : MATH_EVAL_OP_ADD);
+
+  const int32_t offset =
+      expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+  if (offset < 0) {
+    return -1;
+  }
+
+  const int32_t left = chain_emit_plan(arena, chain, plan, first, flags);
+  const int32_t right =
+      left < 0 ? -1 : chain_emit_plan(arena, chain, plan, second, flags);
+  if (right < 0) {
+    return -1;
+  }
+
+  math_eval_binary_init(arena, offset, op, left, right);
+  return offset;
+}
+
+/*
+ * Appends the chain as a tree of the least depth, so that a sum of n terms
+ * takes log2(n) dependent additions instead of n - 1. The two shallowest
+ * subtrees are joined first, like in Huffman coding. Inverse terms are summed
+ * or multiplied together, `a / b / c` becomes `a / (b * c)`.
+ */
+static int32_t chain_emit_balanced(struct expr_arena *arena,
+                                   const struct chain *chain, int flags) {
+  const int count = chain->terms_count;
+
+  struct chain_plan *plan = yu_calloc((size_t)(2 * count - 1), sizeof(*plan));
+  if (!plan) {
+    return -1;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    const struct chain_term *term = &chain->terms[i];
+
+    int operations = 0;
+    plan[i] = (struct chain_plan){
+        .left = -1,
+        .right = -1,
+        .term = i,
+        .depth = term->expr ? math_eval_tree_stats(term->expr, &operations) : 0,
+        .inverse = term->inverse,
+    };
+  }
+
+  qsort(plan, (size_t)count, sizeof(*plan), chain_plan_compare);
+
+  /* Joined nodes are created in order of depth, two queues stay sorted */
+  int leaf = 0;
+  int joined = count;
+  for (int node = count; node < 2 * count - 1; ++node) {
+    int pair[2];
+    for (int i = 0; i < 2; ++i) {
+      const bool take_leaf =
+          leaf < count &&
+          (joined == node || plan[leaf].depth <= plan[joined].depth);
+      pair[i] = take_leaf ? leaf++ : joined++;
+    }
+
+    const int depth = plan[pair[0]].depth > plan[pair[1]].depth
+                          ? plan[pair[0]].depth
+                          : plan[pair[1]].depth;
+    plan[node] = (struct chain_plan){
+        .left = pair[0],
+        .right = pair[1],
+        .depth = depth + 1,
+        .inverse = plan[pair[0]].inverse && plan[pair[1]].inverse,
+    };
+  }
+
+  /* The chain has a term that isn't inverse */
+  assert(!plan[2 * count - 2].inverse);
+
+  const int32_t offset =
+      chain_emit_plan(arena, chain, plan, 2 * count - 2, flags);
+
+  yu_free(plan);
+  return offset;
+}
+
+/*
+ * Appends the chain with its constants folded into one at the end, so
+ * `a + 2 - b + 3` becomes `a - b + 5` and `2 * a / 4` becomes `a * 0.5`.
+ */
+static int32_t chain_emit(struct expr_arena *arena, struct chain *chain,
+                          int flags) {
+  struct chain_term constant = {.value = chain->constant};
+
+  if (chain->divided) {
+    /* A lone divisor stays a division */
+    if (math_eval_float_equal(constant.value, 1)) {
+      constant.value = chain->divisor;
+      constant.inverse = true;
+    } else {
+      constant.value /= chain->divisor;
+    }
+  }
+
+  int first = 0;
+  while (first < chain->terms_count && chain->terms[first].inverse) {
+    ++first;
+  }
+
+  if (first < chain->terms_count) {
+    /* Chain starts with a term that isn't subtracted or divided by */
+    const struct chain_term term = chain->terms[first];
+    memmove(chain->terms + 1, chain->terms,
+            sizeof(term) * (size_t)first);
+    chain->terms[0] = term;
+
+    /* Adding -0 and multiplying by 1 change nothing */
+    const bool identity =
+        chain->constants_count == 0 ||
+        (chain->multiplicative
+             ? math_eval_float_equal(constant.value, 1) && !constant.inverse
+             : math_eval_float_equal(constant.value, 0) &&
+                   signbit(constant.value));
+
+    if (!identity && !chain_push(chain, constant)) {
+      return -1;
+    }
+  } else {
+    /* Leftmost operand is never inverse, so it was a constant */
+    if (constant.inverse) {
+      constant.value = 1 / constant.value;
+      constant.inverse = false;
+    }
+
+    if (!chain_push(chain, constant)) {
+      return -1;
+    }
+
+    memmove(chain->terms + 1, chain->terms,
+            sizeof(constant) * (size_t)(chain->terms_count - 1));
+    chain->terms[0] = constant;
+  }
+
+  if (flags & MATH_EVAL_COMPILE_BALANCE) {
+    return chain_emit_balanced(arena, chain, flags);
+  }
+
+  return chain_emit_terms(arena, chain, chain->terms_count, flags);
+}
+
+/* Copies chain links as they are, operands are rebuilt */
+static int32_t math_eval_rebuild_link(struct expr_arena *arena,
+                                      const struct math_eval_expression *expr,
+                                      bool multiplicative, int flags) {
+  if (!chain_is_link(multiplicative, expr)) {
+    return math_eval_rebuild(arena, expr, flags);
+  }
+
+  const struct math_eval_node_binary *binary =
+      ast_cast(expr, struct math_eval_node_binary);
+
+  const int32_t offset =
+      expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+  if (offset < 0) {
+    return -1;
+  }
+
+  const int32_t left = math_eval_rebuild_link(
+      arena, math_eval_expr_at(expr, binary->left), multiplicative, flags);
+  const int32_t right =
+      left < 0 ? -1
+               : math_eval_rebuild_link(arena,
+                                        math_eval_expr_at(expr, binary->right),
+                                        multiplicative, flags);
+  if (right < 0) {
+    return -1;
+  }
+
+  math_eval_binary_init(arena, offset, binary->op, left, right);
+  return offset;
+}
+
+static int32_t math_eval_rebuild_chain(struct expr_arena *arena,
+                                       const struct math_eval_expression *expr,
+                                       int flags) {
+  struct chain chain = {
+      .multiplicative = chain_op_is_multiplicative(
+          ast_cast(expr, struct math_eval_node_binary)->op),
+  };
+
+  int32_t offset = -1;
+  if (chain_collect(&chain, expr, false)) {
+    /* Nothing to fold or balance, the chain keeps its rounding */
+    const bool balance = (flags & MATH_EVAL_COMPILE_BALANCE) &&
+                         chain.terms_count + chain.constants_count > 2;
+
+    offset = chain.constants_count < 2 && !balance
+                 ? math_eval_rebuild_link(arena, expr, chain.multiplicative,
+                                          flags)
+                 : chain_emit(arena, &chain, flags);
+  }
+
+  yu_free(chain.terms);
+  return offset;
+}
+
+/* Copies a finished tree into `arena`, rewriting chains on the way */
+static int32_t math_eval_rebuild(struct expr_arena *arena,
+                                 const struct math_eval_expression *expr,
+                                 int flags) {
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER:
+    return math_eval_number_create(arena, math_eval_expr(expr));
+
+  case MATH_EVAl_VARIABLE:
+    return expr_arena_append(arena, (const char *)expr,
+                             sizeof(struct math_eval_node_variable));
+
+  case MATH_EVAL_UNARY: {
+    const struct math_eval_node_unary *unary =
+        ast_cast(expr, struct math_eval_node_unary);
+
+    const int32_t offset =
+        expr_arena_allocate(arena, sizeof(struct math_eval_node_unary));
+    if (offset < 0) {
+      return -1;
+    }
+
+    const int32_t arg =
+        math_eval_rebuild(arena, math_eval_expr_at(expr, unary->arg), flags);
+    if (arg < 0) {
+      return -1;
+    }
+
+    struct math_eval_node_unary *copy = expr_arena_at(arena, offset);
+    *copy = *unary;
+    copy->arg = arg - offset;
+    return offset;
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    const size_t size = sizeof(struct math_eval_node_function) +
+                        sizeof(int32_t) * (size_t)fun->args_count;
+    const int32_t offset = expr_arena_append(arena, (const char *)expr, size);
+    if (offset < 0) {
+      return -1;
+    }
+
+    for (int i = 0; i < fun->args_count; ++i) {
+      const int32_t arg =
+          math_eval_rebuild(arena, math_eval_expr_at(expr, fun->args[i]),
+                            flags);
+      if (arg < 0) {
+        return -1;
+      }
+
+      struct math_eval_node_function *copy = expr_arena_at(arena, offset);
+      copy->args[i] = arg - offset;
+    }
+
+    return offset;
+  }
+
+  case MATH_EVAL_BINARY: {
+    const enum math_eval_arithmetic_operation op =
+        ast_cast(expr, struct math_eval_node_binary)->op;
+
+    if (chain_op_is_associative(op)) {
+      return math_eval_rebuild_chain(arena, expr, flags);
+    }
+
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+
+    const int32_t offset =
+        expr_arena_allocate(arena, sizeof(struct math_eval_node_binary));
+    if (offset < 0) {
+      return -1;
+    }
+
+    const int32_t left =
+        math_eval_rebuild(arena, math_eval_expr_at(expr, binary->left), flags);
+    const int32_t right =
+        left < 0 ? -1
+                 : math_eval_rebuild(
+                       arena, math_eval_expr_at(expr, binary->right), flags);
+    if (right < 0) {
+      return -1;
+    }
+
+    math_eval_binary_init(arena, offset, op, left, right);
+    return offset;
+  }
+
+  case MATH_EVAL_PROGRAM:
+  case MATH_EVAL_NATIVE:
+  case MATH_EVAL_INCREMENTAL:
+    break;
+  }
+
+  assert(0 && "Only trees are rebuilt");
+  return -1;
+}
+
+static struct math_eval_expression *
+math_eval_build_tree(struct ast_node *ast, const char *expression,
+                     struct symbol_table *table,
+                     const struct math_eval_layout *layout, int flags,
+                     struct math_eval_error *error) {
+  struct expr_arena arena = {0};
+
+  const int32_t root = ast_construct_expression_tree(
+      &arena, ast, expression, table, layout, flags, error);
+  if (root < 0) {
+    yu_free(arena.data);
+    return NULL;
+  }
+
+  assert(root == 0);
+
+  if (flags & (MATH_EVAL_COMPILE_REASSOCIATE | MATH_EVAL_COMPILE_BALANCE)) {
+    struct expr_arena rebuilt = {0};
+    const int32_t rebuilt_root = math_eval_rebuild(
+        &rebuilt, expr_arena_at(&arena, root), flags);
+
+    yu_free(arena.data);
+    if (rebuilt_root < 0) {
+      yu_free(rebuilt.data);
+      return NULL;
+    }
+
+    arena = rebuilt;
   }
 
-  return NULL;
+  return (struct math_eval_expression *)(void *)arena.data;
+}
+
+/* Takes `program` over, it's destroyed on failure */
+static struct math_eval_expression *
+math_eval_compile_program(struct math_eval_program *program) {
+  struct math_eval_expression *expr = math_eval_program_node_create(program);
+  if (!expr) {
+    math_eval_program_destroy(program);
+  }
+
+  return expr;
+}
+
+static struct math_eval_expression *
+math_eval_compile_layout(struct ast_node *ast, const char *expression,
+                         struct symbol_table *table,
+                         const struct math_eval_layout *layout, int flags,
+                         struct math_eval_error *error) {
+  struct math_eval_error err;
+  if (!error) {
+    error = &err;
+  }
+
+  /* Only programs read slots of a frame */
+  if (layout) {
+    flags &= ~MATH_EVAL_COMPILE_INCREMENTAL;
+    flags |= MATH_EVAL_COMPILE_BYTECODE;
+  }
+
+  struct math_eval_expression *expr =
+      math_eval_build_tree(ast, expression, table, layout, flags, error);
+  if (!expr || expr->type == MATH_EVAL_NUMBER) {
+    return expr;
+  }
+
+  /* Caches live alongside the tree, programs are evaluated as a whole */
+  if (flags & MATH_EVAL_COMPILE_INCREMENTAL) {
+    return math_eval_incremental_create(expr);
+  }
+
+  if (!(flags & (MATH_EVAL_COMPILE_BYTECODE | MATH_EVAL_COMPILE_JIT))) {
+    if (flags & MATH_EVAL_COMPILE_NO_CSE) {
+      return expr;
+    }
+
+    /* Tree can't share nodes, repeated subexpressions need a program */
+    struct math_eval_program *program = math_eval_program_create_shared(expr);
+    if (!program) {
+      return expr;
+    }
+
+    math_eval_expr_destroy(expr);
+    return math_eval_compile_program(program);
+  }
+
+  struct math_eval_program *program = math_eval_program_create_ex(expr, flags);
+  math_eval_expr_destroy(expr);
+
+  if (!program) {
+    return NULL;
+  }
+
+  if (flags & MATH_EVAL_COMPILE_JIT) {
+    /* Without the JIT the expression stays a bytecode program */
+    struct math_eval_expression *native =
+        math_eval_jit_compile_program(program);
+    if (native) {
+      return native;
+    }
+  }
+
+  return math_eval_compile_program(program);
+}
+
+struct math_eval_expression *
+math_eval_compile_ast_ex(struct ast_node *ast, const char *expression,
+                         struct symbol_table *table, int flags,
+                         struct math_eval_error *error) {
+  return math_eval_compile_layout(ast, expression, table, NULL, flags, error);
 }
 
 struct math_eval_expression *
 math_eval_compile_ast(struct ast_node *ast, const char *expression,
                       struct symbol_table *table,
                       struct math_eval_error *error) {
+  return math_eval_compile_ast_ex(ast, expression, table,
+                                  MATH_EVAL_COMPILE_DEFAULT, error);
+}
+
+struct math_eval_expression *math_eval_compile_ex(const char *expression,
+                                                  struct symbol_table *table,
+                                                  int flags,
+                                                  struct math_eval_error *error) {
+  assert(expression != NULL);
+
+  return math_eval_compile_ex_n(expression, strlen(expression), table, flags,
+                                error);
+}
+
+static struct math_eval_expression *
+math_eval_compile_source(const char *expression, size_t len,
+                         struct symbol_table *table,
+                         const struct math_eval_layout *layout, int flags,
+                         struct math_eval_error *error) {
   struct math_eval_error err;
   if (!error) {
     error = &err;
   }
 
-  return ast_construct_expression_tree(ast, expression, table, error);
-}
-
-struct math_eval_expression *math_eval_compile(const char *expression,
-                                               struct symbol_table *table,
-                                               struct math_eval_error *error) {
-  struct ast_error err;
-  struct ast_node *ast = ast_build(expression, &err);
+  struct ast_error ast_err;
+  struct ast_node *ast = ast_build_n(expression, len, &ast_err);
   if (!ast) {
-    error->offset = err.offset;
+    error->offset = ast_err.offset;
     error->code = EVAL_ERR_PARSE;
     return NULL;
   }
 
   struct math_eval_expression *expr =
-      math_eval_compile_ast(ast, expression, table, error);
+      math_eval_compile_layout(ast, expression, table, layout, flags, error);
 
   ast_destroy(ast);
   return expr;
 }
 
-void math_eval_expr_destroy(struct math_eval_expression *expression) {
-  if (!expression) {
-    return;
+struct math_eval_expression *
+math_eval_compile_ex_n(const char *expression, size_t len,
+                       struct symbol_table *table, int flags,
+                       struct math_eval_error *error) {
+  return math_eval_compile_source(expression, len, table, NULL, flags, error);
+}
+
+struct math_eval_expression *math_eval_compile(const char *expression,
+                                               struct symbol_table *table,
+                                               struct math_eval_error *error) {
+  return math_eval_compile_ex(expression, table, MATH_EVAL_COMPILE_DEFAULT,
+                              error);
+}
+
+struct math_eval_expression *math_eval_compile_n(const char *expression,
+                                                 size_t len,
+                                                 struct symbol_table *table,
+                                                 struct math_eval_error *error) {
+  return math_eval_compile_ex_n(expression, len, table,
+                                MATH_EVAL_COMPILE_DEFAULT, error);
+}
+
+struct math_eval_expression *
+math_eval_compile_frame(const char *expression, struct symbol_table *table,
+                        const struct math_eval_layout *layout, int flags,
+                        struct math_eval_error *error) {
+  assert(expression != NULL);
+
+  return math_eval_compile_frame_n(expression, strlen(expression), table,
+                                   layout, flags, error);
+}
+
+struct math_eval_expression *
+math_eval_compile_frame_n(const char *expression, size_t len,
+                          struct symbol_table *table,
+                          const struct math_eval_layout *layout, int flags,
+                          struct math_eval_error *error) {
+  assert(layout != NULL);
+
+  return math_eval_compile_source(expression, len, table, layout, flags,
+                                  error);
+}
+
+double math_eval_expr_frame(const struct math_eval_expression *expr,
+                            const double *frame) {
+  switch (expr->type) {
+  case MATH_EVAL_PROGRAM:
+    return math_eval_program_run_frame(
+        ast_cast(expr, struct math_eval_node_program)->program, frame);
+
+  case MATH_EVAL_NATIVE:
+    return ast_cast(expr, struct math_eval_node_native)
+        ->frame_value(expr, frame);
+
+  default:
+    /* Numbers and expressions compiled without a layout read no slot */
+    return math_eval_expr(expr);
   }
+}
 
-  switch (expression->type) {
-  case MATH_EVAL_NUMBER: {
-    struct math_eval_node_number *number =
-        ast_cast(expression, struct math_eval_node_number);
-    yu_free(number);
+void math_eval_expr_stats(const struct math_eval_expression *expr,
+                          struct math_eval_expr_stats *stats) {
+  switch (expr->type) {
+  case MATH_EVAL_PROGRAM:
+    math_eval_program_stats(
+        ast_cast(expr, struct math_eval_node_program)->program, stats);
     break;
-  }
 
-  case MATH_EVAL_FUNCTION: {
-    struct math_eval_node_function *fun =
-        ast_cast(expression, struct math_eval_node_function);
-    for (int i = 0; i < fun->args_count; ++i) {
-      math_eval_expr_destroy(fun->args[i]);
-    }
+  case MATH_EVAL_NATIVE:
+    math_eval_program_stats(
+        ast_cast(expr, struct math_eval_node_native)->program, stats);
+    break;
+
+  case MATH_EVAL_INCREMENTAL:
+    math_eval_expr_stats(
+        ast_cast(expr, struct math_eval_node_incremental)->tree, stats);
+    break;
 
-    yu_free(fun->args);
-    yu_free(fun);
+  default:
+    *stats = (struct math_eval_expr_stats){0};
+    stats->depth = math_eval_tree_stats(expr, &stats->operations);
     break;
   }
+}
 
-  case MATH_EVAL_UNARY: {
-    struct math_eval_node_unary *unary =
-        ast_cast(expression, struct math_eval_node_unary);
-    math_eval_expr_destroy(unary->arg);
+void math_eval_expr_destroy(struct math_eval_expression *expression) {
+  if (!expression) {
+    return;
+  }
 
-    yu_free(unary);
+  switch (expression->type) {
+  case MATH_EVAL_NUMBER:
+  case MATH_EVAL_FUNCTION:
+  case MATH_EVAL_UNARY:
+  case MATH_EVAL_BINARY:
+  case MATH_EVAl_VARIABLE:
+    /* The whole tree is one allocation starting at the root */
+    yu_free(expression);
     break;
-  }
 
-  case MATH_EVAL_BINARY: {
-    struct math_eval_node_binary *binary =
-        ast_cast(expression, struct math_eval_node_binary);
-    math_eval_expr_destroy(binary->left);
-    math_eval_expr_destroy(binary->right);
+  case MATH_EVAL_PROGRAM: {
+    struct math_eval_node_program *node =
+        ast_cast(expression, struct math_eval_node_program);
+    math_eval_program_destroy(node->program);
 
-    yu_free(binary);
+    yu_free(node);
     break;
   }
 
-  case MATH_EVAl_VARIABLE: {
-    struct math_eval_node_variable *var =
-        ast_cast(expression, struct math_eval_node_variable);
-    yu_free(var);
+  case MATH_EVAL_NATIVE: {
+    math_eval_jit_destroy(
+        ast_cast(expression, struct math_eval_node_native));
     break;
   }
+
+  case MATH_EVAL_INCREMENTAL:
+    math_eval_incremental_destroy(
+        ast_cast(expression, struct math_eval_node_incremental));
+    break;
   }
 }
 
 double math_eval(const char *expression, struct symbol_table *table,
                  struct math_eval_error *error) {
+  assert(expression != NULL);
+
+  return math_eval_n(expression, strlen(expression), table, error);
+}
+
+double math_eval_n(const char *expression, size_t len,
+                   struct symbol_table *table, struct math_eval_error *error) {
+  struct math_eval_error err;
+  if (!error) {
+    error = &err;
+  }
+
+  /* Nothing is kept, so nothing needs to be built */
+  if (!table || !table->cache) {
+    return math_eval_one_shot(expression, len, table, error);
+  }
+
+  const struct math_eval_expression *cached =
+      math_eval_cache_find(table->cache, expression, len);
+  if (cached) {
+    return math_eval_expr(cached);
+  }
+
   struct math_eval_expression *expr =
-      math_eval_compile(expression, table, error);
+      math_eval_compile_n(expression, len, table, error);
+
+  if (expr && math_eval_cache_insert(table->cache, expression, len, expr)) {
+    return math_eval_expr(expr);
+  }
 
   if (expr) {
     double result = math_eval_expr(expr);
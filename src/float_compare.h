@@ -0,0 +1,15 @@
+#ifndef MATH_EVAL_FLOAT_COMPARE_H
+#define MATH_EVAL_FLOAT_COMPARE_H
+
+#include <math.h>
+#include <stdbool.h>
+
+/*
+ * Same as `a == b`, for the places that mean an exact comparison. Spelled
+ * with quiet comparisons so -Wfloat-equal keeps flagging the others.
+ */
+static inline bool math_eval_float_equal(double a, double b) {
+  return isgreaterequal(a, b) && islessequal(a, b);
+}
+
+#endif /* !MATH_EVAL_FLOAT_COMPARE_H */
@@ -0,0 +1,76 @@
+#include <assert.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/bytecode.h"
+#include "math_eval/fused.h"
+
+struct math_eval_fused {
+  int outputs_count;
+  struct math_eval_program *program;
+};
+
+struct math_eval_fused *math_eval_fused_compile(const char *const *expressions,
+                                                int count,
+                                                struct symbol_table *table,
+                                                int *failed,
+                                                struct math_eval_error *error) {
+  assert(expressions != NULL);
+  assert(count > 0);
+
+  struct math_eval_fused *fused = yu_calloc(1, sizeof(*fused));
+  struct math_eval_expression **exprs = yu_calloc((size_t)count, sizeof(*exprs));
+
+  bool ok = fused && exprs;
+
+  /* Trees are only needed until they are merged into one program */
+  for (int i = 0; ok && i < count; ++i) {
+    exprs[i] = math_eval_compile_ex(expressions[i], table,
+                                    MATH_EVAL_COMPILE_NO_CSE, error);
+    if (!exprs[i]) {
+      if (failed) {
+        *failed = i;
+      }
+
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    fused->outputs_count = count;
+    fused->program = math_eval_program_create_fused(
+        (const struct math_eval_expression *const *)exprs, count);
+    ok = fused->program != NULL;
+  }
+
+  for (int i = 0; exprs && i < count; ++i) {
+    math_eval_expr_destroy(exprs[i]);
+  }
+  yu_free(exprs);
+
+  if (!ok) {
+    math_eval_fused_destroy(fused);
+    return NULL;
+  }
+
+  return fused;
+}
+
+void math_eval_fused_destroy(struct math_eval_fused *fused) {
+  if (!fused) {
+    return;
+  }
+
+  math_eval_program_destroy(fused->program);
+  yu_free(fused);
+}
+
+int math_eval_fused_outputs_count(const struct math_eval_fused *fused) {
+  assert(fused != NULL);
+  return fused->outputs_count;
+}
+
+void math_eval_fused_eval(const struct math_eval_fused *fused, double *out) {
+  assert(fused != NULL);
+  math_eval_program_run_outputs(fused->program, out);
+}
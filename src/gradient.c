@@ -0,0 +1,371 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/gradient.h"
+#include "math_eval/incremental.h"
+#include "math_eval/jit.h"
+#include "math_eval/parser.h"
+
+#include "builtins.h"
+
+/*
+ * Record of a program run. Every instruction refers to the instructions that
+ * produced the values it popped, loads are resolved to the stored value.
+ */
+struct gradient_tape {
+  double *values;   /* Result of every instruction */
+  double *adjoints; /* Derivative of the result by every instruction */
+  double *args;     /* Arguments and partial derivatives of one call */
+
+  const double **variables; /* Distinct variables in order of appearance */
+  int variables_count;
+
+  int *operands;
+  int *first; /* First operand of every instruction, index of variables */
+};
+
+/* Program of `expr`, trees are lowered into `lowered` */
+static const struct math_eval_program *
+gradient_program(const struct math_eval_expression *expr,
+                 struct math_eval_program **lowered) {
+  *lowered = NULL;
+
+  switch (expr->type) {
+  case MATH_EVAL_PROGRAM:
+    return ast_cast(expr, struct math_eval_node_program)->program;
+  case MATH_EVAL_NATIVE:
+    return ast_cast(expr, struct math_eval_node_native)->program;
+  case MATH_EVAL_INCREMENTAL:
+    expr = ast_cast(expr, struct math_eval_node_incremental)->tree;
+    break;
+  default:
+    break;
+  }
+
+  *lowered = math_eval_program_create(expr);
+  return *lowered;
+}
+
+static int gradient_variable(const double **variables, int *variables_count,
+                             const double *variable) {
+  for (int i = 0; i < *variables_count; ++i) {
+    if (variables[i] == variable) {
+      return i;
+    }
+  }
+
+  variables[*variables_count] = variable;
+  return (*variables_count)++;
+}
+
+int math_eval_expr_variables(const struct math_eval_expression *expr,
+                             const struct math_eval_variable **variables,
+                             int capacity) {
+  assert(expr != NULL);
+
+  struct math_eval_program *lowered;
+  const struct math_eval_program *program = gradient_program(expr, &lowered);
+  if (!program) {
+    return 0;
+  }
+
+  const double **found =
+      yu_calloc((size_t)program->instructions_count, sizeof(*found));
+
+  int count = 0;
+  for (int i = 0; found && i < program->instructions_count; ++i) {
+    const struct math_eval_instruction *ip = &program->instructions[i];
+    if (ip->opcode != MATH_EVAL_OPCODE_VARIABLE) {
+      continue;
+    }
+
+    const int index = gradient_variable(found, &count, ip->variable);
+    if (index == count - 1 && index < capacity) {
+      /* Nodes point at `value`, the first member of the variable */
+      variables[index] =
+          (const struct math_eval_variable *)(const void *)ip->variable;
+    }
+  }
+
+  yu_free((void *)found);
+  math_eval_program_destroy(lowered);
+  return count;
+}
+
+/* Central difference for functions without a derivative */
+static void gradient_numeric(const struct math_eval_function *function,
+                             double *args, double *partials) {
+  for (int i = 0; i < function->args_count; ++i) {
+    const double x = args[i];
+    const double h = cbrt(DBL_EPSILON) * fmax(fabs(x), 1.0);
+
+    args[i] = x + h;
+    const double up = function->function(args);
+    args[i] = x - h;
+    const double down = function->function(args);
+    args[i] = x;
+
+    partials[i] = (up - down) / (2.0 * h);
+  }
+}
+
+/* Runs the program like the VM does, returns the instruction of the result */
+static int gradient_forward(const struct math_eval_program *program,
+                            struct gradient_tape *tape) {
+  int stack[program->stack_size > 0 ? program->stack_size : 1];
+  int locals[program->locals_count > 0 ? program->locals_count : 1];
+  int sp = 0;
+  int operands_count = 0;
+
+  for (int i = 0; i < program->instructions_count; ++i) {
+    const struct math_eval_instruction *ip = &program->instructions[i];
+    int *operands = tape->operands + operands_count;
+    double value = 0;
+
+    tape->first[i] = operands_count;
+
+    switch (ip->opcode) {
+    case MATH_EVAL_OPCODE_NUMBER:
+      value = ip->number;
+      break;
+
+    case MATH_EVAL_OPCODE_VARIABLE:
+      value = *ip->variable;
+      tape->first[i] = gradient_variable(tape->variables,
+                                         &tape->variables_count, ip->variable);
+      break;
+
+    case MATH_EVAL_OPCODE_ADD:
+    case MATH_EVAL_OPCODE_SUB:
+    case MATH_EVAL_OPCODE_DIV:
+    case MATH_EVAL_OPCODE_MUL:
+    case MATH_EVAL_OPCODE_REM:
+    case MATH_EVAL_OPCODE_EXP: {
+      operands[1] = stack[--sp];
+      operands[0] = stack[--sp];
+      operands_count += 2;
+
+      const double left = tape->values[operands[0]];
+      const double right = tape->values[operands[1]];
+
+      switch (ip->opcode) {
+      case MATH_EVAL_OPCODE_ADD:
+        value = left + right;
+        break;
+      case MATH_EVAL_OPCODE_SUB:
+        value = left - right;
+        break;
+      case MATH_EVAL_OPCODE_DIV:
+        value = left / right;
+        break;
+      case MATH_EVAL_OPCODE_MUL:
+        value = left * right;
+        break;
+      case MATH_EVAL_OPCODE_REM:
+        value = fmod(left, right);
+        break;
+      default:
+        value = pow(left, right);
+        break;
+      }
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_NEGATE:
+      operands[0] = stack[--sp];
+      operands_count += 1;
+      value = -tape->values[operands[0]];
+      break;
+
+    case MATH_EVAL_OPCODE_CALL: {
+      const int args_count = ip->function->args_count;
+
+      sp -= args_count;
+      for (int arg = 0; arg < args_count; ++arg) {
+        operands[arg] = stack[sp + arg];
+        tape->args[arg] = tape->values[operands[arg]];
+      }
+      operands_count += args_count;
+
+      value = ip->function->function(tape->args);
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_LOAD:
+      stack[sp++] = locals[ip->index];
+      continue;
+
+    case MATH_EVAL_OPCODE_STORE:
+      locals[ip->index] = stack[sp - 1];
+      continue;
+
+    case MATH_EVAL_OPCODE_RETURN:
+      return stack[sp - 1];
+
+    case MATH_EVAL_OPCODE_OUTPUT:
+    case MATH_EVAL_OPCODE_HALT:
+      assert(0 && "Gradients are taken of a single result");
+      return -1;
+
+    case MATH_EVAL_OPCODE_FRAME:
+      assert(0 && "Programs reading a frame have no gradient");
+      return -1;
+    }
+
+    tape->values[i] = value;
+    stack[sp++] = i;
+  }
+
+  assert(0 && "Program must end with a return");
+  return -1;
+}
+
+/* Propagates the derivative of the result back to every variable */
+static void gradient_backward(const struct math_eval_program *program,
+                              struct gradient_tape *tape, int result,
+                              double *gradient) {
+  double *adjoints = tape->adjoints;
+  adjoints[result] = 1.0;
+
+  /* Operands always come before the instruction using them */
+  for (int i = result; i >= 0; --i) {
+    const double adjoint = adjoints[i];
+    if (math_eval_float_equal(adjoint, 0.0)) {
+      continue;
+    }
+
+    const struct math_eval_instruction *ip = &program->instructions[i];
+    const int *operands = tape->operands + tape->first[i];
+
+    switch (ip->opcode) {
+    case MATH_EVAL_OPCODE_VARIABLE:
+      gradient[tape->first[i]] += adjoint;
+      break;
+
+    case MATH_EVAL_OPCODE_ADD:
+      adjoints[operands[0]] += adjoint;
+      adjoints[operands[1]] += adjoint;
+      break;
+
+    case MATH_EVAL_OPCODE_SUB:
+      adjoints[operands[0]] += adjoint;
+      adjoints[operands[1]] -= adjoint;
+      break;
+
+    case MATH_EVAL_OPCODE_MUL:
+      adjoints[operands[0]] += adjoint * tape->values[operands[1]];
+      adjoints[operands[1]] += adjoint * tape->values[operands[0]];
+      break;
+
+    case MATH_EVAL_OPCODE_DIV: {
+      const double right = tape->values[operands[1]];
+      adjoints[operands[0]] += adjoint / right;
+      adjoints[operands[1]] -= adjoint * tape->values[i] / right;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_REM: {
+      const double left = tape->values[operands[0]];
+      const double right = tape->values[operands[1]];
+      adjoints[operands[0]] += adjoint;
+      adjoints[operands[1]] -= adjoint * trunc(left / right);
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_EXP: {
+      const double args[] = {tape->values[operands[0]],
+                             tape->values[operands[1]]};
+      double partials[2];
+      builtin_pow_derivative(args, partials);
+
+      adjoints[operands[0]] += adjoint * partials[0];
+      adjoints[operands[1]] += adjoint * partials[1];
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_NEGATE:
+      adjoints[operands[0]] -= adjoint;
+      break;
+
+    case MATH_EVAL_OPCODE_CALL: {
+      const struct math_eval_function *function = ip->function;
+      double *args = tape->args;
+      double *partials = tape->args + function->args_count;
+
+      for (int arg = 0; arg < function->args_count; ++arg) {
+        args[arg] = tape->values[operands[arg]];
+      }
+
+      if (function->derivative) {
+        function->derivative(args, partials);
+      } else {
+        gradient_numeric(function, args, partials);
+      }
+
+      for (int arg = 0; arg < function->args_count; ++arg) {
+        adjoints[operands[arg]] += adjoint * partials[arg];
+      }
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+}
+
+double math_eval_program_gradient(const struct math_eval_program *program,
+                                  double *gradient) {
+  assert(program != NULL);
+
+  if (program->frame_size > 0) {
+    return NAN;
+  }
+
+  /* Call arguments and their partials are bounded by the instructions */
+  const size_t n = (size_t)program->instructions_count;
+  char *block = yu_calloc(1, n * (4 * sizeof(double) + sizeof(double *) +
+                                  2 * sizeof(int)));
+  if (!block) {
+    return NAN;
+  }
+
+  struct gradient_tape tape = {
+      .values = (double *)(void *)block,
+      .adjoints = (double *)(void *)(block + n * sizeof(double)),
+      .args = (double *)(void *)(block + 2 * n * sizeof(double)),
+      .variables = (const double **)(void *)(block + 4 * n * sizeof(double)),
+      .operands = (int *)(void *)(block + n * (4 * sizeof(double) +
+                                              sizeof(double *))),
+  };
+  tape.first = tape.operands + n;
+
+  const int result = gradient_forward(program, &tape);
+  const double value = tape.values[result];
+
+  memset(gradient, 0, sizeof(*gradient) * (size_t)tape.variables_count);
+  gradient_backward(program, &tape, result, gradient);
+
+  yu_free(block);
+  return value;
+}
+
+double math_eval_expr_gradient(const struct math_eval_expression *expr,
+                               double *gradient) {
+  assert(expr != NULL);
+
+  struct math_eval_program *lowered;
+  const struct math_eval_program *program = gradient_program(expr, &lowered);
+  if (!program) {
+    return NAN;
+  }
+
+  const double value = math_eval_program_gradient(program, gradient);
+
+  math_eval_program_destroy(lowered);
+  return value;
+}
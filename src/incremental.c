@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <math.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/incremental.h"
+#include "math_eval/parser.h"
+
+#include "builtins.h"
+
+/* Dependency of every call to a user function, always recomputed */
+#define INCREMENTAL_VOLATILE ((uint64_t)1 << 63)
+
+static inline uint64_t incremental_bit(int variable) {
+  return (uint64_t)1 << (variable % 63);
+}
+
+static int incremental_children_count(const struct math_eval_expression *expr) {
+  switch (expr->type) {
+  case MATH_EVAL_UNARY:
+    return 1;
+  case MATH_EVAL_BINARY:
+    return 2;
+  case MATH_EVAL_FUNCTION:
+    return ast_cast(expr, struct math_eval_node_function)->args_count;
+  default:
+    return 0;
+  }
+}
+
+static const struct math_eval_expression *
+incremental_child(const struct math_eval_expression *expr, int i) {
+  switch (expr->type) {
+  case MATH_EVAL_UNARY:
+    return math_eval_expr_at(expr,
+                             ast_cast(expr, struct math_eval_node_unary)->arg);
+  case MATH_EVAL_BINARY: {
+    const struct math_eval_node_binary *binary =
+        ast_cast(expr, struct math_eval_node_binary);
+    return math_eval_expr_at(expr, i == 0 ? binary->left : binary->right);
+  }
+  default:
+    return math_eval_expr_at(
+        expr, ast_cast(expr, struct math_eval_node_function)->args[i]);
+  }
+}
+
+static int incremental_count(const struct math_eval_expression *expr) {
+  int count = 1;
+  for (int i = 0; i < incremental_children_count(expr); ++i) {
+    count += incremental_count(incremental_child(expr, i));
+  }
+
+  return count;
+}
+
+/* Index of `variable` in `node->variables`, added when missing */
+static int incremental_variable(struct math_eval_node_incremental *node,
+                                const struct math_eval_variable *variable) {
+  for (int i = 0; i < node->variables_count; ++i) {
+    if (node->variables[i] == variable) {
+      return i;
+    }
+  }
+
+  /* At most one variable per node, arrays are sized for `nodes_count` */
+  const int index = node->variables_count++;
+  node->variables[index] = variable;
+  node->versions[index] = variable->version;
+  return index;
+}
+
+/* Appends `expr` and its subtree in pre-order, returns its index */
+static int incremental_build(struct math_eval_node_incremental *node,
+                             int *children_count,
+                             const struct math_eval_expression *expr) {
+  const int index = node->nodes_count++;
+  const int count = incremental_children_count(expr);
+
+  struct math_eval_incremental_node *cached = &node->nodes[index];
+  *cached = (struct math_eval_incremental_node){
+      .expr = expr,
+      .children = *children_count,
+  };
+  *children_count += count;
+
+  uint64_t dependencies = 0;
+  for (int i = 0; i < count; ++i) {
+    const int child =
+        incremental_build(node, children_count, incremental_child(expr, i));
+
+    node->children[node->nodes[index].children + i] = child;
+    dependencies |= node->nodes[child].dependencies;
+  }
+
+  switch (expr->type) {
+  case MATH_EVAL_NUMBER:
+    node->nodes[index].value = math_eval_expr(expr);
+    break;
+
+  case MATH_EVAl_VARIABLE: {
+    /* Nodes point at `value`, the first member of the variable */
+    const double *value =
+        ast_cast(expr, struct math_eval_node_variable)->variable;
+    const struct math_eval_variable *variable =
+        (const struct math_eval_variable *)(const void *)value;
+
+    dependencies |= incremental_bit(incremental_variable(node, variable));
+    break;
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+    if (fun->args_count > node->args_size) {
+      node->args_size = fun->args_count;
+    }
+
+    if (!math_eval_builtin_name(fun->function)) {
+      dependencies |= INCREMENTAL_VOLATILE;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  node->nodes[index].dependencies = dependencies;
+  return index;
+}
+
+/* Recomputes `cached` from the cached values of its children */
+static double incremental_update(struct math_eval_node_incremental *node,
+                                 const struct math_eval_incremental_node *cached) {
+  const struct math_eval_expression *expr = cached->expr;
+  const int *children = node->children + cached->children;
+
+#define INCREMENTAL_CHILD(i) (node->nodes[children[i]].value)
+
+  switch (expr->type) {
+  case MATH_EVAl_VARIABLE:
+    return *ast_cast(expr, struct math_eval_node_variable)->variable;
+
+  case MATH_EVAL_UNARY:
+    return ast_cast(expr, struct math_eval_node_unary)->op ==
+                   MATH_EVAL_UNARY_MINUS
+               ? -INCREMENTAL_CHILD(0)
+               : INCREMENTAL_CHILD(0);
+
+  case MATH_EVAL_BINARY: {
+    const double left = INCREMENTAL_CHILD(0);
+    const double right = INCREMENTAL_CHILD(1);
+
+    switch (ast_cast(expr, struct math_eval_node_binary)->op) {
+    case MATH_EVAL_OP_ADD:
+      return left + right;
+    case MATH_EVAL_OP_SUB:
+      return left - right;
+    case MATH_EVAL_OP_DIV:
+      return left / right;
+    case MATH_EVAL_OP_MUL:
+      return left * right;
+    case MATH_EVAL_OP_REM:
+      return fmod(left, right);
+    case MATH_EVAL_OP_EXP:
+      return pow(left, right);
+    }
+    break;
+  }
+
+  case MATH_EVAL_FUNCTION: {
+    const struct math_eval_node_function *fun =
+        ast_cast(expr, struct math_eval_node_function);
+
+    for (int i = 0; i < fun->args_count; ++i) {
+      node->args[i] = INCREMENTAL_CHILD(i);
+    }
+
+    return fun->function(node->args);
+  }
+
+  default:
+    break;
+  }
+
+#undef INCREMENTAL_CHILD
+
+  assert(0 && "Numbers never depend on variables");
+  return NAN;
+}
+
+static double
+math_eval_incremental_value(const struct math_eval_expression *expr) {
+  struct math_eval_node_incremental *node =
+      ast_cast(expr, struct math_eval_node_incremental);
+
+  /* Everything is computed the first time */
+  uint64_t changed = node->evaluated ? INCREMENTAL_VOLATILE : UINT64_MAX;
+  node->evaluated = true;
+
+  for (int i = 0; i < node->variables_count; ++i) {
+    const uint64_t version = node->variables[i]->version;
+    if (node->versions[i] != version) {
+      node->versions[i] = version;
+      changed |= incremental_bit(i);
+    }
+  }
+
+  /* Children follow their parent, so they are up to date when it's reached */
+  for (int i = node->nodes_count - 1; i >= 0; --i) {
+    struct math_eval_incremental_node *cached = &node->nodes[i];
+    if (cached->dependencies & changed) {
+      cached->value = incremental_update(node, cached);
+    }
+  }
+
+  return node->nodes[0].value;
+}
+
+struct math_eval_expression *
+math_eval_incremental_create(struct math_eval_expression *tree) {
+  assert(tree != NULL);
+
+  const int count = incremental_count(tree);
+
+  struct math_eval_node_incremental *node = yu_calloc(1, sizeof(*node));
+  if (!node) {
+    math_eval_expr_destroy(tree);
+    return NULL;
+  }
+
+  node->node.type = MATH_EVAL_INCREMENTAL;
+  node->node.value = math_eval_incremental_value;
+  node->tree = tree;
+  node->nodes = yu_calloc((size_t)count, sizeof(*node->nodes));
+  node->children = yu_calloc((size_t)count, sizeof(*node->children));
+  node->variables = yu_calloc((size_t)count, sizeof(*node->variables));
+  node->versions = yu_calloc((size_t)count, sizeof(*node->versions));
+
+  if (!node->nodes || !node->children || !node->variables || !node->versions) {
+    math_eval_incremental_destroy(node);
+    return NULL;
+  }
+
+  int children_count = 0;
+  incremental_build(node, &children_count, tree);
+
+  node->args = yu_calloc((size_t)node->args_size + 1, sizeof(*node->args));
+  if (!node->args) {
+    math_eval_incremental_destroy(node);
+    return NULL;
+  }
+  assert(node->nodes_count == count);
+
+  return &node->node;
+}
+
+void math_eval_incremental_destroy(struct math_eval_node_incremental *node) {
+  if (!node) {
+    return;
+  }
+
+  math_eval_expr_destroy(node->tree);
+  yu_free(node->args);
+  yu_free(node->versions);
+  yu_free((void *)node->variables);
+  yu_free(node->children);
+  yu_free(node->nodes);
+  yu_free(node);
+}
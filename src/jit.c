@@ -0,0 +1,568 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/bytecode.h"
+#include "math_eval/jit.h"
+#include "math_eval/kernels.h"
+#include "math_eval/parser.h"
+
+/* Code follows the System V calling convention */
+#if defined(MATH_EVAL_JIT) && defined(__x86_64__) && !defined(_WIN32)
+#define MATH_EVAL_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+#ifdef MATH_EVAL_JIT_X86_64
+
+/* Value stack slots live in xmm2 - xmm15, deeper ones only in memory */
+#define JIT_REGISTER_SLOTS 14
+#define JIT_FIRST_SLOT_REGISTER 2
+
+#define SSE_PREFIX_SD 0xF2
+#define SSE_PREFIX_PD 0x66
+
+#define SSE_MOVSD_LOAD 0x10
+#define SSE_MOVSD_STORE 0x11
+#define SSE_MOVAPD 0x28
+#define SSE_SQRT 0x51
+#define SSE_AND 0x54
+#define SSE_XOR 0x57
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+#define SIGN_MASK 0x8000000000000000
+#define ABS_MASK 0x7FFFFFFFFFFFFFFF
+
+/* Code is only counted while `code` is NULL */
+struct jit_buffer {
+  unsigned char *code;
+  size_t size;
+};
+
+static inline void jit_byte(struct jit_buffer *buffer, unsigned value) {
+  if (buffer->code) {
+    buffer->code[buffer->size] = (unsigned char)value;
+  }
+
+  buffer->size += 1;
+}
+
+static void jit_bytes(struct jit_buffer *buffer, uint64_t value, int count) {
+  for (int i = 0; i < count; ++i) {
+    jit_byte(buffer, (unsigned)(value >> (8 * i)) & 0xFF);
+  }
+}
+
+static inline bool jit_slot_in_register(int slot) {
+  return slot < JIT_REGISTER_SLOTS;
+}
+
+static inline int jit_slot_register(int slot) {
+  return JIT_FIRST_SLOT_REGISTER + slot;
+}
+
+static inline int32_t jit_slot_offset(int slot) {
+  return (int32_t)sizeof(double) * slot;
+}
+
+/* prefix [rex] 0f op xmm(reg), xmm(rm) */
+static void jit_sse_rr(struct jit_buffer *buffer, unsigned prefix, unsigned op,
+                       int reg, int rm) {
+  jit_byte(buffer, prefix);
+  if (reg >= 8 || rm >= 8) {
+    jit_byte(buffer, 0x40 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+  }
+
+  jit_byte(buffer, 0x0F);
+  jit_byte(buffer, op);
+  jit_byte(buffer, 0xC0 | (unsigned)(reg & 7) << 3 | (unsigned)(rm & 7));
+}
+
+/* prefix [rex] 0f op xmm(reg), [rsp + offset] */
+static void jit_sse_stack(struct jit_buffer *buffer, unsigned prefix,
+                          unsigned op, int reg, int32_t offset) {
+  jit_byte(buffer, prefix);
+  if (reg >= 8) {
+    jit_byte(buffer, 0x44);
+  }
+
+  jit_byte(buffer, 0x0F);
+  jit_byte(buffer, op);
+  jit_byte(buffer, 0x84 | (unsigned)(reg & 7) << 3);
+  jit_byte(buffer, 0x24);
+  jit_bytes(buffer, (uint32_t)offset, 4);
+}
+
+/* prefix [rex] 0f op xmm(reg), [rax + offset] */
+static void jit_sse_rax(struct jit_buffer *buffer, unsigned prefix,
+                        unsigned op, int reg, int32_t offset) {
+  jit_byte(buffer, prefix);
+  if (reg >= 8) {
+    jit_byte(buffer, 0x44);
+  }
+
+  jit_byte(buffer, 0x0F);
+  jit_byte(buffer, op);
+  if (offset == 0) {
+    jit_byte(buffer, (unsigned)(reg & 7) << 3);
+  } else {
+    jit_byte(buffer, 0x80 | (unsigned)(reg & 7) << 3);
+    jit_bytes(buffer, (uint32_t)offset, 4);
+  }
+}
+
+/* mov rax, imm64 */
+static void jit_mov_rax(struct jit_buffer *buffer, uint64_t value) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0xB8);
+  jit_bytes(buffer, value, 8);
+}
+
+/* movq xmm(reg), rax */
+static void jit_movq_rax(struct jit_buffer *buffer, int reg) {
+  jit_byte(buffer, SSE_PREFIX_PD);
+  jit_byte(buffer, 0x48 | (reg >= 8 ? 0x4 : 0));
+  jit_byte(buffer, 0x0F);
+  jit_byte(buffer, 0x6E);
+  jit_byte(buffer, 0xC0 | (unsigned)(reg & 7) << 3);
+}
+
+/* mov [rsp + offset], rax */
+static void jit_store_rax(struct jit_buffer *buffer, int32_t offset) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0x89);
+  jit_byte(buffer, 0x84);
+  jit_byte(buffer, 0x24);
+  jit_bytes(buffer, (uint32_t)offset, 4);
+}
+
+/* mov [rsp + offset], rsi */
+static void jit_store_rsi(struct jit_buffer *buffer, int32_t offset) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0x89);
+  jit_byte(buffer, 0xB4);
+  jit_byte(buffer, 0x24);
+  jit_bytes(buffer, (uint32_t)offset, 4);
+}
+
+/* mov rax, [rsp + offset] */
+static void jit_load_rax(struct jit_buffer *buffer, int32_t offset) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0x8B);
+  jit_byte(buffer, 0x84);
+  jit_byte(buffer, 0x24);
+  jit_bytes(buffer, (uint32_t)offset, 4);
+}
+
+/* lea rdi, [rsp + offset] */
+static void jit_lea_rdi(struct jit_buffer *buffer, int32_t offset) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0x8D);
+  jit_byte(buffer, 0xBC);
+  jit_byte(buffer, 0x24);
+  jit_bytes(buffer, (uint32_t)offset, 4);
+}
+
+/* add rsp, imm32 when `grow` is false, sub rsp, imm32 otherwise */
+static void jit_adjust_rsp(struct jit_buffer *buffer, int32_t size,
+                           bool grow) {
+  jit_byte(buffer, 0x48);
+  jit_byte(buffer, 0x81);
+  jit_byte(buffer, grow ? 0xEC : 0xC4);
+  jit_bytes(buffer, (uint32_t)size, 4);
+}
+
+static void jit_call(struct jit_buffer *buffer, uint64_t function) {
+  jit_mov_rax(buffer, function);
+
+  /* call rax */
+  jit_byte(buffer, 0xFF);
+  jit_byte(buffer, 0xD0);
+}
+
+/* Returns register holding `slot`, memory slots are loaded into `scratch` */
+static int jit_load_slot(struct jit_buffer *buffer, int slot, int scratch) {
+  if (jit_slot_in_register(slot)) {
+    return jit_slot_register(slot);
+  }
+
+  jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD, scratch,
+                jit_slot_offset(slot));
+  return scratch;
+}
+
+static void jit_move_slot(struct jit_buffer *buffer, int reg, int slot) {
+  if (jit_slot_in_register(slot)) {
+    jit_sse_rr(buffer, SSE_PREFIX_PD, SSE_MOVAPD, reg, jit_slot_register(slot));
+  } else {
+    jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD, reg,
+                  jit_slot_offset(slot));
+  }
+}
+
+static void jit_store_slot(struct jit_buffer *buffer, int slot, int reg) {
+  if (!jit_slot_in_register(slot)) {
+    jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_STORE, reg,
+                  jit_slot_offset(slot));
+  } else if (reg != jit_slot_register(slot)) {
+    jit_sse_rr(buffer, SSE_PREFIX_PD, SSE_MOVAPD, jit_slot_register(slot), reg);
+  }
+}
+
+/* Every xmm register is caller saved, keep live slots in memory over calls */
+static void jit_spill(struct jit_buffer *buffer, int end) {
+  for (int slot = 0; slot < end && jit_slot_in_register(slot); ++slot) {
+    jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_STORE,
+                  jit_slot_register(slot), jit_slot_offset(slot));
+  }
+}
+
+static void jit_reload(struct jit_buffer *buffer, int end) {
+  for (int slot = 0; slot < end && jit_slot_in_register(slot); ++slot) {
+    jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD,
+                  jit_slot_register(slot), jit_slot_offset(slot));
+  }
+}
+
+static void jit_emit_arithmetic(struct jit_buffer *buffer, unsigned op,
+                                int slot) {
+  const int left = jit_load_slot(buffer, slot, 0);
+  const int right = slot + 1;
+
+  if (jit_slot_in_register(right)) {
+    jit_sse_rr(buffer, SSE_PREFIX_SD, op, left, jit_slot_register(right));
+  } else {
+    jit_sse_stack(buffer, SSE_PREFIX_SD, op, left, jit_slot_offset(right));
+  }
+
+  jit_store_slot(buffer, slot, left);
+}
+
+static void jit_emit_libm(struct jit_buffer *buffer, double (*function)(double,
+                                                                        double),
+                          int slot) {
+  jit_spill(buffer, slot);
+  jit_move_slot(buffer, 0, slot);
+  jit_move_slot(buffer, 1, slot + 1);
+
+  jit_call(buffer, (uint64_t)(uintptr_t)function);
+
+  jit_reload(buffer, slot);
+  jit_store_slot(buffer, slot, 0);
+}
+
+/* Applies `op` with a constant mask to the slot, used for sign operations */
+static void jit_emit_mask(struct jit_buffer *buffer, unsigned op,
+                          uint64_t mask, int slot) {
+  const int reg = jit_load_slot(buffer, slot, 0);
+
+  jit_mov_rax(buffer, mask);
+  jit_movq_rax(buffer, 1);
+  jit_sse_rr(buffer, SSE_PREFIX_PD, op, reg, 1);
+
+  jit_store_slot(buffer, slot, reg);
+}
+
+static void jit_emit_function(struct jit_buffer *buffer,
+                              const struct math_eval_function *function,
+                              int slot) {
+  /* Builtins with a single instruction equivalent are inlined */
+  if (function->kernel == math_eval_kernel_sqrt) {
+    const int reg = jit_load_slot(buffer, slot, 0);
+
+    jit_sse_rr(buffer, SSE_PREFIX_SD, SSE_SQRT, reg, reg);
+    jit_store_slot(buffer, slot, reg);
+    return;
+  }
+
+  if (function->kernel == math_eval_kernel_abs) {
+    jit_emit_mask(buffer, SSE_AND, ABS_MASK, slot);
+    return;
+  }
+
+  /* Arguments are passed as a pointer into the spilled value stack */
+  jit_spill(buffer, slot + function->args_count);
+  jit_lea_rdi(buffer, jit_slot_offset(slot));
+
+  jit_call(buffer, (uint64_t)(uintptr_t)function->function);
+
+  jit_reload(buffer, slot);
+  jit_store_slot(buffer, slot, 0);
+}
+
+/* Locals are kept in memory right above the value stack */
+static inline int32_t jit_local_offset(const struct math_eval_program *program,
+                                       int index) {
+  return jit_slot_offset(program->stack_size + index);
+}
+
+/* Frame pointer, passed in rsi, is saved right above the locals */
+static inline int32_t
+jit_frame_pointer_offset(const struct math_eval_program *program) {
+  return jit_local_offset(program, program->locals_count);
+}
+
+static int32_t jit_frame_size(const struct math_eval_program *program) {
+  const int saved = program->frame_size > 0 ? 1 : 0;
+
+  /* Keeps rsp 16 byte aligned at calls, return address takes 8 bytes */
+  const int32_t size =
+      jit_local_offset(program, program->locals_count + saved) + 8;
+  return ((size + 15) & ~15) - 8;
+}
+
+static void jit_emit_program(struct jit_buffer *buffer,
+                             const struct math_eval_program *program) {
+  const int32_t frame_size = jit_frame_size(program);
+  int depth = 0;
+
+  jit_adjust_rsp(buffer, frame_size, true);
+  if (program->frame_size > 0) {
+    jit_store_rsi(buffer, jit_frame_pointer_offset(program));
+  }
+
+  for (int i = 0; i < program->instructions_count; ++i) {
+    const struct math_eval_instruction *ip = &program->instructions[i];
+
+    switch (ip->opcode) {
+    case MATH_EVAL_OPCODE_NUMBER: {
+      uint64_t bits;
+      memcpy(&bits, &ip->number, sizeof(bits));
+
+      jit_mov_rax(buffer, bits);
+      if (jit_slot_in_register(depth)) {
+        jit_movq_rax(buffer, jit_slot_register(depth));
+      } else {
+        jit_store_rax(buffer, jit_slot_offset(depth));
+      }
+
+      depth += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_VARIABLE: {
+      const int reg =
+          jit_slot_in_register(depth) ? jit_slot_register(depth) : 0;
+
+      jit_mov_rax(buffer, (uint64_t)(uintptr_t)ip->variable);
+      jit_sse_rax(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD, reg, 0);
+      jit_store_slot(buffer, depth, reg);
+
+      depth += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_FRAME: {
+      const int reg =
+          jit_slot_in_register(depth) ? jit_slot_register(depth) : 0;
+
+      /* rsi doesn't survive calls, the frame is reloaded every time */
+      jit_load_rax(buffer, jit_frame_pointer_offset(program));
+      jit_sse_rax(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD, reg,
+                  jit_slot_offset(ip->index));
+      jit_store_slot(buffer, depth, reg);
+
+      depth += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_ADD:
+      depth -= 1;
+      jit_emit_arithmetic(buffer, SSE_ADD, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_SUB:
+      depth -= 1;
+      jit_emit_arithmetic(buffer, SSE_SUB, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_DIV:
+      depth -= 1;
+      jit_emit_arithmetic(buffer, SSE_DIV, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_MUL:
+      depth -= 1;
+      jit_emit_arithmetic(buffer, SSE_MUL, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_REM:
+      depth -= 1;
+      jit_emit_libm(buffer, fmod, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_EXP:
+      depth -= 1;
+      jit_emit_libm(buffer, pow, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_NEGATE:
+      jit_emit_mask(buffer, SSE_XOR, SIGN_MASK, depth - 1);
+      break;
+
+    case MATH_EVAL_OPCODE_CALL:
+      depth -= ip->function->args_count;
+      jit_emit_function(buffer, ip->function, depth);
+      depth += 1;
+      break;
+
+    case MATH_EVAL_OPCODE_LOAD: {
+      const int reg =
+          jit_slot_in_register(depth) ? jit_slot_register(depth) : 0;
+
+      jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_LOAD, reg,
+                    jit_local_offset(program, ip->index));
+      jit_store_slot(buffer, depth, reg);
+
+      depth += 1;
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_STORE: {
+      const int reg = jit_load_slot(buffer, depth - 1, 0);
+
+      jit_sse_stack(buffer, SSE_PREFIX_SD, SSE_MOVSD_STORE, reg,
+                    jit_local_offset(program, ip->index));
+      break;
+    }
+
+    case MATH_EVAL_OPCODE_RETURN:
+      assert(depth == 1);
+
+      jit_move_slot(buffer, 0, 0);
+      jit_adjust_rsp(buffer, frame_size, false);
+
+      /* ret */
+      jit_byte(buffer, 0xC3);
+      break;
+
+    case MATH_EVAL_OPCODE_OUTPUT:
+    case MATH_EVAL_OPCODE_HALT:
+      assert(0 && "Native code returns a single result");
+      break;
+    }
+  }
+}
+
+/* Code reading a frame is only called by `math_eval_expr_frame` */
+static double jit_no_frame(const struct math_eval_expression *expr) {
+  (void)expr;
+  return NAN;
+}
+
+static bool jit_map_code(struct math_eval_node_native *native) {
+  struct jit_buffer buffer = {0};
+  jit_emit_program(&buffer, native->program);
+
+  /* Written while writable, executable only after that */
+  void *code = mmap(NULL, buffer.size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return false;
+  }
+
+  const size_t size = buffer.size;
+  buffer = (struct jit_buffer){.code = code};
+  jit_emit_program(&buffer, native->program);
+  assert(buffer.size == size);
+
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    return false;
+  }
+
+  native->code = code;
+  native->code_size = size;
+
+  /* Generated code takes the expression just like any other `value` */
+  memcpy(&native->frame_value, &native->code, sizeof(native->frame_value));
+  if (native->program->frame_size > 0) {
+    native->node.value = jit_no_frame;
+  } else {
+    memcpy(&native->node.value, &native->code, sizeof(native->node.value));
+  }
+
+  return true;
+}
+
+bool math_eval_jit_available(void) { return true; }
+
+struct math_eval_expression *
+math_eval_jit_compile_program(struct math_eval_program *program) {
+  assert(program != NULL);
+
+  struct math_eval_node_native *native = yu_calloc(1, sizeof(*native));
+  if (!native) {
+    return NULL;
+  }
+
+  native->node.type = MATH_EVAL_NATIVE;
+  native->program = program;
+
+  if (!jit_map_code(native)) {
+    native->program = NULL;
+    math_eval_jit_destroy(native);
+    return NULL;
+  }
+
+  return &native->node;
+}
+
+struct math_eval_expression *
+math_eval_jit_compile(const struct math_eval_expression *expr) {
+  assert(expr != NULL);
+
+  struct math_eval_program *program = math_eval_program_create(expr);
+  if (!program) {
+    return NULL;
+  }
+
+  struct math_eval_expression *native = math_eval_jit_compile_program(program);
+  if (!native) {
+    math_eval_program_destroy(program);
+  }
+
+  return native;
+}
+
+void math_eval_jit_destroy(struct math_eval_node_native *native) {
+  if (!native) {
+    return;
+  }
+
+  if (native->code) {
+    munmap(native->code, native->code_size);
+  }
+
+  math_eval_program_destroy(native->program);
+  yu_free(native);
+}
+
+#else
+
+bool math_eval_jit_available(void) { return false; }
+
+struct math_eval_expression *
+math_eval_jit_compile(const struct math_eval_expression *expr) {
+  (void)expr;
+  return NULL;
+}
+
+struct math_eval_expression *
+math_eval_jit_compile_program(struct math_eval_program *program) {
+  (void)program;
+  return NULL;
+}
+
+void math_eval_jit_destroy(struct math_eval_node_native *native) {
+  assert(native == NULL && "JIT is not available");
+  (void)native;
+}
+
+#endif /* MATH_EVAL_JIT_X86_64 */
@@ -0,0 +1,267 @@
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "math_eval/batch.h"
+#include "math_eval/kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATH_EVAL_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define BLOCK_SIZE MATH_EVAL_BATCH_BLOCK_SIZE
+
+/* Adding 1.5 * 2^52 rounds to an integer that sits in the low mantissa bits */
+#define MAGIC_ROUND 0x1.8p52
+#define MAGIC_ROUND_BITS 0x4338000000000000
+
+#define SQRT2 1.41421356237309514547e+00
+#define LOG2E 1.44269504088896338700e+00
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+
+#define EXP_OVERFLOW 7.09782712893383973096e+02
+#define EXP_UNDERFLOW -7.45133219101941108420e+02
+
+/* Polynomial coefficients from fdlibm */
+#define LG1 6.666666666666735130e-01
+#define LG2 3.999999999940941908e-01
+#define LG3 2.857142874366239149e-01
+#define LG4 2.222219843214978396e-01
+#define LG5 1.818357216161805012e-01
+#define LG6 1.531383769920937332e-01
+#define LG7 1.479819860511658591e-01
+
+#define S1 -1.66666666666666324348e-01
+#define S2 8.33333333332248946124e-03
+#define S3 -1.98412698298579493134e-04
+#define S4 2.75573137070700676789e-06
+#define S5 -2.50507602534068634195e-08
+#define S6 1.58969099521155010221e-10
+
+#define C1 4.16666666666666019037e-02
+#define C2 -1.38888888888741095749e-03
+#define C3 2.48015872894767294178e-05
+#define C4 -2.75573143513906633035e-07
+#define C5 2.08757232129817482790e-09
+#define C6 -1.13596475577881948265e-11
+
+/* pi / 2 split into 33 bit chunks, so that q * PIO2_N is exact */
+#define TWO_OVER_PI 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_2T 2.02226624879595063154e-21
+#define TRIG_REDUCTION_LIMIT 1e5
+
+#define SCALAR_MAP_UNARY(name, expression)                                     \
+  static void scalar_kernel_##name(double *block, size_t n) {                  \
+    for (size_t i = 0; i < n; ++i) {                                           \
+      const double x = block[i];                                               \
+      block[i] = (expression);                                                 \
+    }                                                                          \
+  }
+
+#define SCALAR_MAP_BINARY(name, expression)                                    \
+  static void scalar_kernel_##name(double *block, size_t n) {                  \
+    const double *right = block + BLOCK_SIZE;                                  \
+    for (size_t i = 0; i < n; ++i) {                                           \
+      const double a = block[i];                                               \
+      const double b = right[i];                                               \
+      block[i] = (expression);                                                 \
+    }                                                                          \
+  }
+
+SCALAR_MAP_BINARY(add, a + b)
+SCALAR_MAP_BINARY(sub, a - b)
+SCALAR_MAP_BINARY(div, a / b)
+SCALAR_MAP_BINARY(mul, a * b)
+SCALAR_MAP_BINARY(rem, fmod(a, b))
+SCALAR_MAP_BINARY(pow, pow(a, b))
+SCALAR_MAP_BINARY(min, fmin(a, b))
+SCALAR_MAP_BINARY(max, fmax(a, b))
+
+SCALAR_MAP_UNARY(negate, -x)
+SCALAR_MAP_UNARY(sin, sin(x))
+SCALAR_MAP_UNARY(cos, cos(x))
+SCALAR_MAP_UNARY(exp, exp(x))
+SCALAR_MAP_UNARY(log, log(x))
+SCALAR_MAP_UNARY(sqrt, sqrt(x))
+SCALAR_MAP_UNARY(abs, fabs(x))
+SCALAR_MAP_UNARY(floor, floor(x))
+SCALAR_MAP_UNARY(ceil, ceil(x))
+SCALAR_MAP_UNARY(round, round(x))
+
+static const struct math_eval_kernels scalar_kernels = {
+    .isa = MATH_EVAL_ISA_SCALAR,
+
+    .add = scalar_kernel_add,
+    .sub = scalar_kernel_sub,
+    .div = scalar_kernel_div,
+    .mul = scalar_kernel_mul,
+    .rem = scalar_kernel_rem,
+    .pow = scalar_kernel_pow,
+    .negate = scalar_kernel_negate,
+
+    .sin = scalar_kernel_sin,
+    .cos = scalar_kernel_cos,
+    .exp = scalar_kernel_exp,
+    .log = scalar_kernel_log,
+    .sqrt = scalar_kernel_sqrt,
+    .abs = scalar_kernel_abs,
+    .floor = scalar_kernel_floor,
+    .ceil = scalar_kernel_ceil,
+    .round = scalar_kernel_round,
+    .min = scalar_kernel_min,
+    .max = scalar_kernel_max,
+};
+
+#ifdef MATH_EVAL_X86_KERNELS
+
+#define KERNEL_ISA sse2
+#define KERNEL_ISA_ID MATH_EVAL_ISA_SSE2
+#define KERNEL_TARGET "sse2"
+#define KERNEL_LANES 2
+#define KERNEL_SQRT(v) ((vdouble)_mm_sqrt_pd((__m128d)(v)))
+#include "kernels_impl.h"
+#undef KERNEL_SQRT
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+#undef KERNEL_ISA_ID
+#undef KERNEL_ISA
+
+#define KERNEL_ISA avx2
+#define KERNEL_ISA_ID MATH_EVAL_ISA_AVX2
+#define KERNEL_TARGET "avx2"
+#define KERNEL_LANES 4
+#define KERNEL_SQRT(v) ((vdouble)_mm256_sqrt_pd((__m256d)(v)))
+#include "kernels_impl.h"
+#undef KERNEL_SQRT
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+#undef KERNEL_ISA_ID
+#undef KERNEL_ISA
+
+#define KERNEL_ISA avx512
+#define KERNEL_ISA_ID MATH_EVAL_ISA_AVX512
+#define KERNEL_TARGET "avx512f"
+#define KERNEL_LANES 8
+#define KERNEL_SQRT(v) ((vdouble)_mm512_sqrt_pd((__m512d)(v)))
+#include "kernels_impl.h"
+#undef KERNEL_SQRT
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+#undef KERNEL_ISA_ID
+#undef KERNEL_ISA
+
+#endif /* MATH_EVAL_X86_KERNELS */
+
+/* Read by every batch worker, detected on first use */
+static _Atomic(const struct math_eval_kernels *) selected_kernels = NULL;
+
+static const struct math_eval_kernels *
+kernels_for_isa(enum math_eval_isa isa) {
+  switch (isa) {
+#ifdef MATH_EVAL_X86_KERNELS
+  case MATH_EVAL_ISA_SSE2:
+    return &kernels_sse2;
+  case MATH_EVAL_ISA_AVX2:
+    return &kernels_avx2;
+  case MATH_EVAL_ISA_AVX512:
+    return &kernels_avx512;
+#else
+  case MATH_EVAL_ISA_SSE2:
+  case MATH_EVAL_ISA_AVX2:
+  case MATH_EVAL_ISA_AVX512:
+#endif
+  case MATH_EVAL_ISA_SCALAR:
+    break;
+  }
+
+  return &scalar_kernels;
+}
+
+enum math_eval_isa math_eval_kernels_detect(void) {
+#ifdef MATH_EVAL_X86_KERNELS
+  /* Uses CPUID, also checks that the OS saves the extended registers */
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f")) {
+    return MATH_EVAL_ISA_AVX512;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    return MATH_EVAL_ISA_AVX2;
+  }
+
+  if (__builtin_cpu_supports("sse2")) {
+    return MATH_EVAL_ISA_SSE2;
+  }
+#endif
+
+  return MATH_EVAL_ISA_SCALAR;
+}
+
+bool math_eval_kernels_select(enum math_eval_isa isa) {
+  if (isa > math_eval_kernels_detect()) {
+    return false;
+  }
+
+  atomic_store_explicit(&selected_kernels, kernels_for_isa(isa),
+                        memory_order_release);
+  return true;
+}
+
+const struct math_eval_kernels *math_eval_kernels_get(void) {
+  const struct math_eval_kernels *kernels =
+      atomic_load_explicit(&selected_kernels, memory_order_acquire);
+  if (kernels) {
+    return kernels;
+  }
+
+  /* Keeps kernels selected meanwhile, every thread detects the same ones */
+  const struct math_eval_kernels *detected =
+      kernels_for_isa(math_eval_kernels_detect());
+  if (atomic_compare_exchange_strong_explicit(&selected_kernels, &kernels,
+                                              detected, memory_order_acq_rel,
+                                              memory_order_acquire)) {
+    return detected;
+  }
+
+  return kernels;
+}
+
+const char *math_eval_isa_to_str(enum math_eval_isa isa) {
+  switch (isa) {
+  case MATH_EVAL_ISA_SCALAR:
+    return "scalar";
+  case MATH_EVAL_ISA_SSE2:
+    return "sse2";
+  case MATH_EVAL_ISA_AVX2:
+    return "avx2";
+  case MATH_EVAL_ISA_AVX512:
+    return "avx512";
+  }
+
+  return "unknown isa";
+}
+
+#define KERNEL_DISPATCH(name)                                                  \
+  void math_eval_kernel_##name(double *block, size_t n) {                      \
+    math_eval_kernels_get()->name(block, n);                                   \
+  }
+
+KERNEL_DISPATCH(sin)
+KERNEL_DISPATCH(cos)
+KERNEL_DISPATCH(exp)
+KERNEL_DISPATCH(log)
+KERNEL_DISPATCH(sqrt)
+KERNEL_DISPATCH(pow)
+KERNEL_DISPATCH(abs)
+KERNEL_DISPATCH(floor)
+KERNEL_DISPATCH(ceil)
+KERNEL_DISPATCH(round)
+KERNEL_DISPATCH(min)
+KERNEL_DISPATCH(max)
@@ -0,0 +1,365 @@
+/*
+ * Vector kernels, included by kernels.c once per instruction set.
+ *
+ * Expects:
+ *   KERNEL_ISA     - suffix of generated functions
+ *   KERNEL_ISA_ID  - `enum math_eval_isa` value
+ *   KERNEL_TARGET  - target attribute string
+ *   KERNEL_LANES   - number of doubles in a vector
+ *   KERNEL_SQRT(v) - vector square root
+ *
+ * Tails are computed in a padded vector, so every element gets the same
+ * result no matter where it sits in a block.
+ */
+
+#define KERNEL_CONCAT2(a, b) a##_##b
+#define KERNEL_CONCAT(a, b) KERNEL_CONCAT2(a, b)
+#define KERNEL(name) KERNEL_CONCAT(name, KERNEL_ISA)
+
+#define vdouble KERNEL(vdouble)
+#define vlong KERNEL(vlong)
+#define vulong KERNEL(vulong)
+
+#define KERNEL_INLINE                                                          \
+  static inline __attribute__((always_inline, target(KERNEL_TARGET)))
+#define KERNEL_FUNCTION static __attribute__((target(KERNEL_TARGET)))
+
+typedef double vdouble __attribute__((vector_size(8 * KERNEL_LANES)));
+typedef int64_t vlong __attribute__((vector_size(8 * KERNEL_LANES)));
+typedef uint64_t vulong __attribute__((vector_size(8 * KERNEL_LANES)));
+
+KERNEL_INLINE vdouble KERNEL(splat)(double x) {
+  const vdouble zero = {0};
+  return zero + x;
+}
+
+KERNEL_INLINE vdouble KERNEL(load)(const double *p) {
+  vdouble v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+KERNEL_INLINE void KERNEL(store)(double *p, vdouble v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+KERNEL_INLINE vdouble KERNEL(select)(vlong mask, vdouble a, vdouble b) {
+  return (vdouble)(((vlong)a & mask) | ((vlong)b & ~mask));
+}
+
+KERNEL_INLINE vdouble KERNEL(fabs)(vdouble x) {
+  return (vdouble)((vlong)x & INT64_MAX);
+}
+
+KERNEL_INLINE vdouble KERNEL(copysign)(vdouble x, vdouble sign) {
+  return (vdouble)(((vlong)x & INT64_MAX) | ((vlong)sign & INT64_MIN));
+}
+
+/* Integer valued `x` with |x| < 2^51 to its integer representation */
+KERNEL_INLINE vlong KERNEL(to_long)(vdouble x) {
+  return (vlong)(x + MAGIC_ROUND) - MAGIC_ROUND_BITS;
+}
+
+/* Integer `x` with |x| < 2^51 to double */
+KERNEL_INLINE vdouble KERNEL(to_double)(vlong x) {
+  return (vdouble)(x + MAGIC_ROUND_BITS) - MAGIC_ROUND;
+}
+
+/* Round to nearest even, valid for |x| < 2^51 */
+KERNEL_INLINE vdouble KERNEL(rint_small)(vdouble x) {
+  return (x + MAGIC_ROUND) - MAGIC_ROUND;
+}
+
+/* Truncate towards zero, values that are already integral pass through */
+KERNEL_INLINE vdouble KERNEL(trunc)(vdouble x) {
+  const vdouble ax = KERNEL(fabs)(x);
+
+  vdouble t = (ax + 0x1p52) - 0x1p52;
+  t -= KERNEL(select)(t > ax, KERNEL(splat)(1.0), KERNEL(splat)(0.0));
+
+  return KERNEL(select)(ax < 0x1p52, KERNEL(copysign)(t, x), x);
+}
+
+/* 2^n for integer valued n in [-1022, 1023] */
+KERNEL_INLINE vdouble KERNEL(pow2)(vdouble n) {
+  return (vdouble)((KERNEL(to_long)(n) + 1023) << 52);
+}
+
+KERNEL_INLINE vdouble KERNEL(exp)(vdouble x) {
+  const vdouble xc = KERNEL(select)(
+      x > EXP_OVERFLOW, KERNEL(splat)(EXP_OVERFLOW),
+      KERNEL(select)(x < EXP_UNDERFLOW, KERNEL(splat)(EXP_UNDERFLOW), x));
+
+  /* x = n * ln2 + r, |r| <= ln2 / 2 */
+  const vdouble n = KERNEL(rint_small)(xc * LOG2E);
+  vdouble r = xc - n * LN2_HI;
+  r = r - n * LN2_LO;
+
+  /* Taylor series of e^r */
+  vdouble p = KERNEL(splat)(1.0 / 6227020800.0);
+  p = p * r + 1.0 / 479001600.0;
+  p = p * r + 1.0 / 39916800.0;
+  p = p * r + 1.0 / 3628800.0;
+  p = p * r + 1.0 / 362880.0;
+  p = p * r + 1.0 / 40320.0;
+  p = p * r + 1.0 / 5040.0;
+  p = p * r + 1.0 / 720.0;
+  p = p * r + 1.0 / 120.0;
+  p = p * r + 1.0 / 24.0;
+  p = p * r + 1.0 / 6.0;
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+
+  /* Scale in two steps so that subnormal and near overflow results work */
+  const vdouble n1 = KERNEL(rint_small)(n * 0.5);
+  const vdouble n2 = n - n1;
+  vdouble result = p * KERNEL(pow2)(n1) * KERNEL(pow2)(n2);
+
+  result = KERNEL(select)(x > EXP_OVERFLOW, KERNEL(splat)(HUGE_VAL), result);
+  result = KERNEL(select)(x < EXP_UNDERFLOW, KERNEL(splat)(0.0), result);
+  return KERNEL(select)(x != x, x, result);
+}
+
+KERNEL_INLINE vdouble KERNEL(log)(vdouble x) {
+  /* Normalize subnormals */
+  const vlong subnormal = x < 0x1p-1022;
+  const vdouble xs = KERNEL(select)(subnormal, x * 0x1p54, x);
+
+  const vlong bits = (vlong)xs;
+  const vlong exponent = (vlong)(((vulong)bits >> 52) & 0x7ff) - 1023;
+
+  /* x = 2^k * m, m in [sqrt(2) / 2, sqrt(2)) */
+  vdouble m = (vdouble)((bits & 0x000fffffffffffff) | 0x3ff0000000000000);
+  const vlong big = m > SQRT2;
+  m = KERNEL(select)(big, m * 0.5, m);
+
+  const vdouble k = KERNEL(to_double)(exponent) +
+                    KERNEL(select)(big, KERNEL(splat)(1.0), KERNEL(splat)(0.0)) +
+                    KERNEL(select)(subnormal, KERNEL(splat)(-54.0),
+                                   KERNEL(splat)(0.0));
+
+  const vdouble f = m - 1.0;
+  const vdouble s = f / (2.0 + f);
+  const vdouble z = s * s;
+  const vdouble w = z * z;
+  const vdouble t1 = w * (LG2 + w * (LG4 + w * LG6));
+  const vdouble t2 = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+  const vdouble hfsq = 0.5 * f * f;
+
+  vdouble result = k * LN2_HI - ((hfsq - (s * (hfsq + t2 + t1) + k * LN2_LO)) - f);
+
+  result = KERNEL(select)(x == HUGE_VAL, x, result);
+  result = KERNEL(select)(x == 0.0, KERNEL(splat)(-HUGE_VAL), result);
+  return KERNEL(select)((x < 0.0) | (x != x), KERNEL(splat)(NAN), result);
+}
+
+/*
+ * Shared range reduction of sin and cos: x = q * pi / 2 + r + tail,
+ * |r| <= pi / 4. Arguments beyond `TRIG_REDUCTION_LIMIT` go through libm
+ * instead.
+ */
+KERNEL_INLINE vdouble KERNEL(trig_reduce)(vdouble x, vdouble *tail,
+                                          vlong *quadrant) {
+  const vdouble q = KERNEL(rint_small)(
+      KERNEL(select)(KERNEL(fabs)(x) < TRIG_REDUCTION_LIMIT, x,
+                     KERNEL(splat)(0.0)) *
+      TWO_OVER_PI);
+
+  /* Exact since pi / 2 is split into 33 bit chunks */
+  const vdouble t = x - q * PIO2_1;
+  vdouble w = q * PIO2_2;
+  const vdouble r = t - w;
+  w = q * PIO2_2T - ((t - r) - w);
+
+  const vdouble y = r - w;
+  *tail = (r - y) - w;
+  *quadrant = KERNEL(to_long)(q) & 3;
+  return y;
+}
+
+KERNEL_INLINE vdouble KERNEL(sin_poly)(vdouble x, vdouble y) {
+  const vdouble z = x * x;
+  const vdouble v = z * x;
+  const vdouble r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+
+  return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+KERNEL_INLINE vdouble KERNEL(cos_poly)(vdouble x, vdouble y) {
+  const vdouble z = x * x;
+  const vdouble r =
+      z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+  const vdouble hz = 0.5 * z;
+  const vdouble w = 1.0 - hz;
+
+  return w + (((1.0 - w) - hz) + (z * r - x * y));
+}
+
+KERNEL_INLINE vdouble KERNEL(sin)(vdouble x) {
+  vdouble tail;
+  vlong quadrant;
+  const vdouble r = KERNEL(trig_reduce)(x, &tail, &quadrant);
+
+  vdouble result =
+      KERNEL(select)((quadrant & 1) != 0, KERNEL(cos_poly)(r, tail),
+                     KERNEL(sin_poly)(r, tail));
+  result = KERNEL(select)((quadrant & 2) != 0, -result, result);
+
+  /* Keep the sign of zero */
+  result = KERNEL(select)(x == 0.0, x, result);
+
+  for (int i = 0; i < KERNEL_LANES; ++i) {
+    if (!(fabs(x[i]) < TRIG_REDUCTION_LIMIT)) {
+      result[i] = sin(x[i]);
+    }
+  }
+
+  return result;
+}
+
+KERNEL_INLINE vdouble KERNEL(cos)(vdouble x) {
+  vdouble tail;
+  vlong quadrant;
+  const vdouble r = KERNEL(trig_reduce)(x, &tail, &quadrant);
+
+  vdouble result =
+      KERNEL(select)((quadrant & 1) != 0, KERNEL(sin_poly)(r, tail),
+                     KERNEL(cos_poly)(r, tail));
+  result = KERNEL(select)(((quadrant + 1) & 2) != 0, -result, result);
+
+  for (int i = 0; i < KERNEL_LANES; ++i) {
+    if (!(fabs(x[i]) < TRIG_REDUCTION_LIMIT)) {
+      result[i] = cos(x[i]);
+    }
+  }
+
+  return result;
+}
+
+KERNEL_INLINE vdouble KERNEL(min)(vdouble a, vdouble b) {
+  /* Same NaN handling as `fmin` */
+  const vdouble result = KERNEL(select)(a < b, a, b);
+  return KERNEL(select)(a != a, b, KERNEL(select)(b != b, a, result));
+}
+
+KERNEL_INLINE vdouble KERNEL(max)(vdouble a, vdouble b) {
+  const vdouble result = KERNEL(select)(a > b, a, b);
+  return KERNEL(select)(a != a, b, KERNEL(select)(b != b, a, result));
+}
+
+KERNEL_INLINE vdouble KERNEL(floor)(vdouble x) {
+  const vdouble t = KERNEL(trunc)(x);
+  return KERNEL(select)(t > x, t - 1.0, t);
+}
+
+KERNEL_INLINE vdouble KERNEL(ceil)(vdouble x) {
+  const vdouble t = KERNEL(trunc)(x);
+  return KERNEL(select)(t < x, t + 1.0, t);
+}
+
+KERNEL_INLINE vdouble KERNEL(round)(vdouble x) {
+  /* Halfway cases are rounded away from zero */
+  const vdouble ax = KERNEL(fabs)(x);
+  vdouble t = KERNEL(trunc)(ax);
+  t += KERNEL(select)(ax - t >= 0.5, KERNEL(splat)(1.0), KERNEL(splat)(0.0));
+
+  return KERNEL(copysign)(t, x);
+}
+
+KERNEL_INLINE vdouble KERNEL(sqrt)(vdouble x) { return KERNEL_SQRT(x); }
+
+#define KERNEL_MAP_UNARY(name, expression)                                     \
+  KERNEL_FUNCTION void KERNEL(kernel_##name)(double *block, size_t n) {        \
+    size_t i = 0;                                                              \
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {                         \
+      const vdouble x = KERNEL(load)(block + i);                               \
+      KERNEL(store)(block + i, (expression));                                  \
+    }                                                                          \
+                                                                               \
+    if (i < n) {                                                               \
+      double tail[KERNEL_LANES] = {0};                                         \
+      memcpy(tail, block + i, sizeof(*block) * (n - i));                       \
+                                                                               \
+      const vdouble x = KERNEL(load)(tail);                                    \
+      KERNEL(store)(tail, (expression));                                       \
+      memcpy(block + i, tail, sizeof(*block) * (n - i));                       \
+    }                                                                          \
+  }
+
+#define KERNEL_MAP_BINARY(name, expression)                                    \
+  KERNEL_FUNCTION void KERNEL(kernel_##name)(double *block, size_t n) {        \
+    const double *right = block + MATH_EVAL_BATCH_BLOCK_SIZE;                  \
+                                                                               \
+    size_t i = 0;                                                              \
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {                         \
+      const vdouble a = KERNEL(load)(block + i);                               \
+      const vdouble b = KERNEL(load)(right + i);                               \
+      KERNEL(store)(block + i, (expression));                                  \
+    }                                                                          \
+                                                                               \
+    if (i < n) {                                                               \
+      double tail_a[KERNEL_LANES] = {0};                                       \
+      double tail_b[KERNEL_LANES] = {0};                                       \
+      memcpy(tail_a, block + i, sizeof(*block) * (n - i));                     \
+      memcpy(tail_b, right + i, sizeof(*block) * (n - i));                     \
+                                                                               \
+      const vdouble a = KERNEL(load)(tail_a);                                  \
+      const vdouble b = KERNEL(load)(tail_b);                                  \
+      KERNEL(store)(tail_a, (expression));                                     \
+      memcpy(block + i, tail_a, sizeof(*block) * (n - i));                     \
+    }                                                                          \
+  }
+
+KERNEL_MAP_BINARY(add, a + b)
+KERNEL_MAP_BINARY(sub, a - b)
+KERNEL_MAP_BINARY(div, a / b)
+KERNEL_MAP_BINARY(mul, a * b)
+KERNEL_MAP_BINARY(min, KERNEL(min)(a, b))
+KERNEL_MAP_BINARY(max, KERNEL(max)(a, b))
+
+KERNEL_MAP_UNARY(negate, -x)
+KERNEL_MAP_UNARY(sin, KERNEL(sin)(x))
+KERNEL_MAP_UNARY(cos, KERNEL(cos)(x))
+KERNEL_MAP_UNARY(exp, KERNEL(exp)(x))
+KERNEL_MAP_UNARY(log, KERNEL(log)(x))
+KERNEL_MAP_UNARY(sqrt, KERNEL(sqrt)(x))
+KERNEL_MAP_UNARY(abs, KERNEL(fabs)(x))
+KERNEL_MAP_UNARY(floor, KERNEL(floor)(x))
+KERNEL_MAP_UNARY(ceil, KERNEL(ceil)(x))
+KERNEL_MAP_UNARY(round, KERNEL(round)(x))
+
+static const struct math_eval_kernels KERNEL(kernels) = {
+    .isa = KERNEL_ISA_ID,
+
+    .add = KERNEL(kernel_add),
+    .sub = KERNEL(kernel_sub),
+    .div = KERNEL(kernel_div),
+    .mul = KERNEL(kernel_mul),
+    .rem = scalar_kernel_rem,
+    .pow = scalar_kernel_pow,
+    .negate = KERNEL(kernel_negate),
+
+    .sin = KERNEL(kernel_sin),
+    .cos = KERNEL(kernel_cos),
+    .exp = KERNEL(kernel_exp),
+    .log = KERNEL(kernel_log),
+    .sqrt = KERNEL(kernel_sqrt),
+    .abs = KERNEL(kernel_abs),
+    .floor = KERNEL(kernel_floor),
+    .ceil = KERNEL(kernel_ceil),
+    .round = KERNEL(kernel_round),
+    .min = KERNEL(kernel_min),
+    .max = KERNEL(kernel_max),
+};
+
+#undef KERNEL_MAP_UNARY
+#undef KERNEL_MAP_BINARY
+#undef KERNEL_FUNCTION
+#undef KERNEL_INLINE
+#undef vulong
+#undef vlong
+#undef vdouble
+#undef KERNEL
+#undef KERNEL_CONCAT
+#undef KERNEL_CONCAT2
@@ -0,0 +1,11 @@
+#ifndef MATH_EVAL_NUMBER_H
+#define MATH_EVAL_NUMBER_H
+
+/*
+ * Reads the unsigned number starting at `s`, which can't go past `end`.
+ * Returns its length, or 0 if it's malformed, and stores the value `strtod`
+ * would read from it whatever the locale.
+ */
+int math_eval_scan_number(const char *s, const char *end, double *value);
+
+#endif /* !MATH_EVAL_NUMBER_H */
@@ -0,0 +1,472 @@
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "math_eval/kernels.h"
+#include "math_eval/log.h"
+#include "math_eval/parser.h"
+
+#include "builtins.h"
+#include "float_compare.h"
+#include "one_shot.h"
+
+/*
+ * The grammar is walked exactly like `parser.c` does, with values in place of
+ * nodes, so syntax errors are found and reported the same way. Values follow
+ * the compiler: those it folds into numbers are `constant`, which decides how
+ * powers are rewritten, and nothing is reported until the expression is
+ * known to be free of syntax errors.
+ */
+
+enum one_shot_kind {
+  ONE_SHOT_INVALID, /* Where the parser would have no node */
+  ONE_SHOT_VALUE,
+  ONE_SHOT_IDENTIFIER, /* Either a variable or a callee, not yet known */
+};
+
+struct one_shot_value {
+  enum one_shot_kind kind;
+
+  double value;
+  bool constant; /* Folded into a number by the compiler */
+  bool pure;     /* No call to a user function is left in it */
+
+  struct token token; /* Identifier */
+};
+
+struct one_shot {
+  struct parser parser;
+  struct symbol_table *table;
+
+  /* User functions are only called once the expression is known valid */
+  bool calls;
+  bool deferred;
+
+  /* First error in the order the compiler visits nodes */
+  struct math_eval_error error;
+};
+
+static struct one_shot_value one_shot_expression(struct one_shot *state);
+static struct one_shot_value one_shot_unary(struct one_shot *state);
+
+static const struct one_shot_value one_shot_invalid = {
+    .kind = ONE_SHOT_INVALID,
+    .value = NAN,
+};
+
+static inline struct one_shot_value one_shot_number(double value) {
+  return (struct one_shot_value){
+      .kind = ONE_SHOT_VALUE,
+      .value = value,
+      .constant = true,
+      .pure = true,
+  };
+}
+
+static void one_shot_fail(struct one_shot *state,
+                          enum math_eval_error_code code, struct token token) {
+  if (state->error.code == EVAL_NO_ERROR) {
+    state->error.code = code;
+    state->error.offset = token.offset;
+    state->error.size = token.size;
+  }
+}
+
+static void one_shot_resolve(struct one_shot *state,
+                             struct one_shot_value *value) {
+  if (value->kind != ONE_SHOT_IDENTIFIER) {
+    return;
+  }
+
+  const struct token token = value->token;
+
+  char name[token.size + 1];
+  memcpy(name, state->parser.tokenizer.str + token.offset, (size_t)token.size);
+  name[token.size] = '\0';
+
+  const struct math_eval_variable *variable =
+      symbol_table_find_variable(state->table, name);
+  if (!variable) {
+    one_shot_fail(state, EVAL_ERR_NO_VARIABLE, token);
+    *value = one_shot_invalid;
+    return;
+  }
+
+  *value = (struct one_shot_value){
+      .kind = ONE_SHOT_VALUE,
+      .value = variable->value,
+      .constant = variable->constant,
+      .pure = true,
+  };
+}
+
+static enum math_eval_arithmetic_operation
+one_shot_operation(enum token_type type) {
+  switch (type) {
+  case TOK_PLUS:
+    return MATH_EVAL_OP_ADD;
+  case TOK_MINUS:
+    return MATH_EVAL_OP_SUB;
+  case TOK_FORW_SLASH:
+    return MATH_EVAL_OP_DIV;
+  case TOK_ASTERISK:
+    return MATH_EVAL_OP_MUL;
+  case TOK_PERCENT:
+    return MATH_EVAL_OP_REM;
+  default:
+    return MATH_EVAL_OP_EXP;
+  }
+}
+
+static double one_shot_evaluate(enum math_eval_arithmetic_operation op,
+                                double left, double right) {
+  switch (op) {
+  case MATH_EVAL_OP_ADD:
+    return left + right;
+  case MATH_EVAL_OP_SUB:
+    return left - right;
+  case MATH_EVAL_OP_DIV:
+    return left / right;
+  case MATH_EVAL_OP_MUL:
+    return left * right;
+  case MATH_EVAL_OP_REM:
+    return fmod(left, right);
+  case MATH_EVAL_OP_EXP:
+    return pow(left, right);
+  }
+
+  return NAN;
+}
+
+/* Operands are resolved, other rewrites of the compiler don't change bits */
+static struct one_shot_value one_shot_combine(
+    enum math_eval_arithmetic_operation op, struct one_shot_value left,
+    struct one_shot_value right) {
+  if (left.kind == ONE_SHOT_INVALID || right.kind == ONE_SHOT_INVALID) {
+    return one_shot_invalid;
+  }
+
+  if (left.constant && right.constant) {
+    return one_shot_number(one_shot_evaluate(op, left.value, right.value));
+  }
+
+  struct one_shot_value result = {
+      .kind = ONE_SHOT_VALUE,
+      .pure = left.pure && right.pure,
+  };
+
+  if (op == MATH_EVAL_OP_EXP && right.constant) {
+    const double r = right.value;
+
+    if (math_eval_float_equal(r, 1)) {
+      return left;
+    }
+
+    if (math_eval_float_equal(r, 0) && left.pure) {
+      return one_shot_number(1);
+    }
+
+    /* The compiler expands both into exact arithmetic, x ^ 2 for a pure x */
+    if (math_eval_float_equal(r, 2) && left.pure) {
+      result.value = left.value * left.value;
+      return result;
+    }
+
+    if (math_eval_float_equal(r, -1)) {
+      result.value = 1 / left.value;
+      return result;
+    }
+  }
+
+  result.value = one_shot_evaluate(op, left.value, right.value);
+  return result;
+}
+
+static struct one_shot_value one_shot_binary(struct one_shot *state,
+                                             struct token token,
+                                             struct one_shot_value left,
+                                             struct one_shot_value right) {
+  one_shot_resolve(state, &left);
+  one_shot_resolve(state, &right);
+
+  return one_shot_combine(one_shot_operation(token.type), left, right);
+}
+
+/* Arguments follow the function check, and so do their errors */
+static struct one_shot_value one_shot_call(struct one_shot *state,
+                                           struct token callee) {
+  char name[callee.size + 1];
+  memcpy(name, state->parser.tokenizer.str + callee.offset,
+         (size_t)callee.size);
+  name[callee.size] = '\0';
+
+  const struct math_eval_function *function =
+      symbol_table_find_function(state->table, name);
+  if (!function) {
+    one_shot_fail(state, EVAL_ERR_NO_FUNCTION, callee);
+  }
+
+  const bool first = state->error.code == EVAL_NO_ERROR;
+  const int expected = function ? function->args_count : 0;
+
+  struct one_shot_value args[expected > 0 ? expected : 1];
+  int args_count = 0;
+  bool valid = function != NULL;
+
+  if (parser_token_is(&state->parser, TOK_CLOSE_PAREN)) {
+    parser_eat(&state->parser, TOK_CLOSE_PAREN);
+  } else {
+    do {
+      if (args_count > 0) {
+        parser_eat(&state->parser, TOK_COMMA);
+      }
+
+      struct one_shot_value arg = one_shot_expression(state);
+      one_shot_resolve(state, &arg);
+
+      valid = valid && arg.kind != ONE_SHOT_INVALID;
+      if (args_count < expected) {
+        args[args_count] = arg;
+      }
+      args_count += 1;
+    } while (parser_token_is(&state->parser, TOK_COMMA) &&
+             args_count < AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS);
+
+    parser_eat(&state->parser, TOK_CLOSE_PAREN);
+  }
+
+  if (function && args_count != expected) {
+    /* Checked before the arguments are compiled */
+    if (first) {
+      state->error.code = EVAL_ERR_ARGS_MISMATCH;
+      state->error.offset = callee.offset;
+      state->error.size = callee.size;
+      state->error.function_error.args_count_got = args_count;
+      state->error.function_error.args_count_expected = expected;
+    }
+
+    return one_shot_invalid;
+  }
+
+  if (!valid) {
+    return one_shot_invalid;
+  }
+
+  const bool builtin = math_eval_builtin_name(function->function) != NULL;
+  bool constant = true;
+  bool pure = builtin;
+
+  double values[expected > 0 ? expected : 1];
+  for (int i = 0; i < expected; ++i) {
+    values[i] = args[i].value;
+    constant = constant && args[i].constant;
+    pure = pure && args[i].pure;
+  }
+
+  if (!constant && function->kernel == math_eval_kernel_pow && expected == 2) {
+    return one_shot_combine(MATH_EVAL_OP_EXP, args[0], args[1]);
+  }
+
+  struct one_shot_value result = {
+      .kind = ONE_SHOT_VALUE,
+      .value = NAN,
+      .constant = constant,
+      .pure = constant || pure,
+  };
+
+  /* Past a deferred call values are thrown away, only errors are looked for */
+  if (!state->calls && !builtin) {
+    state->deferred = true;
+  } else if (!state->deferred) {
+    result.value = function->function(values);
+  }
+
+  return result;
+}
+
+static struct one_shot_value one_shot_basic(struct one_shot *state) {
+  struct parser *parser = &state->parser;
+
+  if (parser_token_is(parser, TOK_OPEN_PAREN)) {
+    parser_eat(parser, TOK_OPEN_PAREN);
+    struct one_shot_value value = one_shot_expression(state);
+    parser_eat(parser, TOK_CLOSE_PAREN);
+    return value;
+  }
+
+  if (parser_token_is(parser, TOK_NUMBER)) {
+    return one_shot_number(parser_eat(parser, TOK_NUMBER).value);
+  }
+
+  if (parser_token_is(parser, TOK_IDENTIFIER)) {
+    return (struct one_shot_value){
+        .kind = ONE_SHOT_IDENTIFIER,
+        .token = parser_eat(parser, TOK_IDENTIFIER),
+    };
+  }
+
+  parser->error_codes |= AST_ERR_EXPECTED_EXPRESSION;
+  parser->error_offset = parser->tokenizer.cursor;
+  MATH_EVAL_LOG_ERROR("Expected expression but got: '%s'.",
+                      token_type_to_kind(parser->lookahead.type));
+  return one_shot_invalid;
+}
+
+static struct one_shot_value one_shot_call_or_basic(struct one_shot *state) {
+  struct one_shot_value value = one_shot_basic(state);
+  if (value.kind != ONE_SHOT_IDENTIFIER) {
+    return value;
+  }
+
+  if (parser_token_is(&state->parser, TOK_OPEN_PAREN)) {
+    parser_eat(&state->parser, TOK_OPEN_PAREN);
+    return one_shot_call(state, value.token);
+  }
+
+  /* `(name)(...)` is a call too, nothing else can follow before it's used */
+  if (!parser_token_is(&state->parser, TOK_CLOSE_PAREN)) {
+    one_shot_resolve(state, &value);
+  }
+
+  return value;
+}
+
+static struct one_shot_value one_shot_power(struct one_shot *state) {
+  struct one_shot_value left = one_shot_call_or_basic(state);
+
+  if (parser_token_is(&state->parser, TOK_CARET)) {
+    struct token t = parser_eat(&state->parser, TOK_CARET);
+    left = one_shot_binary(state, t, left, one_shot_unary(state));
+  }
+
+  return left;
+}
+
+static struct one_shot_value one_shot_unary(struct one_shot *state) {
+  if (parser_token_is(&state->parser, TOK_MINUS | TOK_PLUS)) {
+    struct token t = parser_eat(&state->parser, TOK_MINUS | TOK_PLUS);
+
+    struct one_shot_value arg = one_shot_unary(state);
+    one_shot_resolve(state, &arg);
+
+    if (t.type == TOK_MINUS && arg.kind == ONE_SHOT_VALUE) {
+      arg.value = -arg.value;
+    }
+
+    return arg;
+  }
+
+  return one_shot_power(state);
+}
+
+static struct one_shot_value one_shot_multiplication(struct one_shot *state) {
+  struct one_shot_value left = one_shot_unary(state);
+
+  while (parser_token_is(&state->parser,
+                         TOK_ASTERISK | TOK_FORW_SLASH | TOK_PERCENT)) {
+    struct token t = parser_eat(&state->parser,
+                                TOK_ASTERISK | TOK_FORW_SLASH | TOK_PERCENT);
+
+    left = one_shot_binary(state, t, left, one_shot_unary(state));
+  }
+  return left;
+}
+
+static struct one_shot_value one_shot_addition(struct one_shot *state) {
+  struct one_shot_value left = one_shot_multiplication(state);
+
+  while (parser_token_is(&state->parser, TOK_PLUS | TOK_MINUS)) {
+    struct token t = parser_eat(&state->parser, TOK_PLUS | TOK_MINUS);
+
+    left = one_shot_binary(state, t, left, one_shot_multiplication(state));
+  }
+  return left;
+}
+
+static struct one_shot_value one_shot_expression(struct one_shot *state) {
+  return one_shot_addition(state);
+}
+
+/* Same messages and fields as a failed compilation */
+static void one_shot_report(const struct one_shot *state,
+                            struct math_eval_error *error) {
+  const struct math_eval_error *found = &state->error;
+  const int size = found->size;
+
+  char name[size + 1];
+  memcpy(name, state->parser.tokenizer.str + found->offset, (size_t)size);
+  name[size] = '\0';
+
+  switch (found->code) {
+  case EVAL_ERR_NO_FUNCTION:
+    MATH_EVAL_LOG_ERROR("Function with name '%s' doesn't exist", name);
+    break;
+
+  case EVAL_ERR_ARGS_MISMATCH:
+    error->function_error = found->function_error;
+    MATH_EVAL_LOG_ERROR(
+        "Function with the name '%s' expects %d arguments, but got %d", name,
+        found->function_error.args_count_expected,
+        found->function_error.args_count_got);
+    break;
+
+  default:
+    MATH_EVAL_LOG_ERROR("Variable with name '%s' doesn't exist", name);
+    break;
+  }
+
+  error->code = found->code;
+  error->offset = found->offset;
+  error->size = found->size;
+}
+
+static double one_shot_run(struct one_shot *state, const char *expression,
+                           size_t len) {
+  parser_init(&state->parser);
+  tokenizer_read_n(&state->parser.tokenizer, expression, len);
+  state->parser.lookahead = tokenizer_next(&state->parser.tokenizer);
+
+  state->deferred = false;
+  state->error = (struct math_eval_error){.code = EVAL_NO_ERROR};
+
+  struct one_shot_value value = one_shot_expression(state);
+  one_shot_resolve(state, &value);
+  parser_eat(&state->parser, TOK_EOF);
+
+  return value.value;
+}
+
+double math_eval_one_shot(const char *expression, size_t len,
+                          struct symbol_table *table,
+                          struct math_eval_error *error) {
+  /* Offsets of tokens are ints */
+  if (len > INT_MAX) {
+    error->offset = 0;
+    error->code = EVAL_ERR_PARSE;
+    return NAN;
+  }
+
+  struct one_shot state = {.table = table};
+
+  double result = one_shot_run(&state, expression, len);
+
+  if (state.parser.error_codes != AST_NO_ERROR) {
+    error->offset = state.parser.error_offset;
+    error->code = EVAL_ERR_PARSE;
+    return NAN;
+  }
+
+  if (state.error.code != EVAL_NO_ERROR) {
+    one_shot_report(&state, error);
+    return NAN;
+  }
+
+  if (state.deferred) {
+    /* Valid, the calls to user functions can be made now */
+    state.calls = true;
+    result = one_shot_run(&state, expression, len);
+  }
+
+  return result;
+}
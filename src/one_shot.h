@@ -0,0 +1,22 @@
+#ifndef MATH_EVAL_ONE_SHOT_H
+#define MATH_EVAL_ONE_SHOT_H
+
+#include <stddef.h>
+
+#include "math_eval/evaluator.h"
+#include "math_eval/symbol_table.h"
+
+/*
+ * Evaluates the first `len` characters of `expression` while parsing them,
+ * without building anything. The result and errors are the ones of compiling
+ * and evaluating it.
+ *
+ * User functions are only called once the whole expression is known to be
+ * valid, so expressions calling them are read twice: the first time only up
+ * to the first such call is evaluated, the rest is just checked.
+ */
+double math_eval_one_shot(const char *expression, size_t len,
+                          struct symbol_table *table,
+                          struct math_eval_error *error);
+
+#endif /* !MATH_EVAL_ONE_SHOT_H */
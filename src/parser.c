@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,8 +52,6 @@
  *
  */
 
-static struct token parser_eat(struct parser *parser, int token_types);
-static bool parser_token_is(struct parser *parser, int token_types);
 static struct ast_node *parser_parse_expression(struct parser *parser);
 static struct ast_node *parser_parse_addition(struct parser *parser);
 static struct ast_node *parser_parse_multiplication(struct parser *parser);
@@ -61,8 +60,98 @@ static struct ast_node *parser_parse_unary(struct parser *parser);
 static struct ast_node *parser_parse_call(struct parser *parser);
 static struct ast_node *parser_parse_basic(struct parser *parser);
 
-struct ast_node *ast_node_init(struct ast_node *node, enum ast_node_type type,
-                               int offset, int size) {
+/* Any node, so that the root can be moved into the arena header */
+union ast_node_any {
+  struct ast_node node;
+  struct ast_node_number number;
+  struct ast_node_binary binary;
+  struct ast_node_function function;
+  struct ast_node_unary unary;
+};
+
+struct ast_arena_block {
+  struct ast_arena_block *next;
+  size_t size;
+  size_t used;
+
+  union ast_node_any data[];
+};
+
+/*
+ * Every node of a tree and its argument lists are bump allocated from the
+ * blocks of one arena. The first block follows the header in the same
+ * allocation. Once parsed, the root is moved into the header, so that
+ * `ast_destroy` finds the arena from it and frees the whole tree at once.
+ */
+struct ast_arena {
+  union ast_node_any root;
+  struct ast_arena_block *blocks; /* Block being filled first */
+};
+
+#define AST_ARENA_ALIGN _Alignof(union ast_node_any)
+#define AST_ARENA_MAX_FIRST_BLOCK 4096
+
+static struct ast_arena *ast_arena_create(size_t length) {
+  /* A node per character at most, and as many arguments */
+  size_t size = (length + 1) * (sizeof(union ast_node_any) + sizeof(void *));
+  if (size > AST_ARENA_MAX_FIRST_BLOCK) {
+    size = AST_ARENA_MAX_FIRST_BLOCK;
+  }
+
+  struct ast_arena *arena = yu_calloc(
+      1, sizeof(*arena) + sizeof(struct ast_arena_block) + size);
+  if (!arena) {
+    return NULL;
+  }
+
+  arena->blocks = (struct ast_arena_block *)(void *)(arena + 1);
+  arena->blocks->size = size;
+  return arena;
+}
+
+static void ast_arena_destroy(struct ast_arena *arena) {
+  struct ast_arena_block *first = (struct ast_arena_block *)(void *)(arena + 1);
+
+  struct ast_arena_block *block = arena->blocks;
+  while (block != first) {
+    struct ast_arena_block *next = block->next;
+    yu_free(block);
+    block = next;
+  }
+
+  yu_free(arena);
+}
+
+static void *parser_allocate(struct parser *parser, size_t size) {
+  struct ast_arena *arena = parser->arena;
+  size = (size + AST_ARENA_ALIGN - 1) / AST_ARENA_ALIGN * AST_ARENA_ALIGN;
+
+  struct ast_arena_block *block = arena->blocks;
+  if (block->size - block->used < size) {
+    size_t block_size = block->size * 2;
+    while (block_size < size) {
+      block_size *= 2;
+    }
+
+    block = yu_calloc(1, sizeof(*block) + block_size);
+    if (!block) {
+      parser->error_codes |= AST_ERR_FATAL;
+      return NULL;
+    }
+
+    block->next = arena->blocks;
+    block->size = block_size;
+    arena->blocks = block;
+  }
+
+  void *memory = (char *)block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+static struct ast_node *ast_node_init(struct ast_node *node,
+                                      enum ast_node_type type, int offset,
+                                      int size) {
   assert(node != NULL);
 
   node->type = type;
@@ -72,9 +161,10 @@ struct ast_node *ast_node_init(struct ast_node *node, enum ast_node_type type,
   return node;
 }
 
-struct ast_node *ast_node_create(enum ast_node_type type, int offset,
-                                 int size) {
-  struct ast_node *ast_node = yu_calloc(1, sizeof(*ast_node));
+static struct ast_node *ast_node_create(struct parser *parser,
+                                        enum ast_node_type type, int offset,
+                                        int size) {
+  struct ast_node *ast_node = parser_allocate(parser, sizeof(*ast_node));
   if (!ast_node) {
     return NULL;
   }
@@ -82,10 +172,22 @@ struct ast_node *ast_node_create(enum ast_node_type type, int offset,
   return ast_node_init(ast_node, type, offset, size);
 }
 
-struct ast_node *ast_node_create_binary(int offset, int size,
-                                        struct ast_node *left,
-                                        struct ast_node *right) {
-  struct ast_node_binary *binary = yu_calloc(1, sizeof(*binary));
+static struct ast_node *ast_node_number_create(struct parser *parser,
+                                               struct token token) {
+  struct ast_node_number *number = parser_allocate(parser, sizeof(*number));
+  if (!number) {
+    return NULL;
+  }
+
+  number->value = token.value;
+  return ast_node_init(&number->node, AST_NUMBER, token.offset, token.size);
+}
+
+static struct ast_node *ast_node_create_binary(struct parser *parser,
+                                               int offset, int size,
+                                               struct ast_node *left,
+                                               struct ast_node *right) {
+  struct ast_node_binary *binary = parser_allocate(parser, sizeof(*binary));
   if (!binary) {
     return NULL;
   }
@@ -96,8 +198,9 @@ struct ast_node *ast_node_create_binary(int offset, int size,
   return ast_node_init(&binary->node, AST_BINARY, offset, size);
 }
 
-struct ast_node *ast_node_function_create(int offset, int size) {
-  struct ast_node_function *fun = yu_calloc(1, sizeof(*fun));
+static struct ast_node *ast_node_function_create(struct parser *parser,
+                                                 int offset, int size) {
+  struct ast_node_function *fun = parser_allocate(parser, sizeof(*fun));
   if (!fun) {
     return NULL;
   }
@@ -108,9 +211,10 @@ struct ast_node *ast_node_function_create(int offset, int size) {
   return ast_node_init(&fun->node, AST_CALL, offset, size);
 }
 
-struct ast_node *ast_node_unary_create(int offset, int size,
-                                       struct ast_node *arg) {
-  struct ast_node_unary *unary = yu_calloc(1, sizeof(*unary));
+static struct ast_node *ast_node_unary_create(struct parser *parser,
+                                              int offset, int size,
+                                              struct ast_node *arg) {
+  struct ast_node_unary *unary = parser_allocate(parser, sizeof(*unary));
   if (!unary) {
     return NULL;
   }
@@ -119,14 +223,38 @@ struct ast_node *ast_node_unary_create(int offset, int size,
   return ast_node_init(&unary->node, AST_UNARY, offset, size);
 }
 
+static size_t ast_node_size(const struct ast_node *node) {
+  switch (node->type) {
+  case AST_NUMBER:
+    return sizeof(struct ast_node_number);
+  case AST_BINARY:
+    return sizeof(struct ast_node_binary);
+  case AST_UNARY:
+    return sizeof(struct ast_node_unary);
+  case AST_CALL:
+    return sizeof(struct ast_node_function);
+  default:
+    return sizeof(struct ast_node);
+  }
+}
+
 struct ast_node *ast_build(const char *str, struct ast_error *error) {
+  assert(str != NULL);
+
+  return ast_build_n(str, strlen(str), error);
+}
+
+struct ast_node *ast_build_n(const char *str, size_t len,
+                             struct ast_error *error) {
   struct parser parser;
   parser_init(&parser);
 
-  struct ast_node *ast = parser_read(&parser, str);
+  struct ast_node *ast = parser_read_n(&parser, str, len);
   if (!ast || parser.error_codes != AST_NO_ERROR) {
-    error->codes = parser.error_codes;
-    error->offset = parser.error_offset;
+    if (error) {
+      error->codes = parser.error_codes;
+      error->offset = parser.error_offset;
+    }
 
     ast_destroy(ast);
     return NULL;
@@ -135,38 +263,9 @@ struct ast_node *ast_build(const char *str, struct ast_error *error) {
   return ast;
 }
 
-void ast_node_destroy(struct ast_node *node) {
-  if (node) {
-    if (node->type == AST_CALL) {
-      struct ast_node_function *fun = ast_cast(node, struct ast_node_function);
-      for (int i = 0; i < fun->args_count; ++i) {
-        ast_node_destroy(fun->args[i]);
-      }
-
-      yu_free(fun->args);
-      yu_free(fun);
-
-    } else if (node->type == AST_UNARY) {
-      struct ast_node_unary *unary = ast_cast(node, struct ast_node_unary);
-      ast_node_destroy(unary->arg);
-      yu_free(unary);
-
-    } else if (node->type == AST_BINARY) {
-      struct ast_node_binary *binary = ast_cast(node, struct ast_node_binary);
-
-      ast_node_destroy(binary->left);
-      ast_node_destroy(binary->right);
-
-      yu_free(binary);
-    } else {
-      yu_free(node);
-    }
-  }
-}
-
 void ast_destroy(struct ast_node *ast) {
   if (ast) {
-    ast_node_destroy(ast);
+    ast_arena_destroy(container_of(ast, struct ast_arena, root));
   }
 }
 
@@ -175,21 +274,55 @@ void parser_init(struct parser *parser) {
 
   parser->error_codes = AST_NO_ERROR;
   parser->error_offset = 0;
+
+  parser->arena = NULL;
+  parser->args = NULL;
+  parser->args_count = 0;
+  parser->args_size = 0;
 }
 
 void parser_destroy(struct parser *parser) { yu_free(parser); }
 
 struct ast_node *parser_read(struct parser *parser, const char *str) {
+  assert(str != NULL);
+
+  return parser_read_n(parser, str, strlen(str));
+}
+
+struct ast_node *parser_read_n(struct parser *parser, const char *str,
+                               size_t len) {
   assert(parser != NULL);
 
-  tokenizer_read(&parser->tokenizer, str);
+  /* Offsets of tokens are ints */
+  parser->arena = len <= INT_MAX ? ast_arena_create(len) : NULL;
+  if (!parser->arena) {
+    parser->error_codes = AST_ERR_FATAL;
+    return NULL;
+  }
+
+  tokenizer_read_n(&parser->tokenizer, str, len);
   parser->error_codes = AST_NO_ERROR;
   parser->lookahead = tokenizer_next(&parser->tokenizer);
 
   struct ast_node *expression = parser_parse_expression(parser);
   parser_eat(parser, TOK_EOF);
 
-  return expression;
+  struct ast_arena *arena = parser->arena;
+  parser->arena = NULL;
+
+  yu_free(parser->args);
+  parser->args = NULL;
+  parser->args_count = 0;
+  parser->args_size = 0;
+
+  if (!expression) {
+    ast_arena_destroy(arena);
+    return NULL;
+  }
+
+  /* Nothing points at the root, it can move */
+  memcpy(&arena->root, expression, ast_node_size(expression));
+  return &arena->root.node;
 }
 
 const char *ast_node_type_to_str(enum ast_node_type type) {
@@ -232,7 +365,7 @@ static void token_types_to_kinds(int token_types, char *buffer, int bufsize) {
   *buffer = '\0';
 }
 
-static struct token parser_eat(struct parser *parser, int token_types) {
+struct token parser_eat(struct parser *parser, int token_types) {
   assert(parser != NULL);
 
   struct token token = parser->lookahead;
@@ -251,7 +384,7 @@ static struct token parser_eat(struct parser *parser, int token_types) {
   return token;
 }
 
-static bool parser_token_is(struct parser *parser, int token_types) {
+bool parser_token_is(struct parser *parser, int token_types) {
   return token_types & parser->lookahead.type;
 }
 
@@ -264,7 +397,7 @@ static struct ast_node *parser_parse_addition(struct parser *parser) {
 
   while (parser_token_is(parser, TOK_PLUS | TOK_MINUS)) {
     struct token t = parser_eat(parser, TOK_PLUS | TOK_MINUS);
-    left = ast_node_create_binary(t.offset, t.size, left,
+    left = ast_node_create_binary(parser, t.offset, t.size, left,
                                   parser_parse_multiplication(parser));
   }
   return left;
@@ -276,7 +409,7 @@ static struct ast_node *parser_parse_multiplication(struct parser *parser) {
   while (parser_token_is(parser, TOK_ASTERISK | TOK_FORW_SLASH | TOK_PERCENT)) {
     struct token t =
         parser_eat(parser, TOK_ASTERISK | TOK_FORW_SLASH | TOK_PERCENT);
-    left = ast_node_create_binary(t.offset, t.size, left,
+    left = ast_node_create_binary(parser, t.offset, t.size, left,
                                   parser_parse_unary(parser));
   }
   return left;
@@ -286,7 +419,8 @@ static struct ast_node *parser_parse_unary(struct parser *parser) {
   if (parser_token_is(parser, TOK_MINUS | TOK_PLUS)) {
     struct token t = parser_eat(parser, TOK_MINUS | TOK_PLUS);
 
-    return ast_node_unary_create(t.offset, t.size, parser_parse_unary(parser));
+    return ast_node_unary_create(parser, t.offset, t.size,
+                                 parser_parse_unary(parser));
   }
 
   return parser_parse_power(parser);
@@ -298,12 +432,37 @@ static struct ast_node *parser_parse_power(struct parser *parser) {
   if (parser_token_is(parser, TOK_CARET)) {
     struct token t = parser_eat(parser, TOK_CARET);
 
-    left = ast_node_create_binary(t.offset, t.size, left,
+    left = ast_node_create_binary(parser, t.offset, t.size, left,
                                   parser_parse_unary(parser));
   }
   return left;
 }
 
+/* Arguments are collected on a stack shared by nested calls */
+static bool parser_push_arg(struct parser *parser, struct ast_node *arg) {
+  if (parser->args_count == parser->args_size) {
+    const int size = parser->args_size > 0 ? parser->args_size * 2 : 16;
+
+    /* Not reallocated, custom allocators can't, see `math_eval_init` */
+    struct ast_node **args = yu_calloc((size_t)size, sizeof(*args));
+    if (!args) {
+      parser->error_codes |= AST_ERR_FATAL;
+      return false;
+    }
+
+    if (parser->args) {
+      memcpy(args, parser->args, sizeof(*args) * (size_t)parser->args_count);
+      yu_free(parser->args);
+    }
+
+    parser->args = args;
+    parser->args_size = size;
+  }
+
+  parser->args[parser->args_count++] = arg;
+  return true;
+}
+
 static struct ast_node *parser_parse_call(struct parser *parser) {
   struct ast_node *maybe_callee = parser_parse_basic(parser);
 
@@ -312,9 +471,11 @@ static struct ast_node *parser_parse_call(struct parser *parser) {
       parser_token_is(parser, TOK_OPEN_PAREN)) {
     parser_eat(parser, TOK_OPEN_PAREN);
 
-    struct ast_node *callee =
-        ast_node_function_create(maybe_callee->offset, maybe_callee->size);
-    ast_node_destroy(maybe_callee);
+    struct ast_node *callee = ast_node_function_create(
+        parser, maybe_callee->offset, maybe_callee->size);
+    if (!callee) {
+      return NULL;
+    }
 
     /* Function with zero arguments */
     if (parser_token_is(parser, TOK_CLOSE_PAREN)) {
@@ -322,19 +483,35 @@ static struct ast_node *parser_parse_call(struct parser *parser) {
       return callee;
     }
 
+    /* Arguments of nested calls are pushed after ours */
+    const int args = parser->args_count;
+    int args_count = 0;
+
+    do {
+      if (args_count > 0) {
+        parser_eat(parser, TOK_COMMA);
+      }
+
+      struct ast_node *arg = parser_parse_expression(parser);
+      if (!parser_push_arg(parser, arg)) {
+        return NULL;
+      }
+      args_count += 1;
+    } while (parser_token_is(parser, TOK_COMMA) &&
+             args_count < AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS);
+
+    parser_eat(parser, TOK_CLOSE_PAREN);
+
     struct ast_node_function *fun = ast_cast(callee, struct ast_node_function);
-    fun->args =
-        yu_calloc(AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS, sizeof(*fun->args));
-    fun->args_count = 1;
-
-    fun->args[0] = parser_parse_expression(parser);
-    while (parser_token_is(parser, TOK_COMMA) &&
-           fun->args_count < AST_CALL_MAXIMUM_NUMBER_OF_ARGUMENTS) {
-      parser_eat(parser, TOK_COMMA);
-      fun->args[fun->args_count++] = parser_parse_expression(parser);
+    fun->args = parser_allocate(parser, sizeof(*fun->args) * (size_t)args_count);
+    if (!fun->args) {
+      return NULL;
     }
 
-    parser_eat(parser, TOK_CLOSE_PAREN);
+    memcpy(fun->args, parser->args + args,
+           sizeof(*fun->args) * (size_t)args_count);
+    fun->args_count = args_count;
+    parser->args_count = args;
 
     return callee;
   }
@@ -351,13 +528,12 @@ static struct ast_node *parser_parse_basic(struct parser *parser) {
   }
 
   if (parser_token_is(parser, TOK_NUMBER)) {
-    struct token t = parser_eat(parser, TOK_NUMBER);
-    return ast_node_create(AST_NUMBER, t.offset, t.size);
+    return ast_node_number_create(parser, parser_eat(parser, TOK_NUMBER));
   }
 
   if (parser_token_is(parser, TOK_IDENTIFIER)) {
     struct token t = parser_eat(parser, TOK_IDENTIFIER);
-    return ast_node_create(AST_IDENTIFIER, t.offset, t.size);
+    return ast_node_create(parser, AST_IDENTIFIER, t.offset, t.size);
   }
 
   parser->error_codes |= AST_ERR_EXPECTED_EXPRESSION;
@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "datastructs/functions.h"
+#include "datastructs/memory.h"
+
+#include "math_eval/container.h"
+#include "math_eval/shared_cache.h"
+
+#include "epoch.h"
+
+#ifdef MATH_EVAL_THREADS
+
+#include <pthread.h>
+
+typedef pthread_mutex_t shared_mutex;
+
+#define SHARED_MUTEX_INIT(mutex) pthread_mutex_init(mutex, NULL)
+#define SHARED_MUTEX_DESTROY(mutex) pthread_mutex_destroy(mutex)
+#define SHARED_MUTEX_LOCK(mutex) pthread_mutex_lock(mutex)
+#define SHARED_MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+
+#else
+
+typedef int shared_mutex;
+
+#define SHARED_MUTEX_INIT(mutex) ((void)(mutex))
+#define SHARED_MUTEX_DESTROY(mutex) ((void)(mutex))
+#define SHARED_MUTEX_LOCK(mutex) ((void)(mutex))
+#define SHARED_MUTEX_UNLOCK(mutex) ((void)(mutex))
+
+#endif /* MATH_EVAL_THREADS */
+
+#define SHARED_CACHE_SHARDS 16
+
+/* Never changes once published, apart from `next` and `referenced` */
+struct shared_entry {
+  _Atomic(struct shared_entry *) next; /* Next entry of the same bucket */
+  atomic_bool referenced;              /* Hit since the clock hand passed */
+
+  struct math_eval_retired retired;
+
+  size_t hash;
+  struct math_eval_expression *expr;
+  char expression[];
+};
+
+/* Padded to a cache line, only its own thread writes to it */
+struct shared_reader {
+  _Atomic uint64_t hits;
+  _Atomic uint64_t misses;
+
+  char padding[64 - 2 * sizeof(uint64_t)];
+};
+
+/*
+ * Readers walk the buckets without the mutex, writers publish entries at the
+ * head of a bucket and unlink them before retiring. Evictions follow a clock
+ * over `entries`: entries hit since the hand last passed get another round.
+ */
+struct shared_shard {
+  shared_mutex mutex;
+
+  _Atomic(struct shared_entry *) *buckets;
+  size_t buckets_mask;
+
+  struct shared_entry **entries;
+  atomic_int entries_count;
+  int capacity;
+  int hand;
+};
+
+/* Unlinked entries are retired, readers are inside while they hold one */
+struct math_eval_shared_cache {
+  struct symbol_table *table;
+  int flags;
+
+  struct shared_shard shards[SHARED_CACHE_SHARDS];
+
+  struct shared_reader *readers; /* Statistics */
+  int readers_count;
+
+  struct math_eval_epoch epoch;
+  shared_mutex retired_mutex;
+};
+
+static void shared_entry_destroy(struct shared_entry *entry) {
+  math_eval_expr_destroy(entry->expr);
+  yu_free(entry);
+}
+
+static void shared_entry_reclaim(struct math_eval_retired *retired) {
+  shared_entry_destroy(container_of(retired, struct shared_entry, retired));
+}
+
+/* Spreads string hashes over shards and buckets, whose low bits are weak */
+static inline size_t shared_hash(const char *expression) {
+  uint64_t hash = (uint64_t)yu_hash_str(expression);
+  hash ^= hash >> 33;
+  hash *= UINT64_C(0xff51afd7ed558ccd);
+  hash ^= hash >> 33;
+  return (size_t)hash;
+}
+
+static inline _Atomic(struct shared_entry *) *
+shared_bucket(struct shared_shard *shard, size_t hash) {
+  return &shard->buckets[(hash / SHARED_CACHE_SHARDS) & shard->buckets_mask];
+}
+
+static inline void shared_count(_Atomic uint64_t *counter) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+static struct shared_entry *shared_find(struct shared_shard *shard,
+                                        size_t hash, const char *expression) {
+  struct shared_entry *entry =
+      atomic_load_explicit(shared_bucket(shard, hash), memory_order_acquire);
+
+  for (; entry;
+       entry = atomic_load_explicit(&entry->next, memory_order_acquire)) {
+    if (entry->hash == hash && strcmp(entry->expression, expression) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/* `entries` are chained by `retired.next` and already unlinked */
+static void shared_retire(struct math_eval_shared_cache *cache,
+                          struct shared_entry *entries) {
+  SHARED_MUTEX_LOCK(&cache->retired_mutex);
+  math_eval_epoch_retire(&cache->epoch, &entries->retired);
+  SHARED_MUTEX_UNLOCK(&cache->retired_mutex);
+}
+
+/* Unlinks the entry under the clock hand, the mutex is held */
+static struct shared_entry *shared_evict(struct shared_shard *shard) {
+  /* Readers may mark entries again behind the hand, two rounds at most */
+  for (int step = 0; step < 2 * shard->capacity; ++step) {
+    if (!atomic_exchange_explicit(&shard->entries[shard->hand]->referenced,
+                                  false, memory_order_relaxed)) {
+      break;
+    }
+
+    shard->hand = (shard->hand + 1) % shard->capacity;
+  }
+
+  struct shared_entry *victim = shard->entries[shard->hand];
+
+  _Atomic(struct shared_entry *) *link = shared_bucket(shard, victim->hash);
+  while (atomic_load_explicit(link, memory_order_relaxed) != victim) {
+    link = &atomic_load_explicit(link, memory_order_relaxed)->next;
+  }
+
+  atomic_store_explicit(
+      link, atomic_load_explicit(&victim->next, memory_order_relaxed),
+      memory_order_release);
+
+  victim->retired.next = NULL;
+  return victim;
+}
+
+/*
+ * Publishes `expr` for `expression`, or returns the entry another thread
+ * published first and destroys `expr`. NULL when out of memory, `expr` is
+ * left to the caller then.
+ */
+static struct shared_entry *
+shared_insert(struct math_eval_shared_cache *cache, struct shared_shard *shard,
+              size_t hash, const char *expression,
+              struct math_eval_expression *expr) {
+  const size_t length = strlen(expression);
+
+  struct shared_entry *entry = yu_calloc(1, sizeof(*entry) + length + 1);
+  if (!entry) {
+    return NULL;
+  }
+
+  memcpy(entry->expression, expression, length + 1);
+  entry->hash = hash;
+  entry->expr = expr;
+  atomic_init(&entry->referenced, false);
+
+  SHARED_MUTEX_LOCK(&shard->mutex);
+
+  struct shared_entry *existing = shared_find(shard, hash, expression);
+  if (existing) {
+    SHARED_MUTEX_UNLOCK(&shard->mutex);
+
+    shared_entry_destroy(entry);
+    return existing;
+  }
+
+  struct shared_entry *victim = NULL;
+  int index = atomic_load_explicit(&shard->entries_count, memory_order_relaxed);
+
+  if (index < shard->capacity) {
+    atomic_store_explicit(&shard->entries_count, index + 1,
+                          memory_order_relaxed);
+  } else {
+    victim = shared_evict(shard);
+    index = shard->hand;
+    shard->hand = (shard->hand + 1) % shard->capacity;
+  }
+
+  shard->entries[index] = entry;
+
+  _Atomic(struct shared_entry *) *bucket = shared_bucket(shard, hash);
+  atomic_init(&entry->next,
+              atomic_load_explicit(bucket, memory_order_relaxed));
+  atomic_store_explicit(bucket, entry, memory_order_release);
+
+  SHARED_MUTEX_UNLOCK(&shard->mutex);
+
+  if (victim) {
+    shared_retire(cache, victim);
+  }
+
+  return entry;
+}
+
+struct math_eval_shared_cache *
+math_eval_shared_cache_create(struct symbol_table *table, int flags,
+                              int capacity, int readers_count) {
+  assert(table != NULL);
+  assert(capacity > 0);
+  assert(readers_count > 0);
+  assert(!(flags & MATH_EVAL_COMPILE_INCREMENTAL));
+
+  struct math_eval_shared_cache *cache = yu_calloc(1, sizeof(*cache));
+  if (!cache) {
+    return NULL;
+  }
+
+  cache->table = table;
+  cache->flags = flags;
+  cache->readers_count = readers_count;
+  SHARED_MUTEX_INIT(&cache->retired_mutex);
+
+  cache->readers = yu_calloc((size_t)readers_count, sizeof(*cache->readers));
+  bool ok = cache->readers != NULL &&
+            math_eval_epoch_init(&cache->epoch, readers_count,
+                                 shared_entry_reclaim);
+
+  for (int i = 0; ok && i < readers_count; ++i) {
+    atomic_init(&cache->readers[i].hits, 0);
+    atomic_init(&cache->readers[i].misses, 0);
+  }
+
+  const int shard_capacity =
+      (capacity + SHARED_CACHE_SHARDS - 1) / SHARED_CACHE_SHARDS;
+
+  size_t buckets_count = 1;
+  while (buckets_count < (size_t)shard_capacity * 2) {
+    buckets_count *= 2;
+  }
+
+  for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    struct shared_shard *shard = &cache->shards[i];
+
+    SHARED_MUTEX_INIT(&shard->mutex);
+    shard->capacity = shard_capacity;
+    shard->buckets_mask = buckets_count - 1;
+    atomic_init(&shard->entries_count, 0);
+
+    shard->entries =
+        yu_calloc((size_t)shard_capacity, sizeof(*shard->entries));
+    shard->buckets = yu_calloc(buckets_count, sizeof(*shard->buckets));
+    ok = ok && shard->entries && shard->buckets;
+
+    for (size_t bucket = 0; shard->buckets && bucket < buckets_count;
+         ++bucket) {
+      atomic_init(&shard->buckets[bucket], NULL);
+    }
+  }
+
+  if (!ok) {
+    math_eval_shared_cache_destroy(cache);
+    return NULL;
+  }
+
+  return cache;
+}
+
+void math_eval_shared_cache_destroy(struct math_eval_shared_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    struct shared_shard *shard = &cache->shards[i];
+
+    const int count =
+        atomic_load_explicit(&shard->entries_count, memory_order_relaxed);
+    for (int entry = 0; entry < count; ++entry) {
+      shared_entry_destroy(shard->entries[entry]);
+    }
+
+    yu_free((void *)shard->buckets);
+    yu_free((void *)shard->entries);
+    SHARED_MUTEX_DESTROY(&shard->mutex);
+  }
+
+  math_eval_epoch_destroy(&cache->epoch);
+
+  SHARED_MUTEX_DESTROY(&cache->retired_mutex);
+  yu_free(cache->readers);
+  yu_free(cache);
+}
+
+double math_eval_shared_cache_eval(struct math_eval_shared_cache *cache,
+                                   int reader, const char *expression,
+                                   struct math_eval_error *error) {
+  assert(cache != NULL);
+  assert(reader >= 0 && reader < cache->readers_count);
+  assert(expression != NULL);
+
+  struct shared_reader *self = &cache->readers[reader];
+  const size_t hash = shared_hash(expression);
+  struct shared_shard *shard = &cache->shards[hash % SHARED_CACHE_SHARDS];
+
+  math_eval_epoch_enter(&cache->epoch, reader);
+
+  struct shared_entry *entry = shared_find(shard, hash, expression);
+  if (entry) {
+    shared_count(&self->hits);
+
+    /* Only written when it changes, to keep the line shared between cores */
+    if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+      atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+    }
+
+    const double result = math_eval_expr(entry->expr);
+    math_eval_epoch_leave(&cache->epoch, reader);
+    return result;
+  }
+
+  shared_count(&self->misses);
+  math_eval_epoch_leave(&cache->epoch, reader);
+
+  /* Compiled outside the cache, other readers may do the same meanwhile */
+  struct math_eval_expression *expr =
+      math_eval_compile_ex(expression, cache->table, cache->flags, error);
+  if (!expr) {
+    return NAN;
+  }
+
+  math_eval_epoch_enter(&cache->epoch, reader);
+
+  double result;
+  entry = shared_insert(cache, shard, hash, expression, expr);
+  if (entry) {
+    result = math_eval_expr(entry->expr);
+  } else {
+    result = math_eval_expr(expr);
+    math_eval_expr_destroy(expr);
+  }
+
+  math_eval_epoch_leave(&cache->epoch, reader);
+  return result;
+}
+
+void math_eval_shared_cache_clear(struct math_eval_shared_cache *cache) {
+  assert(cache != NULL);
+
+  for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    struct shared_shard *shard = &cache->shards[i];
+    struct shared_entry *retired = NULL;
+
+    SHARED_MUTEX_LOCK(&shard->mutex);
+
+    for (size_t bucket = 0; bucket <= shard->buckets_mask; ++bucket) {
+      atomic_store_explicit(&shard->buckets[bucket], NULL,
+                            memory_order_release);
+    }
+
+    const int count =
+        atomic_load_explicit(&shard->entries_count, memory_order_relaxed);
+    for (int entry = 0; entry < count; ++entry) {
+      shard->entries[entry]->retired.next =
+          retired ? &retired->retired : NULL;
+      retired = shard->entries[entry];
+    }
+
+    atomic_store_explicit(&shard->entries_count, 0, memory_order_relaxed);
+    shard->hand = 0;
+
+    SHARED_MUTEX_UNLOCK(&shard->mutex);
+
+    if (retired) {
+      shared_retire(cache, retired);
+    }
+  }
+}
+
+struct math_eval_cache_stats
+math_eval_shared_cache_stats(const struct math_eval_shared_cache *cache) {
+  assert(cache != NULL);
+
+  struct math_eval_cache_stats stats = {0};
+
+  for (int i = 0; i < cache->readers_count; ++i) {
+    stats.hits +=
+        atomic_load_explicit(&cache->readers[i].hits, memory_order_relaxed);
+    stats.misses +=
+        atomic_load_explicit(&cache->readers[i].misses, memory_order_relaxed);
+  }
+
+  for (int i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    stats.size += atomic_load_explicit(&cache->shards[i].entries_count,
+                                       memory_order_relaxed);
+    stats.capacity += cache->shards[i].capacity;
+  }
+
+  return stats;
+}
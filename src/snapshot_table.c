@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/container.h"
+#include "math_eval/snapshot_table.h"
+
+#include "epoch.h"
+
+struct snapshot_version {
+  struct symbol_table *table; /* Read-only */
+
+  struct math_eval_retired retired;
+};
+
+/* Replaced versions are retired, readers are inside while they pin one */
+struct math_eval_snapshot_table {
+  struct symbol_table *writer;
+
+  _Atomic(struct snapshot_version *) current;
+
+  struct math_eval_epoch epoch; /* Retired by the writer only */
+};
+
+static void snapshot_version_destroy(struct snapshot_version *version) {
+  symbol_table_destroy(version->table);
+  yu_free(version);
+}
+
+static void snapshot_version_reclaim(struct math_eval_retired *retired) {
+  snapshot_version_destroy(
+      container_of(retired, struct snapshot_version, retired));
+}
+
+static struct snapshot_version *snapshot_version_create(
+    struct math_eval_snapshot_table *table) {
+  struct snapshot_version *version = yu_calloc(1, sizeof(*version));
+  if (!version) {
+    return NULL;
+  }
+
+  version->table = symbol_table_clone(table->writer);
+  if (!version->table) {
+    yu_free(version);
+    return NULL;
+  }
+
+  version->table->read_only = true;
+  return version;
+}
+
+struct math_eval_snapshot_table *
+math_eval_snapshot_table_create(struct symbol_table *parent,
+                                int readers_count) {
+  assert(readers_count > 0);
+
+  struct math_eval_snapshot_table *table = yu_calloc(1, sizeof(*table));
+  if (!table) {
+    return NULL;
+  }
+
+  atomic_init(&table->current, NULL);
+
+  table->writer = symbol_table_create_child(parent);
+  bool ok = table->writer &&
+            math_eval_epoch_init(&table->epoch, readers_count,
+                                 snapshot_version_reclaim);
+
+  /* Readers always find a table */
+  struct snapshot_version *version =
+      ok ? snapshot_version_create(table) : NULL;
+  if (!version) {
+    math_eval_snapshot_table_destroy(table);
+    return NULL;
+  }
+
+  atomic_store_explicit(&table->current, version, memory_order_relaxed);
+  return table;
+}
+
+void math_eval_snapshot_table_destroy(struct math_eval_snapshot_table *table) {
+  if (!table) {
+    return;
+  }
+
+  struct snapshot_version *current =
+      atomic_load_explicit(&table->current, memory_order_relaxed);
+  if (current) {
+    snapshot_version_destroy(current);
+  }
+
+  math_eval_epoch_destroy(&table->epoch);
+  symbol_table_destroy(table->writer);
+  yu_free(table);
+}
+
+struct symbol_table *
+math_eval_snapshot_table_writer(struct math_eval_snapshot_table *table) {
+  assert(table != NULL);
+
+  return table->writer;
+}
+
+bool math_eval_snapshot_table_publish(struct math_eval_snapshot_table *table) {
+  assert(table != NULL);
+
+  struct snapshot_version *version = snapshot_version_create(table);
+  if (!version) {
+    return false;
+  }
+
+  struct snapshot_version *replaced = atomic_exchange_explicit(
+      &table->current, version, memory_order_acq_rel);
+
+  replaced->retired.next = NULL;
+  math_eval_epoch_retire(&table->epoch, &replaced->retired);
+  return true;
+}
+
+struct symbol_table *
+math_eval_snapshot_table_pin(struct math_eval_snapshot_table *table,
+                             int reader) {
+  assert(table != NULL);
+  assert(reader >= 0 && reader < table->epoch.readers_count);
+  assert(!math_eval_epoch_inside(&table->epoch, reader) && "Already pinned");
+
+  math_eval_epoch_enter(&table->epoch, reader);
+  return atomic_load_explicit(&table->current, memory_order_acquire)->table;
+}
+
+void math_eval_snapshot_table_unpin(struct math_eval_snapshot_table *table,
+                                    int reader) {
+  assert(table != NULL);
+  assert(reader >= 0 && reader < table->epoch.readers_count);
+
+  math_eval_epoch_leave(&table->epoch, reader);
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -10,8 +11,12 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#include "math_eval/kernels.h"
 #include "math_eval/symbol_table.h"
 
+#include "builtins.h"
+#include "cache.h"
+
 struct function_call_hash {
   char *str;
   struct math_eval_function fc;
@@ -21,7 +26,8 @@ struct function_call_hash {
 
 struct variable_hash {
   char *str;
-  struct math_eval_variable value;
+  int index;
+  struct math_eval_variable *value; /* Into `variable_chunks` */
 
   struct hash_entry hh;
 };
@@ -67,57 +73,191 @@ bool equal_variable(const struct hash_entry *lhs,
   return strcmp(a->str, b->str) == 0;
 }
 
-struct symbol_table *symbol_table_create(void) {
-  struct symbol_table *table = yu_calloc(1, sizeof(*table));
-  if (!table) {
-    return NULL;
-  }
+/* Shared layer of builtins, looked up by `builtins_find_*` */
+static struct symbol_table builtins_table = {.read_only = true};
 
-  table->functions = htable_create(10, hash_function_call, equal_function_call);
-  table->variables = htable_create(10, hash_variable, equal_variable);
+struct symbol_table *symbol_table_create(void) {
+  return symbol_table_create_child(NULL);
+}
 
-  if (!table->functions || !table->variables) {
-    symbol_table_destroy(table);
-    return NULL;
+struct symbol_table *symbol_table_create_child(struct symbol_table *parent) {
+  struct symbol_table *table = yu_calloc(1, sizeof(*table));
+  if (table) {
+    table->parent = parent;
   }
 
   return table;
 }
 
 void symbol_table_destroy(struct symbol_table *table) {
-  if (table) {
+  if (table && table != &builtins_table) {
     struct variable_hash *cur, *n;
     struct function_call_hash *fcur, *fn;
 
-    htable_for_each_temp(table->variables, cur, n, hh) {
-      destroy_variable(cur);
+    if (table->variables) {
+      htable_for_each_temp(table->variables, cur, n, hh) {
+        destroy_variable(cur);
+      }
     }
-    htable_for_each_temp(table->functions, fcur, fn, hh) {
-      destroy_function_call(fcur);
+    if (table->functions) {
+      htable_for_each_temp(table->functions, fcur, fn, hh) {
+        destroy_function_call(fcur);
+      }
     }
 
-    htable_destroy(table->variables, NULL);
-    htable_destroy(table->functions, NULL);
+    for (int i = 0; i < MATH_EVAL_VARIABLES_CHUNKS; ++i) {
+      yu_free(table->variable_chunks[i]);
+    }
+
+    math_eval_cache_destroy(table->cache);
+
+    if (table->variables) {
+      htable_destroy(table->variables, NULL);
+    }
+    if (table->functions) {
+      htable_destroy(table->functions, NULL);
+    }
     yu_free(table);
   }
 }
 
-struct math_eval_variable *
-symbol_table_find_variable(struct symbol_table *table, const char *key) {
+struct symbol_table *symbol_table_clone(struct symbol_table *table) {
   assert(table != NULL);
+  assert(table != &builtins_table);
+
+  struct symbol_table *clone = symbol_table_create_child(table->parent);
+  bool ok = clone != NULL;
+
+  if (ok && table->functions) {
+    struct function_call_hash *cur, *n;
+    htable_for_each_temp(table->functions, cur, n, hh) {
+      ok = ok && symbol_table_add_function(clone, cur->str, cur->fc);
+    }
+  }
+
+  /* Added in index order to keep the indices */
+  const char **names =
+      ok && table->variables_count > 0
+          ? yu_calloc((size_t)table->variables_count, sizeof(*names))
+          : NULL;
+  ok = ok && (names || table->variables_count == 0);
+
+  if (ok && table->variables) {
+    /* Sized up front, clones are made of large tables */
+    clone->variables = htable_create((size_t)table->variables_count * 2 + 10,
+                                     hash_variable, equal_variable);
+    ok = clone->variables != NULL;
+  }
+
+  if (ok && table->variables) {
+    struct variable_hash *cur, *n;
+    htable_for_each_temp(table->variables, cur, n, hh) {
+      names[cur->index] = cur->str;
+    }
+  }
+
+  for (int i = 0; ok && i < table->variables_count; ++i) {
+    const struct math_eval_variable *variable =
+        symbol_table_variable_at(table, i);
+
+    ok = symbol_table_add_variable(clone, names[i], variable->value,
+                                   variable->constant);
+    if (ok) {
+      symbol_table_variable_at(clone, i)->version = variable->version;
+    }
+  }
+
+  yu_free((void *)names);
+
+  if (!ok) {
+    symbol_table_destroy(clone);
+    return NULL;
+  }
+
+  return clone;
+}
+
+static struct math_eval_variable *builtins_find_variable(const char *key);
+static struct math_eval_function *builtins_find_function(const char *key);
+
+/* Variable of the table itself */
+static struct variable_hash *variable_lookup(struct symbol_table *table,
+                                             const char *key) {
+  if (!table->variables) {
+    return NULL;
+  }
 
   struct variable_hash query;
   query.str = (char *)key;
 
   struct hash_entry *entry = htable_lookup(table->variables, &query.hh);
-  if (!entry) {
-    return NULL;
+  return entry ? htable_entry(entry, struct variable_hash, hh) : NULL;
+}
+
+struct math_eval_variable *
+symbol_table_find_variable(struct symbol_table *table, const char *key) {
+  assert(table != NULL);
+  assert(key != NULL);
+
+  for (; table; table = table->parent) {
+    if (table == &builtins_table) {
+      return builtins_find_variable(key);
+    }
+
+    struct variable_hash *variable = variable_lookup(table, key);
+    if (variable) {
+      return variable->value;
+    }
   }
 
-  struct variable_hash *variable =
-      htable_entry(entry, struct variable_hash, hh);
+  return NULL;
+}
+
+int symbol_table_find_variable_index(struct symbol_table *table,
+                                     const char *key) {
+  assert(table != NULL);
+  assert(key != NULL);
+
+  struct variable_hash *variable = variable_lookup(table, key);
+  return variable ? variable->index : -1;
+}
+
+struct math_eval_variable *
+symbol_table_variable_at(struct symbol_table *table, int index) {
+  assert(table != NULL);
+  assert(index >= 0 && index < table->variables_count);
+
+  int chunk = 0;
+  for (int size = MATH_EVAL_VARIABLES_CHUNK; index >= size; size *= 2) {
+    index -= size;
+    chunk += 1;
+  }
 
-  return &variable->value;
+  return &table->variable_chunks[chunk][index];
+}
+
+/* Next variable of the slab, chunks are allocated as they are reached */
+static struct math_eval_variable *
+symbol_table_allocate_variable(struct symbol_table *table) {
+  int chunk = 0;
+  int index = table->variables_count;
+  for (int size = MATH_EVAL_VARIABLES_CHUNK; index >= size; size *= 2) {
+    index -= size;
+    if (++chunk == MATH_EVAL_VARIABLES_CHUNKS) {
+      return NULL;
+    }
+  }
+
+  if (!table->variable_chunks[chunk]) {
+    table->variable_chunks[chunk] =
+        yu_calloc((size_t)MATH_EVAL_VARIABLES_CHUNK << chunk,
+                  sizeof(struct math_eval_variable));
+    if (!table->variable_chunks[chunk]) {
+      return NULL;
+    }
+  }
+
+  return &table->variable_chunks[chunk][index];
 }
 
 struct math_eval_function *
@@ -128,15 +268,19 @@ symbol_table_find_function(struct symbol_table *table, const char *key) {
   struct function_call_hash query;
   query.str = (char *)key;
 
-  struct hash_entry *entry = htable_lookup(table->functions, &query.hh);
-  if (!entry) {
-    return NULL;
-  }
+  for (; table; table = table->parent) {
+    if (table == &builtins_table) {
+      return builtins_find_function(key);
+    }
 
-  struct function_call_hash *fun =
-      htable_entry(entry, struct function_call_hash, hh);
+    struct hash_entry *entry =
+        table->functions ? htable_lookup(table->functions, &query.hh) : NULL;
+    if (entry) {
+      return &htable_entry(entry, struct function_call_hash, hh)->fc;
+    }
+  }
 
-  return &fun->fc;
+  return NULL;
 }
 
 bool symbol_table_add_function(struct symbol_table *table, const char *key,
@@ -144,6 +288,18 @@ bool symbol_table_add_function(struct symbol_table *table, const char *key,
   assert(table != NULL);
   assert(key != NULL);
 
+  if (table->read_only) {
+    return false;
+  }
+
+  if (!table->functions) {
+    table->functions =
+        htable_create(10, hash_function_call, equal_function_call);
+    if (!table->functions) {
+      return false;
+    }
+  }
+
   struct function_call_hash *entry = yu_calloc(1, sizeof(*entry));
   entry->str = yu_dup_str(key);
   entry->fc = fc;
@@ -151,6 +307,12 @@ bool symbol_table_add_function(struct symbol_table *table, const char *key,
   struct hash_entry *replaced = NULL;
   bool ok = htable_replace(table->functions, &entry->hh, &replaced);
 
+  /* Cached expressions call the replaced function or the one it hides */
+  if (replaced || (ok && table->cache && table->parent &&
+                   symbol_table_find_function(table->parent, key))) {
+    math_eval_cache_clear(table->cache);
+  }
+
   if (replaced) {
     destroy_function_call(
         htable_entry(replaced, struct function_call_hash, hh));
@@ -164,108 +326,187 @@ bool symbol_table_add_variable(struct symbol_table *table, const char *key,
   assert(table != NULL);
   assert(key != NULL);
 
-  struct variable_hash *entry = yu_calloc(1, sizeof(*entry));
-  entry->str = yu_dup_str(key);
-  entry->value.constant = constant;
-  entry->value.value = var;
-
-  struct hash_entry *replaced = NULL;
-  bool ok = htable_replace(table->variables, &entry->hh, &replaced);
+  if (table->read_only) {
+    return false;
+  }
 
-  if (replaced) {
-    destroy_variable(htable_entry(replaced, struct variable_hash, hh));
+  if (!table->variables) {
+    table->variables = htable_create(10, hash_variable, equal_variable);
+    if (!table->variables) {
+      return false;
+    }
   }
 
-  return ok;
-}
+  struct variable_hash *entry = variable_lookup(table, key);
+  if (entry) {
+    /* Cached expressions read or folded the replaced variable */
+    math_eval_cache_clear(table->cache);
 
-static size_t ncr(int n, int r) {
-  if (r > n) {
-    return 0;
+    entry->value->constant = constant;
+    math_eval_variable_set(entry->value, var);
+    return true;
   }
-  if (r * 2 > n) {
-    r = n - r;
+
+  struct math_eval_variable *value = symbol_table_allocate_variable(table);
+  entry = yu_calloc(1, sizeof(*entry));
+  if (!value || !entry) {
+    yu_free(entry);
+    return false;
   }
-  if (r == 0) {
-    return 1;
+
+  entry->str = yu_dup_str(key);
+  entry->index = table->variables_count;
+  entry->value = value;
+  struct hash_entry *replaced = NULL;
+  if (!entry->str || !htable_replace(table->variables, &entry->hh, &replaced)) {
+    destroy_variable(entry);
+    return false;
   }
 
-  size_t result = (size_t)n;
-  for (int i = 2; i <= r; ++i) {
-    result *= (size_t)(n - i + 1);
-    result /= (size_t)i;
+  assert(replaced == NULL);
+
+  value->value = var;
+  value->constant = constant;
+  table->variables_count += 1;
+
+  /* Cached expressions read the variable it hides */
+  if (table->cache && table->parent &&
+      symbol_table_find_variable(table->parent, key)) {
+    math_eval_cache_clear(table->cache);
   }
-  return result;
-}
 
-static double min_variadic(double *params) {
-  return fmin(params[0], params[1]);
+  return true;
 }
 
-static double max_variadic(double *params) {
-  return fmax(params[0], params[1]);
-}
+MATH_EVAL_BUILTIN_HELPERS
 
-static double log_variadic(double *params) { return log(params[0]); }
+#define BUILTIN_FUNCTION(name, args_count, expression, kernel, derivative)     \
+  static double name##_variadic(double *args) { return expression; }           \
+  static void name##_derivative(double *args, double *partials) {              \
+    (void)args; /* Constant derivatives don't read it */                       \
+    derivative;                                                                \
+  }
 
-static double logn_variadic(double *params) {
-  return log(params[1]) / log(params[0]);
-}
+MATH_EVAL_BUILTINS(BUILTIN_FUNCTION)
 
-static double ceil_variadic(double *params) { return ceil(params[0]); }
+/*
+ * Lookups hand out mutable pointers to these. They are const, so that writing
+ * through one faults instead of changing the builtins of every table.
+ */
+static const struct builtin_function {
+  const char *name;
+  struct math_eval_function fc;
+} builtins_functions[] = {
+#define BUILTIN_ENTRY(name, args_count, expression, kernel, derivative)        \
+  {#name, {name##_variadic, args_count, kernel, name##_derivative}},
 
-static double floor_variadic(double *params) { return floor(params[0]); }
+    MATH_EVAL_BUILTINS(BUILTIN_ENTRY)};
 
-static double abs_variadic(double *params) { return fabs(params[0]); }
+static const int builtins_functions_count =
+    sizeof(builtins_functions) / sizeof(builtins_functions[0]);
 
-static double cos_variadic(double *params) { return cos(params[0]); }
+static const struct builtin_constant {
+  const char *name;
+  struct math_eval_variable value;
+} builtins_constants[] = {
+    {"pi", {M_PI, true, 0}},
+    {"e", {M_E, true, 0}},
+    {"pi_2", {M_PI_2, true, 0}},
+    {"pi_4", {M_PI_4, true, 0}},
+};
 
-static double sin_variadic(double *params) { return sin(params[0]); }
+static const int builtins_constants_count =
+    sizeof(builtins_constants) / sizeof(builtins_constants[0]);
+
+/*
+ * Perfect hash of the builtin names, FNV-1a from a seed that was searched
+ * for so that neither functions nor constants share a slot. Slots hold the
+ * index of the builtin and -1 when empty, the top bits of the hash select
+ * one. tests/builtins_hash.py generates them again when the builtins change,
+ * the tests fail until it's done.
+ */
+#define BUILTINS_HASH_SEED 0x71u
+#define BUILTINS_FUNCTION_SLOTS_BITS 5
+#define BUILTINS_CONSTANT_SLOTS_BITS 3
+
+static const signed char
+    builtins_function_slots[1 << BUILTINS_FUNCTION_SLOTS_BITS] = {
+        10, 9,  -1, -1, -1, 7,  -1, -1, -1, 6,  -1, 0,  -1, 8,  1,  -1,
+        -1, -1, 2,  4,  -1, 13, 14, -1, 12, -1, -1, 5,  11, 3,  -1, -1,
+};
 
-static double tan_variadic(double *params) { return tan(params[0]); }
+static const signed char
+    builtins_constant_slots[1 << BUILTINS_CONSTANT_SLOTS_BITS] = {
+        1, -1, -1, -1, 0, 2, 3, -1,
+};
 
-static double sqrt_variadic(double *params) { return sqrt(params[0]); }
+static uint32_t builtins_hash(const char *name) {
+  uint32_t hash = BUILTINS_HASH_SEED;
+  for (; *name; ++name) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
 
-static double exp_variadic(double *params) { return exp(params[0]); }
+  return hash;
+}
 
-static double round_variadic(double *params) { return round(params[0]); }
+static const struct builtin_function *
+builtins_lookup_function(const char *key) {
+  const int index =
+      builtins_function_slots[builtins_hash(key) >>
+                              (32 - BUILTINS_FUNCTION_SLOTS_BITS)];
+  if (index < 0 || strcmp(builtins_functions[index].name, key) != 0) {
+    return NULL;
+  }
 
-static double pow_variadic(double *params) { return pow(params[0], params[1]); }
+  return &builtins_functions[index];
+}
 
-static double ncr_variadic(double *params) {
-  return (double)ncr((int)params[0], (int)params[1]);
+static struct math_eval_function *builtins_find_function(const char *key) {
+  const struct builtin_function *builtin = builtins_lookup_function(key);
+  return builtin ? (struct math_eval_function *)&builtin->fc : NULL;
 }
 
-void symbol_table_add_builtins(struct symbol_table *table) {
-  const struct builtin_function {
-    const char *name;
-
-    double (*function)(double *);
-    int args_count;
-  } builtins_functions[] = {
-      {"min", min_variadic, 2},     {"max", max_variadic, 2},
-      {"logn", logn_variadic, 2},   {"log", log_variadic, 1},
-      {"ceil", ceil_variadic, 1},   {"floor", floor_variadic, 1},
-      {"abs", abs_variadic, 1},     {"cos", cos_variadic, 1},
-      {"sin", sin_variadic, 1},     {"exp", exp_variadic, 1},
-      {"round", round_variadic, 1}, {"pow", pow_variadic, 2},
-      {"sqrt", sqrt_variadic, 1},   {"tan", tan_variadic, 1},
-      {"ncr", ncr_variadic, 2}};
-
-  const int builtins_functions_count =
-      sizeof(builtins_functions) / sizeof(builtins_functions[0]);
+static struct math_eval_variable *builtins_find_variable(const char *key) {
+  const int index =
+      builtins_constant_slots[builtins_hash(key) >>
+                              (32 - BUILTINS_CONSTANT_SLOTS_BITS)];
+  if (index < 0 || strcmp(builtins_constants[index].name, key) != 0) {
+    return NULL;
+  }
+
+  return (struct math_eval_variable *)&builtins_constants[index].value;
+}
+
+struct symbol_table *symbol_table_builtins(void) { return &builtins_table; }
+
+const char *math_eval_builtin_name(math_fn function) {
   for (int i = 0; i < builtins_functions_count; ++i) {
-    const struct builtin_function *builtin = &builtins_functions[i];
+    if (builtins_functions[i].fc.function == function) {
+      return builtins_functions[i].name;
+    }
+  }
 
-    struct math_eval_function fun;
-    fun.function = builtin->function;
-    fun.args_count = builtin->args_count;
+  return NULL;
+}
+
+bool math_eval_builtin_find(const char *name,
+                            struct math_eval_function *function) {
+  const struct builtin_function *builtin = builtins_lookup_function(name);
+  if (builtin) {
+    *function = builtin->fc;
+  }
+
+  return builtin != NULL;
+}
 
-    symbol_table_add_function(table, builtin->name, fun);
+void symbol_table_add_builtins(struct symbol_table *table) {
+  for (int i = 0; i < builtins_functions_count; ++i) {
+    symbol_table_add_function(table, builtins_functions[i].name,
+                              builtins_functions[i].fc);
   }
 
-  symbol_table_add_variable(table, "pi", M_PI, true);
-  symbol_table_add_variable(table, "e", M_E, true);
-  symbol_table_add_variable(table, "pi_2", M_PI_2, true);
-  symbol_table_add_variable(table, "pi_4", M_PI_4, true);
+  for (int i = 0; i < builtins_constants_count; ++i) {
+    symbol_table_add_variable(table, builtins_constants[i].name,
+                              builtins_constants[i].value.value, true);
+  }
 }
@@ -0,0 +1,308 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "datastructs/memory.h"
+
+#include "math_eval/thread_pool.h"
+
+#ifdef MATH_EVAL_THREADS
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* Remaining tasks of a worker, `begin` in the low half and `end` in the high */
+#define RANGE(begin, end) ((uint64_t)(end) << 32 | (uint64_t)(begin))
+#define RANGE_BEGIN(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+struct thread_pool_worker {
+  _Atomic uint64_t range;
+
+  struct math_eval_thread_pool *pool;
+  pthread_t thread;
+  int index;
+};
+
+struct math_eval_thread_pool {
+  int workers_count;
+  struct thread_pool_worker *workers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+  /* Serializes `math_eval_thread_pool_run` calls from different threads */
+  pthread_mutex_t run_mutex;
+
+  unsigned long generation;
+  int running; /* Background workers still busy with the current tasks */
+  bool stop;
+
+  math_eval_task task;
+  void *user_data;
+};
+
+static bool thread_pool_take(struct thread_pool_worker *worker,
+                             size_t *index) {
+  uint64_t range = atomic_load(&worker->range);
+
+  for (;;) {
+    const uint32_t begin = RANGE_BEGIN(range);
+    const uint32_t end = RANGE_END(range);
+    if (begin >= end) {
+      return false;
+    }
+
+    if (atomic_compare_exchange_weak(&worker->range, &range,
+                                     RANGE(begin + 1, end))) {
+      *index = begin;
+      return true;
+    }
+  }
+}
+
+/* Moves the upper half of another worker's range to `worker` */
+static bool thread_pool_steal(struct thread_pool_worker *worker) {
+  struct math_eval_thread_pool *pool = worker->pool;
+
+  for (int i = 1; i < pool->workers_count; ++i) {
+    struct thread_pool_worker *victim =
+        &pool->workers[(worker->index + i) % pool->workers_count];
+
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+      const uint32_t begin = RANGE_BEGIN(range);
+      const uint32_t end = RANGE_END(range);
+      if (begin >= end) {
+        break;
+      }
+
+      const uint32_t middle = begin + (end - begin) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &range,
+                                       RANGE(begin, middle))) {
+        atomic_store(&worker->range, RANGE(middle, end));
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static void thread_pool_work(struct thread_pool_worker *worker) {
+  struct math_eval_thread_pool *pool = worker->pool;
+
+  do {
+    size_t index;
+    while (thread_pool_take(worker, &index)) {
+      pool->task(pool->user_data, index, worker->index);
+    }
+  } while (thread_pool_steal(worker));
+}
+
+static void *thread_pool_main(void *arg) {
+  struct thread_pool_worker *worker = arg;
+  struct math_eval_thread_pool *pool = worker->pool;
+
+  unsigned long generation = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->wake, &pool->mutex);
+    }
+
+    if (pool->stop) {
+      break;
+    }
+
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    thread_pool_work(worker);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+struct math_eval_thread_pool *math_eval_thread_pool_create(int workers_count) {
+  assert(workers_count > 0);
+
+  struct math_eval_thread_pool *pool = yu_calloc(1, sizeof(*pool));
+  if (!pool) {
+    return NULL;
+  }
+
+  pool->workers = yu_calloc((size_t)workers_count, sizeof(*pool->workers));
+  if (!pool->workers) {
+    yu_free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_mutex_init(&pool->run_mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int i = 0; i < workers_count; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    atomic_init(&pool->workers[i].range, RANGE(0, 0));
+  }
+
+  /* Worker 0 is whoever calls `math_eval_thread_pool_run` */
+  pool->workers_count = 1;
+  for (int i = 1; i < workers_count; ++i) {
+    if (pthread_create(&pool->workers[i].thread, NULL, thread_pool_main,
+                       &pool->workers[i]) != 0) {
+      math_eval_thread_pool_destroy(pool);
+      return NULL;
+    }
+
+    pool->workers_count += 1;
+  }
+
+  return pool;
+}
+
+void math_eval_thread_pool_destroy(struct math_eval_thread_pool *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 1; i < pool->workers_count; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->run_mutex);
+  pthread_mutex_destroy(&pool->mutex);
+
+  yu_free(pool->workers);
+  yu_free(pool);
+}
+
+static struct math_eval_thread_pool *default_pool = NULL;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+static void thread_pool_create_default(void) {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  default_pool = math_eval_thread_pool_create(cpus > 0 ? (int)cpus : 1);
+}
+
+struct math_eval_thread_pool *math_eval_thread_pool_default(void) {
+  pthread_once(&default_pool_once, thread_pool_create_default);
+  return default_pool;
+}
+
+void math_eval_thread_pool_run(struct math_eval_thread_pool *pool,
+                               size_t tasks_count, math_eval_task task,
+                               void *user_data) {
+  assert(pool != NULL);
+  assert(task != NULL);
+  assert(tasks_count <= UINT32_MAX);
+
+  const int workers_count = pool->workers_count;
+
+  if (workers_count == 1 || tasks_count <= 1) {
+    for (size_t i = 0; i < tasks_count; ++i) {
+      task(user_data, i, 0);
+    }
+
+    return;
+  }
+
+  pthread_mutex_lock(&pool->run_mutex);
+
+  for (int i = 0; i < workers_count; ++i) {
+    const size_t begin = tasks_count * (size_t)i / (size_t)workers_count;
+    const size_t end = tasks_count * (size_t)(i + 1) / (size_t)workers_count;
+
+    atomic_store(&pool->workers[i].range, RANGE(begin, end));
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->task = task;
+  pool->user_data = user_data;
+  pool->running = workers_count - 1;
+  pool->generation += 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  thread_pool_work(&pool->workers[0]);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  pthread_mutex_unlock(&pool->run_mutex);
+}
+
+int math_eval_thread_pool_size(const struct math_eval_thread_pool *pool) {
+  assert(pool != NULL);
+  return pool->workers_count;
+}
+
+#else
+
+struct math_eval_thread_pool {
+  int workers_count;
+};
+
+static struct math_eval_thread_pool default_pool = {.workers_count = 1};
+
+struct math_eval_thread_pool *math_eval_thread_pool_create(int workers_count) {
+  assert(workers_count > 0);
+  (void)workers_count;
+
+  struct math_eval_thread_pool *pool = yu_calloc(1, sizeof(*pool));
+  if (pool) {
+    pool->workers_count = 1;
+  }
+
+  return pool;
+}
+
+void math_eval_thread_pool_destroy(struct math_eval_thread_pool *pool) {
+  if (pool != &default_pool) {
+    yu_free(pool);
+  }
+}
+
+struct math_eval_thread_pool *math_eval_thread_pool_default(void) {
+  return &default_pool;
+}
+
+void math_eval_thread_pool_run(struct math_eval_thread_pool *pool,
+                               size_t tasks_count, math_eval_task task,
+                               void *user_data) {
+  assert(pool != NULL);
+  (void)pool;
+
+  for (size_t i = 0; i < tasks_count; ++i) {
+    task(user_data, i, 0);
+  }
+}
+
+int math_eval_thread_pool_size(const struct math_eval_thread_pool *pool) {
+  assert(pool != NULL);
+  return pool->workers_count;
+}
+
+#endif /* MATH_EVAL_THREADS */
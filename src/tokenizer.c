@@ -1,171 +1,175 @@
 #include <assert.h>
-#include <ctype.h>
+#include <limits.h>
 #include <string.h>
 
 #include "math_eval/log.h"
 #include "math_eval/token.h"
 #include "math_eval/tokenizer.h"
 
-void tokenizer_init(struct tokenizer *tok) {
-  tok->str = NULL;
-  tok->str_size = 0;
-  tok->cursor = 0;
+#include "number.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define TOKENIZER_SSE2
+#include <emmintrin.h>
+#endif
+
+enum char_class {
+  CHAR_SPACE = 0x1, /* As `isspace` in the "C" locale */
+  CHAR_DIGIT = 0x2,
+  CHAR_ALPHA = 0x4, /* Letters and `_` */
+};
+
+#define S CHAR_SPACE
+#define D CHAR_DIGIT
+#define A CHAR_ALPHA
+
+/* Bytes past ASCII belong to no class, whatever the locale */
+static const unsigned char char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, S, S, S, 0, 0, /* 0x00 */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x10 */
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 0x20 */
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0, /* 0x30 */
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, /* 0x40 */
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A, /* 0x50 */
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, /* 0x60 */
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0, /* 0x70 */
+};
+
+#undef S
+#undef D
+#undef A
+
+/* Characters that are a whole token by themselves */
+static const unsigned short char_tokens[256] = {
+    ['+'] = TOK_PLUS,         ['-'] = TOK_MINUS,       ['*'] = TOK_ASTERISK,
+    ['/'] = TOK_FORW_SLASH,   ['%'] = TOK_PERCENT,     ['^'] = TOK_CARET,
+    [','] = TOK_COMMA,        ['('] = TOK_OPEN_PAREN,  [')'] = TOK_CLOSE_PAREN,
+};
+
+static inline bool char_is(char c, unsigned char classes) {
+  return char_classes[(unsigned char)c] & classes;
 }
 
-void tokenizer_read(struct tokenizer *tok, const char *str) {
-  assert(tok != NULL);
-  assert(str != NULL);
+#ifdef TOKENIZER_SSE2
+/* Bits of the bytes of `v` that are in `classes` */
+static inline int span_mask(__m128i v, unsigned char classes) {
+  /* Unsigned `x <= limit` */
+#define SPAN_LE(x, limit)                                                      \
+  _mm_cmpeq_epi8(_mm_max_epu8((x), _mm_set1_epi8(limit)), _mm_set1_epi8(limit))
 
-  tok->str = str;
-  tok->str_size = (int)strlen(str);
-  tok->cursor = 0;
-}
+  __m128i in = _mm_setzero_si128();
 
-int extract_number(const char *s) {
-  bool saw_exp = false;
-  bool saw_dot = false;
-  bool saw_dig = false;
-
-  const char *start = s;
-
-  for (; *s != '\0'; ++s) {
-    if (isdigit(*s)) {
-      saw_dig = true;
-    } else if (*s == '.') {
-      if (saw_dot || saw_exp) {
-        return 0;
-      }
-
-      saw_dot = true;
-    } else if (*s == 'e' || *s == 'E') {
-      /* If we already saw `e` or not saw `0-9` it's not a valid number */
-      if (!saw_dig || saw_exp) {
-        return 0;
-      }
-
-      /* Skip `e` sign */
-      if (s[1] == '-' || s[1] == '+') {
-        s++;
-      }
-
-      saw_dig = false;
-      saw_exp = true;
-    } else {
-      break;
-    }
+  if (classes & CHAR_SPACE) {
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    in = _mm_or_si128(in, SPAN_LE(_mm_sub_epi8(v, _mm_set1_epi8('\t')), 4));
   }
 
-  return saw_dig ? (int)(s - start) : 0;
-}
-
-struct token tokenizer_next(struct tokenizer *tok) {
-  assert(tok != NULL);
-  assert(tok->str != NULL);
-
-  /* Skip white spaces */
-  while (isspace(tok->str[tok->cursor])) {
-    tok->cursor++;
+  if (classes & CHAR_DIGIT) {
+    in = _mm_or_si128(in, SPAN_LE(_mm_sub_epi8(v, _mm_set1_epi8('0')), 9));
   }
 
-  if (tok->cursor >= tok->str_size) {
-    return (struct token){.size = 0, .offset = 0, .type = TOK_EOF};
+  if (classes & CHAR_ALPHA) {
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    in = _mm_or_si128(in, SPAN_LE(_mm_sub_epi8(lower, _mm_set1_epi8('a')), 25));
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
   }
 
-  struct token t;
-  t.offset = tok->cursor;
-  t.type = TOK_INVALID;
-
-  switch (tok->str[tok->cursor]) {
-  case '0':
-  case '1':
-  case '2':
-  case '3':
-  case '4':
-  case '5':
-  case '6':
-  case '7':
-  case '8':
-  case '9':
-  case '.': {
-    t.size = extract_number(&tok->str[tok->cursor]);
+#undef SPAN_LE
 
-    if (t.size > 0) {
-      t.type = TOK_NUMBER;
+  return _mm_movemask_epi8(in);
+}
+#endif
+
+/* Characters checked one by one before scanning whole vectors */
+#define SPAN_SCALAR 8
+
+/* First character from `s` on that isn't in `classes`, or `end` */
+static inline const char *span(const char *s, const char *end,
+                               unsigned char classes) {
+  /* Most runs are short, vectors only pay off for longer ones */
+  const char *scalar_end = end - s > SPAN_SCALAR ? s + SPAN_SCALAR : end;
+  for (; s < scalar_end; ++s) {
+    if (!char_is(*s, classes)) {
+      return s;
     }
-    break;
   }
 
-  case '-': {
-    t.type = TOK_MINUS;
-    t.size = 1;
-    break;
+#ifdef TOKENIZER_SSE2
+  for (; end - s >= 16; s += 16) {
+    const int mask =
+        ~span_mask(_mm_loadu_si128((const __m128i *)(const void *)s), classes) &
+        0xffff;
+    if (mask) {
+      return s + __builtin_ctz((unsigned)mask);
+    }
   }
+#endif
 
-  case '+': {
-    t.type = TOK_PLUS;
-    t.size = 1;
-    break;
+  while (s < end && char_is(*s, classes)) {
+    ++s;
   }
 
-  case '*': {
-    t.type = TOK_ASTERISK;
-    t.size = 1;
-    break;
-  }
+  return s;
+}
 
-  case '/': {
-    t.type = TOK_FORW_SLASH;
-    t.size = 1;
-    break;
-  }
+void tokenizer_init(struct tokenizer *tok) {
+  tok->str = NULL;
+  tok->str_size = 0;
+  tok->cursor = 0;
+}
 
-  case '%': {
-    t.type = TOK_PERCENT;
-    t.size = 1;
-    break;
-  }
+void tokenizer_read(struct tokenizer *tok, const char *str) {
+  assert(str != NULL);
 
-  case '^': {
-    t.type = TOK_CARET;
-    t.size = 1;
-    break;
-  }
+  tokenizer_read_n(tok, str, strlen(str));
+}
 
-  case ',': {
-    t.type = TOK_COMMA;
-    t.size = 1;
-    break;
-  }
+void tokenizer_read_n(struct tokenizer *tok, const char *str, size_t len) {
+  assert(tok != NULL);
+  assert(str != NULL || len == 0);
+  assert(len <= INT_MAX);
 
-  case '(': {
-    t.type = TOK_OPEN_PAREN;
-    t.size = 1;
-    break;
-  }
+  tok->str = str;
+  tok->str_size = (int)len;
+  tok->cursor = 0;
+}
 
-  case ')': {
-    t.type = TOK_CLOSE_PAREN;
-    t.size = 1;
-    break;
+struct token tokenizer_next(struct tokenizer *tok) {
+  assert(tok != NULL);
+  assert(tok->str != NULL || tok->str_size == 0);
+
+  const char *end = tok->str + tok->str_size;
+
+  /* Skip white spaces */
+  tok->cursor = (int)(span(tok->str + tok->cursor, end, CHAR_SPACE) - tok->str);
+
+  if (tok->cursor >= tok->str_size) {
+    return (struct token){.size = 0, .offset = 0, .type = TOK_EOF};
   }
 
-  default: {
-    /* Check if identifier */
-    const char *s = &tok->str[tok->cursor];
+  const char *s = &tok->str[tok->cursor];
 
-    for (; *s != '\0' && (isalpha(*s) || *s == '_' || isdigit(*s)); ++s) {
-    }
+  struct token t;
+  t.offset = tok->cursor;
+  t.type = TOK_INVALID;
+  t.size = 0;
+  t.value = 0;
 
-    t.size = (int)(s - &tok->str[tok->cursor]);
+  if (char_tokens[(unsigned char)*s]) {
+    t.type = (enum token_type)char_tokens[(unsigned char)*s];
+    t.size = 1;
+  } else if (char_is(*s, CHAR_DIGIT) || *s == '.') {
+    t.size = math_eval_scan_number(s, end, &t.value);
 
     if (t.size > 0) {
-      t.type = TOK_IDENTIFIER;
-      break;
+      t.type = TOK_NUMBER;
     }
-
+  } else if (char_is(*s, CHAR_ALPHA)) {
+    t.type = TOK_IDENTIFIER;
+    t.size = (int)(span(s, end, CHAR_ALPHA | CHAR_DIGIT) - s);
+  } else {
     /* Could not extract any tokens */
-    MATH_EVAL_LOG_ERROR("Invalid syntax: %s", &tok->str[tok->cursor]);
-  }
+    MATH_EVAL_LOG_ERROR("Invalid syntax: %.*s", tok->str_size - tok->cursor, s);
   }
 
   tok->cursor += t.size;
@@ -0,0 +1,119 @@
+"""Perfect hash of the builtin names in src/symbol_table.c.
+
+Without arguments, searches for a seed under which neither the functions of
+src/builtins.h nor the constants of src/symbol_table.c share a slot, and
+prints the definitions to paste over the ones in src/symbol_table.c. With
+--check, verifies that the definitions there still fit the builtins.
+"""
+
+import os
+import re
+import sys
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+
+
+def read(path):
+    with open(os.path.join(ROOT, path)) as f:
+        return f.read()
+
+
+def builtin_names():
+    builtins = read("src/builtins.h")
+    body = builtins[builtins.index("#define MATH_EVAL_BUILTINS(X)") :]
+    body = body[: body.index("\n\n")]
+    functions = re.findall(r"\bX\((\w+),", body)
+
+    table = read("src/symbol_table.c")
+    body = table[table.index("builtins_constants[] = {") :]
+    body = body[: body.index("};")]
+    constants = re.findall(r'\{"(\w+)",', body)
+
+    return functions, constants
+
+
+def fnv1a(name, seed):
+    hash = seed
+    for c in name.encode():
+        hash = ((hash ^ c) * 16777619) & 0xFFFFFFFF
+    return hash
+
+
+def slots(names, seed, bits):
+    table = [-1] * (1 << bits)
+    for index, name in enumerate(names):
+        slot = fnv1a(name, seed) >> (32 - bits)
+        if table[slot] >= 0:
+            return None
+        table[slot] = index
+    return table
+
+
+def slots_bits(count):
+    """Half empty, few seeds fit fuller tables"""
+    bits = 1
+    while (1 << bits) < 2 * count:
+        bits += 1
+    return bits
+
+
+def c_array(name, bits_macro, table):
+    rows = []
+    for i in range(0, len(table), 16):
+        rows.append("        " + ", ".join(str(v) for v in table[i : i + 16]) + ",")
+    return (
+        f"static const signed char\n    {name}[1 << {bits_macro}] = {{\n"
+        + "\n".join(rows)
+        + "\n};"
+    )
+
+
+def generate(functions, constants):
+    function_bits = slots_bits(len(functions))
+    constant_bits = slots_bits(len(constants))
+
+    for seed in range(1 << 32):
+        function_slots = slots(functions, seed, function_bits)
+        constant_slots = slots(constants, seed, constant_bits)
+        if function_slots and constant_slots:
+            break
+
+    print(f"#define BUILTINS_HASH_SEED {seed:#x}u")
+    print(f"#define BUILTINS_FUNCTION_SLOTS_BITS {function_bits}")
+    print(f"#define BUILTINS_CONSTANT_SLOTS_BITS {constant_bits}")
+    print()
+    print(c_array("builtins_function_slots", "BUILTINS_FUNCTION_SLOTS_BITS", function_slots))
+    print()
+    print(c_array("builtins_constant_slots", "BUILTINS_CONSTANT_SLOTS_BITS", constant_slots))
+
+
+def parse_array(table, name):
+    body = table[table.index(name) :]
+    body = body[body.index("= {") + 3 : body.index("};")]
+    return [int(v) for v in re.findall(r"-?\d+", body)]
+
+
+def check(functions, constants):
+    table = read("src/symbol_table.c")
+    seed = int(re.search(r"#define BUILTINS_HASH_SEED (\w+)u", table).group(1), 0)
+    function_bits = int(re.search(r"#define BUILTINS_FUNCTION_SLOTS_BITS (\d+)", table).group(1))
+    constant_bits = int(re.search(r"#define BUILTINS_CONSTANT_SLOTS_BITS (\d+)", table).group(1))
+
+    ok = slots(functions, seed, function_bits) == parse_array(
+        table, "builtins_function_slots["
+    ) and slots(constants, seed, constant_bits) == parse_array(
+        table, "builtins_constant_slots["
+    )
+
+    if not ok:
+        print("Builtins changed, regenerate the hash with tests/builtins_hash.py")
+    return ok
+
+
+if __name__ == "__main__":
+    functions, constants = builtin_names()
+
+    if "--check" in sys.argv[1:]:
+        exit(0 if check(functions, constants) else 1)
+
+    generate(functions, constants)
@@ -1,29 +1,1126 @@
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "math_eval/batch.h"
+#include "math_eval/emit_c.h"
 #include "math_eval/evaluator.h"
+#include "math_eval/fused.h"
+#include "math_eval/gradient.h"
+#include "math_eval/jit.h"
+#include "math_eval/kernels.h"
 #include "math_eval/log.h"
 #include "math_eval/parser.h"
+#include "math_eval/shared_cache.h"
+#include "math_eval/snapshot_table.h"
 #include "math_eval/symbol_table.h"
+#include "math_eval/tokenizer.h"
 
-int main(int argc, char *argv[]) {
+/* Spans enough blocks to be split between threads, the last one is partial */
+#define BATCH_ROWS (24 * MATH_EVAL_BATCH_BLOCK_SIZE + 3)
+#define VARIABLES_COUNT 7
+#define AOT_MAX_FORMULAS 8192
+
+static double batch_values[VARIABLES_COUNT][BATCH_ROWS];
+static struct math_eval_column batch_columns[VARIABLES_COUNT];
+
+static struct math_eval_thread_pool *batch_pool = NULL;
+
+#define SHARED_TASKS 64
+
+static struct math_eval_shared_cache *shared_cache = NULL;
+static struct math_eval_thread_pool *shared_pool = NULL;
+
+struct shared_task {
+  const char *expression;
+  double results[SHARED_TASKS];
+};
+
+#define FRAME_TASKS 16
+
+/* Builtins only, variables of the test are read from frames */
+static struct symbol_table *frame_table = NULL;
+static struct math_eval_thread_pool *frame_pool = NULL;
+
+struct frame_task {
+  const struct math_eval_expression *expr;
+  double frames[FRAME_TASKS][VARIABLES_COUNT];
+  double results[FRAME_TASKS];
+};
+
+#define SNAPSHOT_TASKS 4
+
+/* Task 0 publishes `b` = 2 * `a` for growing `a`, the others read them */
+struct snapshot_task {
+  struct math_eval_snapshot_table *table;
+  int rounds;
+  bool failed[SNAPSHOT_TASKS];
+};
+
+/* Blocks start past a header, so `realloc` on them fails loudly */
+#define TEST_ALLOCATOR_HEADER 16
+
+static void *test_allocate(size_t size, void *user_data) {
+  (void)user_data;
+  char *block = malloc(TEST_ALLOCATOR_HEADER + size);
+  return block ? block + TEST_ALLOCATOR_HEADER : NULL;
+}
+
+static void test_deallocate(void *ptr, void *user_data) {
+  (void)user_data;
+  free((char *)ptr - TEST_ALLOCATOR_HEADER);
+}
+
+static double batch_eval(const struct math_eval_expression *expr) {
+  static double out[BATCH_ROWS];
+  if (!math_eval_expr_batch(expr, BATCH_ROWS, batch_columns, VARIABLES_COUNT,
+                            out)) {
+    return NAN;
+  }
+
+  if (batch_pool) {
+    static double parallel_out[BATCH_ROWS];
+    if (!math_eval_expr_batch_parallel(expr, BATCH_ROWS, batch_columns,
+                                       VARIABLES_COUNT, parallel_out,
+                                       batch_pool)) {
+      return NAN;
+    }
+
+    /* Must not depend on the number of threads */
+    if (memcmp(out, parallel_out, sizeof(out)) != 0) {
+      return NAN;
+    }
+  }
+
+  /* Only the last row holds the values under test */
+  return out[BATCH_ROWS - 1];
+}
+
+/*
+ * Fuses `expression` with expressions built around it, every output has to
+ * match evaluating its expression on its own
+ */
+static double fused_eval(const char *expression, struct symbol_table *table,
+                         const struct math_eval_expression *expr) {
+  char doubled[BUFSIZ + 8];
+  char negated[BUFSIZ + 8];
+  snprintf(doubled, sizeof(doubled), "(%s)*2", expression);
+  snprintf(negated, sizeof(negated), "-(%s)", expression);
+
+  const char *expressions[] = {expression, doubled, negated, expression};
+  struct math_eval_fused *fused =
+      math_eval_fused_compile(expressions, 4, table, NULL, NULL);
+  if (!fused) {
+    return NAN;
+  }
+
+  double out[4];
+  math_eval_fused_eval(fused, out);
+  math_eval_fused_destroy(fused);
+
+  const double expected[] = {math_eval_expr(expr), out[0] * 2, -out[0],
+                             out[0]};
+  if (memcmp(out, expected, sizeof(out)) != 0) {
+    return NAN;
+  }
+
+  return out[0];
+}
+
+/* Balanced chains may neither be deeper nor take more operations */
+static double balance_eval(const char *expression, struct symbol_table *table,
+                           const struct math_eval_expression *expr,
+                           int flags) {
+  flags |= MATH_EVAL_COMPILE_NO_CSE;
+
+  struct math_eval_expression *balanced =
+      math_eval_compile_ex(expression, table, flags, NULL);
+  struct math_eval_expression *plain = math_eval_compile_ex(
+      expression, table, flags & ~MATH_EVAL_COMPILE_BALANCE, NULL);
+
+  struct math_eval_expr_stats balanced_stats = {0};
+  struct math_eval_expr_stats plain_stats = {0};
+  if (balanced && plain) {
+    math_eval_expr_stats(balanced, &balanced_stats);
+    math_eval_expr_stats(plain, &plain_stats);
+  }
+
+  math_eval_expr_destroy(balanced);
+  math_eval_expr_destroy(plain);
+
+  if (!balanced || !plain || balanced_stats.depth > plain_stats.depth ||
+      balanced_stats.operations > plain_stats.operations) {
+    return NAN;
+  }
+
+  return math_eval_expr(expr);
+}
+
+static bool same_value(double a, double b) {
+  return memcmp(&a, &b, sizeof(a)) == 0 || (isnan(a) && isnan(b));
+}
+
+/* Changes every variable in turn, cached subtrees have to follow */
+static double incremental_eval(const char *expression,
+                               struct symbol_table *table,
+                               const struct math_eval_expression *expr,
+                               int flags,
+                               const char *variables[VARIABLES_COUNT]) {
+  struct math_eval_expression *plain = math_eval_compile_ex(
+      expression, table, flags & ~MATH_EVAL_COMPILE_INCREMENTAL, NULL);
+
+  const double result = math_eval_expr(expr);
+  bool ok = plain != NULL;
+
+  for (int i = 0; ok && i < VARIABLES_COUNT; ++i) {
+    struct math_eval_variable *variable =
+        symbol_table_find_variable(table, variables[i]);
+    const double value = variable->value;
+
+    math_eval_variable_set(variable, value * 2 + 1);
+    ok = same_value(math_eval_expr(expr), math_eval_expr(plain));
+
+    variable->value = value;
+    math_eval_variable_mark_dirty(variable);
+    ok = ok && same_value(math_eval_expr(expr), result);
+  }
+
+  math_eval_expr_destroy(plain);
+  return ok ? result : NAN;
+}
+
+/*
+ * Evaluates through the cache of `table` before and after replacing a
+ * variable, cached expressions must see the replacement
+ */
+static double cache_eval(const char *expression, struct symbol_table *table,
+                         const struct math_eval_expression *expr,
+                         const char *variables[VARIABLES_COUNT]) {
+  const double result = math_eval_expr(expr);
+  const struct math_eval_cache_stats before = symbol_table_cache_stats(table);
+
+  bool ok = same_value(math_eval(expression, table, NULL), result) &&
+            same_value(math_eval(expression, table, NULL), result);
+
+  const struct math_eval_cache_stats after = symbol_table_cache_stats(table);
+  ok = ok && after.hits + after.misses == before.hits + before.misses + 2 &&
+       after.hits >= before.hits + 1;
+
+  for (int i = 0; ok && i < VARIABLES_COUNT; ++i) {
+    const struct math_eval_variable *variable =
+        symbol_table_find_variable(table, variables[i]);
+    const double value = variable->value;
+    const bool constant = variable->constant;
+
+    symbol_table_add_variable(table, variables[i], value * 2 + 1, constant);
+    struct math_eval_expression *replaced =
+        math_eval_compile(expression, table, NULL);
+
+    ok = replaced != NULL && same_value(math_eval(expression, table, NULL),
+                                        math_eval_expr(replaced));
+    math_eval_expr_destroy(replaced);
+
+    symbol_table_add_variable(table, variables[i], value, constant);
+  }
+
+  return ok ? result : NAN;
+}
+
+static void shared_task_run(void *user_data, size_t index, int worker) {
+  struct shared_task *task = user_data;
+  task->results[index] =
+      math_eval_shared_cache_eval(shared_cache, worker, task->expression, NULL);
+}
+
+/*
+ * Evaluates `expression` from every worker through the shared cache, small
+ * enough for the corpus to evict entries while others read them
+ */
+static double shared_cache_eval(const char *expression,
+                                const struct math_eval_expression *expr) {
+  static int lines = 0;
+  if (++lines % 64 == 0) {
+    math_eval_shared_cache_clear(shared_cache);
+  }
+
+  struct shared_task task = {.expression = expression};
+  math_eval_thread_pool_run(shared_pool, SHARED_TASKS, shared_task_run, &task);
+
+  const double result = math_eval_expr(expr);
+  for (int i = 0; i < SHARED_TASKS; ++i) {
+    if (!same_value(task.results[i], result)) {
+      return NAN;
+    }
+  }
+
+  return result;
+}
+
+static void frame_task_run(void *user_data, size_t index, int worker) {
+  struct frame_task *task = user_data;
+  (void)worker;
+
+  task->results[index] =
+      math_eval_expr_frame(task->expr, task->frames[index]);
+}
+
+/*
+ * Compiles `expression` with the variables laid out in reverse order, then
+ * evaluates one compiled expression with different frames from every worker.
+ * Each result has to match evaluating its frame alone, the frame of current
+ * values has to match `expr`.
+ */
+static double frame_eval(const char *expression, struct symbol_table *table,
+                         const struct math_eval_expression *expr, int flags,
+                         const char *const *variables) {
+  const char *names[VARIABLES_COUNT];
+  for (int i = 0; i < VARIABLES_COUNT; ++i) {
+    names[i] = variables[VARIABLES_COUNT - 1 - i];
+  }
+
+  const struct math_eval_layout layout = {names, VARIABLES_COUNT};
+  struct math_eval_expression *compiled =
+      math_eval_compile_frame(expression, frame_table, &layout, flags, NULL);
+  if (!compiled) {
+    return NAN;
+  }
+
+  struct frame_task task = {.expr = compiled};
+  for (int i = 0; i < VARIABLES_COUNT; ++i) {
+    task.frames[0][i] = symbol_table_find_variable(table, names[i])->value;
+  }
+
+  for (int frame = 1; frame < FRAME_TASKS; ++frame) {
+    for (int i = 0; i < VARIABLES_COUNT; ++i) {
+      task.frames[frame][i] = frame * 0.5 + i;
+    }
+  }
+
+  math_eval_thread_pool_run(frame_pool, FRAME_TASKS, frame_task_run, &task);
+
+  const double result = math_eval_expr(expr);
+  bool ok = same_value(task.results[0], result);
+  for (int frame = 0; frame < FRAME_TASKS; ++frame) {
+    ok = ok && same_value(task.results[frame],
+                          math_eval_expr_frame(compiled, task.frames[frame]));
+  }
+
+  /* Nothing to read the slots from */
+  const double unbound = math_eval_expr(compiled);
+  ok = ok && (compiled->type == MATH_EVAL_NUMBER || isnan(unbound));
+
+  math_eval_expr_destroy(compiled);
+  return ok ? result : NAN;
+}
+
+/* Messages of the last evaluation, without the location of debug builds */
+static char one_shot_log[4096];
+
+static void one_shot_log_handler(enum math_eval_log_severity severity,
+                                 const char *msg) {
+  (void)severity;
+
+  const char *location = strstr(msg, ".c:");
+  const char *text = location ? strstr(location + 3, ": ") : NULL;
+
+  const size_t used = strlen(one_shot_log);
+  snprintf(one_shot_log + used, sizeof(one_shot_log) - used, "%s\n",
+           text ? text + 2 : msg);
+}
+
+/* Calls made to `twice` */
+static int twice_calls;
+
+static double twice(double *args) {
+  ++twice_calls;
+  return args[0] * 2;
+}
+
+/*
+ * `math_eval` must fail or succeed just like compiling and evaluating, and
+ * call user functions as often
+ */
+static bool one_shot_check(const char *expression, struct symbol_table *table) {
+  struct math_eval_error want, got;
+  memset(&want, 0x5a, sizeof(want));
+  memset(&got, 0x5a, sizeof(got));
+
+  char log[sizeof(one_shot_log)];
+  one_shot_log[0] = '\0';
+
+  twice_calls = 0;
+  struct math_eval_expression *expr =
+      math_eval_compile(expression, table, &want);
+  const double result = expr ? math_eval_expr(expr) : NAN;
+  math_eval_expr_destroy(expr);
+
+  const int calls = twice_calls;
+  twice_calls = 0;
+
+  memcpy(log, one_shot_log, sizeof(log));
+  one_shot_log[0] = '\0';
+
+  return same_value(math_eval(expression, table, &got), result) &&
+         calls == twice_calls && memcmp(&want, &got, sizeof(want)) == 0 &&
+         strcmp(log, one_shot_log) == 0;
+}
+
+/* Calls to user functions aren't folded away, unlike builtins */
+static bool one_shot_check_user(struct symbol_table *table) {
+  static const char *expressions[] = {
+      "twice(x) + twice(2)", "twice(x) ^ 0",     "twice(3) ^ 0",
+      "twice(x) ^ 2",        "pow(twice(x), 2)",  "(twice)(x) ^ 2",
+      "pow(twice(x), -1)",   "twice(x, 1) + q",   "q + twice(x, 1)",
+      "twice(q)",            "twice(x) + (",
+  };
+
+  struct math_eval_function fc = {.function = twice, .args_count = 1};
+  if (!symbol_table_add_function(table, "twice", fc)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeof(expressions) / sizeof(*expressions); ++i) {
+    if (!one_shot_check(expressions[i], table)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Checks `expression`, every prefix and every copy with one character dropped
+ * or an argument added, which covers syntax errors, unknown names and wrong
+ * argument counts
+ */
+static double one_shot_eval(const char *expression, struct symbol_table *table,
+                            const struct math_eval_expression *expr) {
+  const double result = math_eval_expr(expr);
+  bool ok = one_shot_check(expression, table);
+
+  const size_t length = strlen(expression);
+  char variant[BUFSIZ + 2];
+
+  for (size_t i = 0; ok && i < length; ++i) {
+    memcpy(variant, expression, i);
+    variant[i] = '\0';
+    ok = one_shot_check(variant, table);
+
+    strcpy(variant + i, expression + i + 1);
+    ok = ok && one_shot_check(variant, table);
+
+    if (ok && expression[i] == ')') {
+      memcpy(variant + i, ",0", 2);
+      strcpy(variant + i + 2, expression + i);
+      ok = one_shot_check(variant, table);
+    }
+  }
+
+  return ok ? result : NAN;
+}
+
+/* Prefixes fail to parse, nothing reads the errors */
+static void unterminated_log_handler(enum math_eval_log_severity severity,
+                                     const char *msg) {
+  (void)severity;
+  (void)msg;
+}
+
+/*
+ * Evaluates an unterminated copy of `expression` sized to fit, then a prefix
+ * of it, which must not see the characters that follow
+ */
+static double unterminated_eval(const char *expression,
+                                struct symbol_table *table,
+                                const struct math_eval_expression *expr) {
+  const double result = math_eval_expr(expr);
+  const size_t length = strlen(expression);
+
+  char *copy = malloc(length > 0 ? length : 1);
+  if (!copy) {
+    return NAN;
+  }
+  memcpy(copy, expression, length);
+
+  struct math_eval_expression *compiled =
+      math_eval_compile_n(copy, length, table, NULL);
+  bool ok = compiled != NULL && same_value(math_eval_expr(compiled), result) &&
+            same_value(math_eval_n(copy, length, table, NULL), result);
+  math_eval_expr_destroy(compiled);
+
+  struct ast_node *ast = ast_build_n(copy, length, NULL);
+  ok = ok && ast != NULL;
+  ast_destroy(ast);
+
+  char prefix[BUFSIZ];
+  const size_t half = length / 2;
+  memcpy(prefix, expression, half);
+  prefix[half] = '\0';
+
+  struct math_eval_error want = {0}, got = {0};
+  ok = ok && same_value(math_eval_n(copy, half, table, &got),
+                        math_eval(prefix, table, &want)) &&
+       memcmp(&want, &got, sizeof(want)) == 0;
+
+  free(copy);
+  return ok ? result : NAN;
+}
+
+/* Divisors whose reciprocal overflows have to stay divisions */
+static bool reciprocal_check(void) {
   struct symbol_table *table = symbol_table_create();
+  bool ok = table && symbol_table_add_variable(table, "a", 1e-300, false);
+
+  struct math_eval_expression *expr =
+      ok ? math_eval_compile_ex("a / 1e-310", table,
+                                MATH_EVAL_COMPILE_RECIPROCAL, NULL)
+         : NULL;
+  ok = expr && same_value(math_eval_expr(expr), 1e-300 / 1e-310);
+
+  if (ok) {
+    math_eval_variable_set(symbol_table_find_variable(table, "a"), 0);
+    ok = same_value(math_eval_expr(expr), 0);
+  }
+
+  math_eval_expr_destroy(expr);
+  symbol_table_destroy(table);
+  return ok;
+}
+
+/* Powers only copy their base when it calls no user function */
+static bool power_check(void) {
+  static const struct {
+    const char *expression;
+    double exponent;
+    int flags;
+  } powers[] = {
+      {"twice(a) ^ 2", 2, 0},
+      {"pow(twice(a), 2)", 2, 0},
+      {"twice(a) ^ -1", -1, 0},
+      {"twice(a) ^ 2", 2, MATH_EVAL_COMPILE_FAST_MATH},
+      {"twice(a) ^ 16", 16, MATH_EVAL_COMPILE_FAST_MATH},
+      {"twice(a) ^ 0.5", 0.5, MATH_EVAL_COMPILE_FAST_MATH},
+      {"twice(a) ^ 0", 0, MATH_EVAL_COMPILE_FAST_MATH},
+      {"pow(twice(a), 0)", 0, MATH_EVAL_COMPILE_FAST_MATH},
+  };
+
+  struct symbol_table *table = symbol_table_create();
+  struct math_eval_function fc = {.function = twice, .args_count = 1};
+  bool ok = table && symbol_table_add_variable(table, "a", 2, false) &&
+            symbol_table_add_function(table, "twice", fc);
+  if (ok) {
+    symbol_table_add_builtins(table);
+  }
+
+  for (size_t i = 0; ok && i < sizeof(powers) / sizeof(*powers); ++i) {
+    struct math_eval_expression *expr = math_eval_compile_ex(
+        powers[i].expression, table, powers[i].flags, NULL);
+
+    /* Powers of 4 are exact */
+    twice_calls = 0;
+    ok = expr && same_value(math_eval_expr(expr), pow(4, powers[i].exponent)) &&
+         twice_calls == 1;
+
+    math_eval_expr_destroy(expr);
+  }
+
+  symbol_table_destroy(table);
+  return ok;
+}
+
+/*
+ * Variables keep their index and address while the table grows, adding one
+ * again updates it in place
+ */
+static bool variables_check(int count) {
+  struct symbol_table *table = symbol_table_create();
+  struct math_eval_variable **added = malloc(sizeof(*added) * (size_t)count);
+  bool ok = table && added;
+
+  for (int i = 0; ok && i < count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "v%d", i);
+
+    ok = symbol_table_add_variable(table, name, i, false);
+    added[i] = ok ? symbol_table_find_variable(table, name) : NULL;
+  }
+
+  for (int i = 0; ok && i < count; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "v%d", i);
+
+    ok = symbol_table_find_variable_index(table, name) == i &&
+         symbol_table_variable_at(table, i) == added[i] &&
+         same_value(added[i]->value, i) &&
+         symbol_table_add_variable(table, name, -i, true) &&
+         symbol_table_find_variable(table, name) == added[i] &&
+         same_value(added[i]->value, -i) && added[i]->constant &&
+         added[i]->version == 1;
+  }
+
+  ok = ok && symbol_table_find_variable_index(table, "missing") == -1;
+
+  free(added);
+  symbol_table_destroy(table);
+  return ok;
+}
+
+/* Compares the shared builtins against a table they were added to */
+static bool layered_check(void) {
+  static const char *functions[] = {"min",   "max",  "logn", "log", "ceil",
+                                    "floor", "abs",  "cos",  "sin", "exp",
+                                    "round", "pow",  "sqrt", "tan", "ncr"};
+  static const char *constants[] = {"pi", "e", "pi_2", "pi_4"};
+  static const char *missing[] = {"", "mi", "pi_3", "sinh", "x", "ncrr"};
+
+  struct symbol_table *builtins = symbol_table_builtins();
+  struct symbol_table *added = symbol_table_create();
+  struct symbol_table *child = symbol_table_create_child(builtins);
+  struct symbol_table *grandchild = symbol_table_create_child(child);
+  bool ok = added && child && grandchild;
+  if (ok) {
+    symbol_table_add_builtins(added);
+  }
+
+  for (size_t i = 0; ok && i < sizeof(functions) / sizeof(*functions); ++i) {
+    const struct math_eval_function *expected =
+        symbol_table_find_function(added, functions[i]);
+    const struct math_eval_function *got =
+        symbol_table_find_function(builtins, functions[i]);
+
+    ok = expected && got && expected->function == got->function &&
+         expected->args_count == got->args_count &&
+         expected->kernel == got->kernel &&
+         expected->derivative == got->derivative &&
+         symbol_table_find_function(grandchild, functions[i]) == got &&
+         symbol_table_find_variable(builtins, functions[i]) == NULL;
+  }
+
+  for (size_t i = 0; ok && i < sizeof(constants) / sizeof(*constants); ++i) {
+    const struct math_eval_variable *expected =
+        symbol_table_find_variable(added, constants[i]);
+    const struct math_eval_variable *got =
+        symbol_table_find_variable(builtins, constants[i]);
+
+    ok = expected && got && same_value(expected->value, got->value) &&
+         got->constant &&
+         symbol_table_find_variable(grandchild, constants[i]) == got &&
+         symbol_table_find_function(builtins, constants[i]) == NULL;
+  }
+
+  for (size_t i = 0; ok && i < sizeof(missing) / sizeof(*missing); ++i) {
+    ok = symbol_table_find_function(grandchild, missing[i]) == NULL &&
+         symbol_table_find_variable(grandchild, missing[i]) == NULL;
+  }
+
+  /* Symbols of a child hide those of its parents */
+  ok = ok && symbol_table_add_variable(child, "pi", 3, true) &&
+       symbol_table_add_variable(grandchild, "x", 1, false) &&
+       same_value(symbol_table_find_variable(grandchild, "pi")->value, 3) &&
+       same_value(symbol_table_find_variable(builtins, "pi")->value, M_PI) &&
+       symbol_table_find_variable(child, "x") == NULL &&
+       symbol_table_find_variable_index(grandchild, "pi") == -1;
+
+  struct math_eval_expression *expr =
+      ok ? math_eval_compile("pi + x + sin(0)", grandchild, NULL) : NULL;
+  ok = expr && same_value(math_eval_expr(expr), 4);
+
+  /* Only children of read-only tables can cache, hiding drops the cache */
+  struct symbol_table *cached = symbol_table_create_child(builtins);
+  ok = ok && cached && !symbol_table_cache_enable(grandchild, 4) &&
+       !symbol_table_cache_enable(builtins, 4) &&
+       symbol_table_cache_enable(cached, 4) &&
+       same_value(math_eval("e + 0", cached, NULL), M_E) &&
+       symbol_table_add_variable(cached, "e", 2, false) &&
+       same_value(math_eval("e + 0", cached, NULL), 2) &&
+       same_value(math_eval("abs(-1)", cached, NULL), 1) &&
+       symbol_table_add_function(cached, "abs", *symbol_table_find_function(
+                                                   builtins, "sqrt")) &&
+       same_value(math_eval("abs(-1)", cached, NULL), NAN);
+
+  symbol_table_destroy(cached);
+  math_eval_expr_destroy(expr);
+  symbol_table_destroy(builtins);
+  symbol_table_destroy(grandchild);
+  symbol_table_destroy(child);
+  symbol_table_destroy(added);
+  return ok;
+}
+
+/* Prints the value followed by the derivative by every test variable */
+static bool gradient_print(const struct math_eval_expression *expr,
+                           struct symbol_table *table,
+                           const char *variables[VARIABLES_COUNT]) {
+  const struct math_eval_variable *read[VARIABLES_COUNT];
+  const int count = math_eval_expr_variables(expr, read, VARIABLES_COUNT);
+  if (count > VARIABLES_COUNT) {
+    return false;
+  }
+
+  double gradient[VARIABLES_COUNT];
+  printf("%.20g", math_eval_expr_gradient(expr, gradient));
+
+  for (int i = 0; i < VARIABLES_COUNT; ++i) {
+    const struct math_eval_variable *variable =
+        symbol_table_find_variable(table, variables[i]);
+
+    double derivative = 0;
+    for (int j = 0; j < count; ++j) {
+      derivative = read[j] == variable ? gradient[j] : derivative;
+    }
+
+    printf(" %.20g", derivative);
+  }
+
+  printf("\n");
+  return true;
+}
+
+/* The tokenizer has to read `number` whole and exactly like `strtod` */
+static bool number_check(const char *number) {
+  struct tokenizer tokenizer;
+  tokenizer_init(&tokenizer);
+  tokenizer_read(&tokenizer, number);
+
+  const struct token token = tokenizer_next(&tokenizer);
+  const double want = strtod(number, NULL);
+
+  if (token.type != TOK_NUMBER || token.size != (int)strlen(number) ||
+      !same_value(token.value, want)) {
+    printf("[FAIL] %s: %.17g, want %.17g\n", number, token.value, want);
+    return false;
+  }
+
+  return true;
+}
+
+static uint64_t number_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void snapshot_task_run(void *user_data, size_t index, int worker) {
+  struct snapshot_task *task = user_data;
+  bool ok = true;
+
+  if (index == 0) {
+    struct symbol_table *writer =
+        math_eval_snapshot_table_writer(task->table);
+
+    for (int i = 1; ok && i <= task->rounds; ++i) {
+      ok = symbol_table_add_variable(writer, "a", i, false) &&
+           symbol_table_add_variable(writer, "b", 2 * i, false);
+
+      /* Grows the table copied by every publish */
+      char name[32];
+      snprintf(name, sizeof(name), "v%d", i);
+      ok = ok && (i % 16 != 0 || symbol_table_add_variable(writer, name, i,
+                                                           true));
+
+      ok = ok && math_eval_snapshot_table_publish(task->table);
+    }
+
+    task->failed[index] = !ok;
+    return;
+  }
+
+  double last = 0;
+  for (int i = 0; ok && i < task->rounds; ++i) {
+    struct symbol_table *table =
+        math_eval_snapshot_table_pin(task->table, worker);
+    const struct math_eval_variable *a = symbol_table_find_variable(table, "a");
+    const struct math_eval_variable *b = symbol_table_find_variable(table, "b");
+
+    if (a && b) {
+      struct math_eval_expression *expr =
+          math_eval_compile("b - 2 * a + sqrt(0)", table, NULL);
+
+      ok = expr && same_value(math_eval_expr(expr), 0) && a->value >= last &&
+           !symbol_table_add_variable(table, "a", 0, false);
+      last = a->value;
+      math_eval_expr_destroy(expr);
+    } else {
+      /* Nothing was published yet */
+      ok = !a && !b;
+    }
+
+    math_eval_snapshot_table_unpin(task->table, worker);
+  }
+
+  task->failed[index] = !ok;
+}
+
+/* One writer publishing while readers check that they see whole updates */
+static bool snapshots_check(int rounds) {
+  struct math_eval_thread_pool *pool =
+      math_eval_thread_pool_create(SNAPSHOT_TASKS);
+  struct snapshot_task task = {.rounds = rounds};
+  task.table = pool ? math_eval_snapshot_table_create(
+                          symbol_table_builtins(),
+                          math_eval_thread_pool_size(pool))
+                    : NULL;
+  bool ok = task.table != NULL;
+
+  if (ok) {
+    math_eval_thread_pool_run(pool, SNAPSHOT_TASKS, snapshot_task_run, &task);
+  }
+
+  for (int i = 0; ok && i < SNAPSHOT_TASKS; ++i) {
+    ok = !task.failed[i];
+  }
+
+  if (ok) {
+    struct symbol_table *table = math_eval_snapshot_table_pin(task.table, 0);
+    const struct math_eval_variable *a = symbol_table_find_variable(table, "a");
+
+    ok = a && same_value(a->value, rounds) &&
+         symbol_table_find_variable_index(table, "b") == 1;
+    math_eval_snapshot_table_unpin(task.table, 0);
+  }
+
+  math_eval_snapshot_table_destroy(task.table);
+  math_eval_thread_pool_destroy(pool);
+  return ok;
+}
+
+/*
+ * Random digit strings, round trips of random doubles, more digits than fit
+ * in 64 bits and points halfway between neighbouring doubles
+ */
+static bool numbers_check(int count) {
+  static const char *edges[] = {
+      "0", "0.0", ".0", "0.", "00000.00000e-99999", "1e308", "1.8e308",
+      "1e309", "2.2250738585072011e-308", "2.2250738585072014e-308",
+      "4.9e-324", "2.4703282292062327e-324", "2.4703282292062328e-324",
+      "9007199254740993", "9007199254740992.5", "1e23", "8.5e-322",
+      "179769313486231580793728971405303415079934132710037826936173778980444"
+      "968292764750946649017977587207096330286416692887910946555547851940402"
+      "630657488671505820681908902000708383676273854845817711531764475730270"
+      "069855571366959622842914819860834936475292719074168444365510704342711"
+      "559699508093042880177904174497791.9999999999999999999999999999999999",
+      "0.000000000000000000000000000000000000000000001e-280",
+      "123456789012345678901234567890e-40", "1e99999999", "1e-99999999",
+  };
+
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(edges) / sizeof(*edges); ++i) {
+    ok = number_check(edges[i]) && ok;
+  }
+
+  uint64_t state = 0x2545f4914f6cdd1d;
+  char number[128];
+
+  for (int i = 0; ok && i < count; ++i) {
+    /* Digits, a point and an exponent in random amounts */
+    int length = 0;
+    const int integer = (int)(number_random(&state) % 24);
+    const int fraction = (int)(number_random(&state) % 24) + (integer == 0);
+
+    for (int digit = 0; digit < integer; ++digit) {
+      number[length++] = (char)('0' + number_random(&state) % 10);
+    }
+    if (fraction > 0) {
+      number[length++] = '.';
+    }
+    for (int digit = 0; digit < fraction; ++digit) {
+      number[length++] = (char)('0' + number_random(&state) % 10);
+    }
+    if (number_random(&state) % 2) {
+      length += snprintf(number + length, sizeof(number) - (size_t)length,
+                         "e%d", (int)(number_random(&state) % 700) - 350);
+    }
+    number[length] = '\0';
+    ok = number_check(number);
+
+    /* Any finite double, printed with every useful precision */
+    const uint64_t bits = number_random(&state) & ~(UINT64_C(1) << 63);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+
+    if (isfinite(value)) {
+      snprintf(number, sizeof(number), "%.*e",
+               (int)(number_random(&state) % 25), value);
+      ok = ok && number_check(number);
+
+#if LDBL_MANT_DIG >= 64
+      /* Exactly halfway to the next double when printed with enough digits */
+      const double next = nextafter(value, INFINITY);
+      if (isfinite(next)) {
+        snprintf(number, sizeof(number), "%.60Le",
+                 ((long double)value + (long double)next) / 2);
+        ok = ok && number_check(number);
+      }
+#endif
+    }
+  }
+
+  return ok;
+}
+
+/* Builds every expression of `corpus` into a shared object and compares */
+static bool aot_check(struct symbol_table *table, const char *corpus,
+                      const char *variables[VARIABLES_COUNT], int flags) {
+  FILE *file = fopen(corpus, "r");
+  if (!file) {
+    return false;
+  }
+
+  struct math_eval_c_variable c_variables[VARIABLES_COUNT];
+  double values[VARIABLES_COUNT];
+
+  for (int i = 0; i < VARIABLES_COUNT; ++i) {
+    c_variables[i].name = variables[i];
+    c_variables[i].variable = symbol_table_find_variable(table, variables[i]);
+    values[i] = c_variables[i].variable->value;
+  }
+
+  struct math_eval_formula formulas[AOT_MAX_FORMULAS];
+  char names[AOT_MAX_FORMULAS][16];
+  int formulas_count = 0;
+
+  char buffer[BUFSIZ];
+  while (formulas_count < AOT_MAX_FORMULAS &&
+         fgets(buffer, sizeof(buffer), file)) {
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+
+    struct math_eval_expression *expr =
+        math_eval_compile_ex(buffer, table, flags, NULL);
+    if (expr) {
+      snprintf(names[formulas_count], sizeof(names[0]), "f%d", formulas_count);
+      formulas[formulas_count].name = names[formulas_count];
+      formulas[formulas_count].expr = expr;
+      formulas_count += 1;
+    }
+  }
+  fclose(file);
+
+  struct math_eval_emit_c_options options = {
+      .variables = c_variables,
+      .variables_count = VARIABLES_COUNT,
+      .style = MATH_EVAL_EMIT_C_STRUCT,
+  };
+
+  struct math_eval_shared_object *object = math_eval_shared_object_build(
+      "./aot_test.so", formulas, formulas_count, &options);
+
+  bool ok = object != NULL;
+  for (int i = 0; ok && i < formulas_count; ++i) {
+    math_eval_native_fun function =
+        math_eval_shared_object_function(object, formulas[i].name);
+    if (!function) {
+      ok = false;
+      break;
+    }
+
+    const double expected = math_eval_expr(formulas[i].expr);
+    const double got = function(values);
+
+    /* Bit for bit, any NaN is accepted for a NaN */
+    if (memcmp(&expected, &got, sizeof(got)) != 0 &&
+        !(isnan(expected) && isnan(got))) {
+      printf("[FAIL] %s: expected %a, got %a\n", formulas[i].name, expected,
+             got);
+      ok = false;
+    }
+  }
+
+  for (int i = 0; i < formulas_count; ++i) {
+    math_eval_expr_destroy((struct math_eval_expression *)formulas[i].expr);
+  }
+
+  math_eval_shared_object_close(object);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  /* Options go before variable values */
+  bool constant = true;
+  int flags = MATH_EVAL_COMPILE_DEFAULT;
+  bool batch = false;
+  bool fused = false;
+  bool gradient = false;
+  bool cache = false;
+  bool shared = false;
+  bool one_shot = false;
+  bool unterminated = false;
+  bool frame = false;
+  bool layered = false;
+  const char *aot_corpus = NULL;
+  int numbers = 0;
+  int snapshots = 0;
+
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+    if (strcmp(argv[arg], "--variables") == 0) {
+      /* Keep variables out of constant folding */
+      constant = false;
+    } else if (strcmp(argv[arg], "--allocator") == 0) {
+      /* Goes first, nothing may be allocated before */
+      math_eval_init(&(struct math_eval_allocator){
+          .allocate = test_allocate,
+          .deallocate = test_deallocate,
+      });
+    } else if (strcmp(argv[arg], "--bytecode") == 0) {
+      flags |= MATH_EVAL_COMPILE_BYTECODE;
+    } else if (strcmp(argv[arg], "--fast-math") == 0) {
+      flags |= MATH_EVAL_COMPILE_FAST_MATH | MATH_EVAL_COMPILE_RECIPROCAL;
+    } else if (strcmp(argv[arg], "--reassociate") == 0) {
+      flags |= MATH_EVAL_COMPILE_REASSOCIATE;
+    } else if (strcmp(argv[arg], "--balance") == 0) {
+      flags |= MATH_EVAL_COMPILE_BALANCE;
+    } else if (strcmp(argv[arg], "--gradient") == 0) {
+      gradient = true;
+    } else if (strcmp(argv[arg], "--cache") == 0) {
+      cache = true;
+    } else if (strcmp(argv[arg], "--shared-cache") == 0) {
+      shared = true;
+    } else if (strcmp(argv[arg], "--one-shot") == 0) {
+      one_shot = true;
+    } else if (strcmp(argv[arg], "--unterminated") == 0) {
+      unterminated = true;
+    } else if (strcmp(argv[arg], "--frame") == 0) {
+      frame = true;
+    } else if (strcmp(argv[arg], "--layered") == 0) {
+      layered = true;
+    } else if (strcmp(argv[arg], "--incremental") == 0) {
+      flags |= MATH_EVAL_COMPILE_INCREMENTAL;
+    } else if (strcmp(argv[arg], "--jit") == 0) {
+      /* Don't let the test pass on the fallback evaluator */
+      if (!math_eval_jit_available()) {
+        return EXIT_FAILURE;
+      }
+
+      flags |= MATH_EVAL_COMPILE_JIT;
+    } else if (strncmp(argv[arg], "--aot=", 6) == 0) {
+      /* Checks generated C against the corpus instead of reading stdin */
+      aot_corpus = argv[arg] + 6;
+    } else if (strncmp(argv[arg], "--numbers=", 10) == 0) {
+      /* Checks reading numbers against `strtod` instead of reading stdin */
+      numbers = atoi(argv[arg] + 10);
+    } else if (strncmp(argv[arg], "--snapshots=", 12) == 0) {
+      /* Checks snapshot tables instead of reading stdin */
+      snapshots = atoi(argv[arg] + 12);
+    } else if (strncmp(argv[arg], "--threads=", 10) == 0) {
+      batch_pool = math_eval_thread_pool_create(atoi(argv[arg] + 10));
+      if (!batch_pool) {
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[arg], "--fused") == 0) {
+      fused = true;
+    } else if (strncmp(argv[arg], "--isa=", 6) == 0) {
+      /* Instruction set of batch kernels */
+      enum math_eval_isa isa = MATH_EVAL_ISA_SCALAR;
+      while (strcmp(math_eval_isa_to_str(isa), argv[arg] + 6) != 0) {
+        if (isa++ == MATH_EVAL_ISA_AVX512) {
+          return EXIT_FAILURE;
+        }
+      }
+
+      if (!math_eval_kernels_select(isa)) {
+        return EXIT_FAILURE;
+      }
+    } else {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!variables_check(1000) || !layered_check() || !reciprocal_check() ||
+      !power_check()) {
+    return EXIT_FAILURE;
+  }
+
+  /* Builtins are either added or looked up in the shared table */
+  struct symbol_table *table =
+      layered ? symbol_table_create_child(symbol_table_builtins())
+              : symbol_table_create();
   if (!table) {
     MATH_EVAL_LOG_ERROR("Failed to create symbol table");
     return EXIT_FAILURE;
   }
 
-  const char *variables[] = {"a", "b", "c", "x", "y", "z", "w"};
-  int variables_count = sizeof(variables) / sizeof(variables[0]);
-  if (variables_count != argc - 1) {
+  const char *variables[VARIABLES_COUNT] = {"a", "b", "c", "x",
+                                            "y", "z", "w"};
+  if (VARIABLES_COUNT != argc - arg) {
     return EXIT_FAILURE;
   }
 
-  for (int i = 0; i < variables_count; ++i) {
-    symbol_table_add_variable(table, variables[i], atof(argv[i + 1]), true);
+  for (int i = 0; i < VARIABLES_COUNT; ++i) {
+    const double value = atof(argv[arg + i]);
+    symbol_table_add_variable(table, variables[i], value, constant);
+
+    for (int row = 0; row < BATCH_ROWS; ++row) {
+      batch_values[i][row] = row == BATCH_ROWS - 1 ? value : row * 0.5;
+    }
+
+    batch_columns[i].variable = symbol_table_find_variable(table, variables[i]);
+    batch_columns[i].values = batch_values[i];
+  }
+
+  if (!layered) {
+    symbol_table_add_builtins(table);
+  }
+
+  /* Small enough for the corpus to evict entries */
+  if (cache && !symbol_table_cache_enable(table, 16)) {
+    return EXIT_FAILURE;
+  }
+
+  if (shared) {
+    shared_pool = math_eval_thread_pool_create(4);
+    shared_cache = math_eval_shared_cache_create(table, flags, 8, 4);
+    if (!shared_pool || !shared_cache) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (frame) {
+    frame_table = symbol_table_create();
+    frame_pool = math_eval_thread_pool_create(4);
+    if (!frame_table || !frame_pool) {
+      return EXIT_FAILURE;
+    }
+
+    symbol_table_add_builtins(frame_table);
+  }
+
+  if (one_shot) {
+    math_eval_install_message_handler(one_shot_log_handler);
+    if (!one_shot_check_user(table)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (unterminated) {
+    math_eval_install_message_handler(unterminated_log_handler);
   }
 
-  symbol_table_add_builtins(table);
+  if (numbers > 0) {
+    const bool ok = numbers_check(numbers);
+
+    symbol_table_destroy(table);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (snapshots > 0) {
+    const bool ok = snapshots_check(snapshots);
+
+    symbol_table_destroy(table);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (aot_corpus) {
+    const bool ok = aot_check(table, aot_corpus, variables, flags);
+
+    symbol_table_destroy(table);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   char buffer[BUFSIZ];
 
@@ -32,9 +1129,28 @@ int main(int argc, char *argv[]) {
   while (fgets(buffer, sizeof(buffer), stdin)) {
     buffer[strcspn(buffer, "\r\n")] = '\0';
 
-    struct math_eval_expression *expr = math_eval_compile(buffer, table, NULL);
-    if (expr) {
-      double result = math_eval_expr(expr);
+    struct math_eval_expression *expr =
+        math_eval_compile_ex(buffer, table, flags, NULL);
+    if (expr && gradient) {
+      if (!gradient_print(expr, table, variables)) {
+        printf("[FAIL] %s\n", buffer);
+      }
+
+      math_eval_expr_destroy(expr);
+    } else if (expr) {
+      double result =
+          batch   ? batch_eval(expr)
+          : fused ? fused_eval(buffer, table, expr)
+          : (flags & MATH_EVAL_COMPILE_BALANCE)
+              ? balance_eval(buffer, table, expr, flags)
+          : cache ? cache_eval(buffer, table, expr, variables)
+          : shared ? shared_cache_eval(buffer, expr)
+          : one_shot ? one_shot_eval(buffer, table, expr)
+          : unterminated ? unterminated_eval(buffer, table, expr)
+          : frame ? frame_eval(buffer, table, expr, flags, variables)
+          : (flags & MATH_EVAL_COMPILE_INCREMENTAL)
+              ? incremental_eval(buffer, table, expr, flags, variables)
+              : math_eval_expr(expr);
       math_eval_expr_destroy(expr);
 
       printf("%.20g\n", result);
@@ -46,6 +1162,11 @@ int main(int argc, char *argv[]) {
   }
 
   ast_destroy(ast);
+  math_eval_shared_cache_destroy(shared_cache);
+  math_eval_thread_pool_destroy(shared_pool);
+  math_eval_thread_pool_destroy(batch_pool);
+  math_eval_thread_pool_destroy(frame_pool);
+  symbol_table_destroy(frame_table);
   symbol_table_destroy(table);
   return EXIT_SUCCESS;
 }
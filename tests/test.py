@@ -2,11 +2,12 @@ import math
 import sys
 from subprocess import PIPE, Popen
 
-if len(sys.argv) != 2:
+if len(sys.argv) < 2:
     print("Test binary path is not provided")
     exit(-1)
 
 test_executable = sys.argv[1]
+test_options = sys.argv[2:]
 
 globals = {
     "sin": math.sin,
@@ -31,6 +32,7 @@ globals = {
 p = Popen(
     [
         test_executable,
+        *test_options,
         str(globals["a"]),
         str(globals["b"]),
         str(globals["c"]),
@@ -47,6 +49,239 @@ p = Popen(
 
 failed = False
 
+
+class Bounded:
+    """Value with a first order bound of its rounding error"""
+
+    EPSILON = 2.0**-53
+
+    def __init__(self, value, error=0.0):
+        self.value = value
+        self.error = error + Bounded.EPSILON * abs(value)
+
+    def __neg__(self):
+        return Bounded(-self.value, self.error)
+
+    def __pos__(self):
+        return self
+
+    def __abs__(self):
+        return Bounded(abs(self.value), self.error)
+
+    def __add__(self, other):
+        other = lift(other)
+        return Bounded(self.value + other.value, self.error + other.error)
+
+    def __sub__(self, other):
+        other = lift(other)
+        return Bounded(self.value - other.value, self.error + other.error)
+
+    def __mul__(self, other):
+        other = lift(other)
+        return Bounded(
+            self.value * other.value,
+            abs(self.value) * other.error
+            + abs(other.value) * self.error
+            + self.error * other.error,
+        )
+
+    def __truediv__(self, other):
+        other = lift(other)
+        value = self.value / other.value
+        if abs(other.value) <= other.error:
+            return Bounded(value, math.inf)
+
+        return Bounded(
+            value,
+            (self.error + abs(value) * other.error) / (abs(other.value) - other.error),
+        )
+
+    def __mod__(self, other):
+        other = lift(other)
+        quotient = abs(self.value // other.value)
+        return Bounded(self.value % other.value, self.error + quotient * other.error)
+
+    def __pow__(self, other):
+        other = lift(other)
+        value = self.value**other.value
+        error = 0.0
+        if self.value != 0:
+            error += abs(other.value * value / self.value) * self.error
+        if self.value > 0:
+            error += abs(math.log(self.value) * value) * other.error
+
+        return Bounded(value, error)
+
+    __radd__ = __add__
+    __rmul__ = __mul__
+
+    def __rsub__(self, other):
+        return lift(other) - self
+
+    def __rtruediv__(self, other):
+        return lift(other) / self
+
+    def __rmod__(self, other):
+        return lift(other) % self
+
+    def __rpow__(self, other):
+        return lift(other) ** self
+
+
+def lift(value):
+    return value if isinstance(value, Bounded) else Bounded(float(value))
+
+
+def bounded_function(function, derivative):
+    def call(x):
+        x = lift(x)
+        return Bounded(function(x.value), abs(derivative(x.value)) * x.error)
+
+    return call
+
+
+bounded_globals = {
+    "sin": bounded_function(math.sin, math.cos),
+    "cos": bounded_function(math.cos, math.sin),
+    "tan": bounded_function(math.tan, lambda x: 1 + math.tan(x) ** 2),
+    "sqrt": bounded_function(math.sqrt, lambda x: 0.5 / math.sqrt(x)),
+    "pow": lambda x, y: lift(x) ** lift(y),
+    "log": bounded_function(math.log, lambda x: 1 / x),
+    "exp": bounded_function(math.exp, math.exp),
+    "abs": abs,
+}
+for name in ("a", "b", "c", "x", "y", "z", "w", "pi", "e"):
+    bounded_globals[name] = Bounded(float(globals[name]), 0.0)
+
+
+class Dual:
+    """Value with its derivatives by every variable, forward mode. Magnitudes
+    sum the contributions to every derivative without their signs, they bound
+    the rounding error of derivatives that cancel out."""
+
+    def __init__(self, value, derivatives, magnitudes=None):
+        self.value = value
+        self.derivatives = derivatives
+        self.magnitudes = magnitudes or [abs(d) for d in derivatives]
+
+    def chain(self, value, *pairs):
+        derivatives = [0.0] * len(variables)
+        magnitudes = [0.0] * len(variables)
+        for partial, operand in pairs:
+            if partial != 0:
+                for i, derivative in enumerate(operand.derivatives):
+                    derivatives[i] += partial * derivative
+                    magnitudes[i] += abs(partial) * operand.magnitudes[i]
+
+        return Dual(value, derivatives, magnitudes)
+
+    def __neg__(self):
+        return self.chain(-self.value, (-1.0, self))
+
+    def __pos__(self):
+        return self
+
+    def __abs__(self):
+        return self.chain(abs(self.value), (math.copysign(1.0, self.value), self))
+
+    def __add__(self, other):
+        other = dual(other)
+        return self.chain(self.value + other.value, (1.0, self), (1.0, other))
+
+    def __sub__(self, other):
+        other = dual(other)
+        return self.chain(self.value - other.value, (1.0, self), (-1.0, other))
+
+    def __mul__(self, other):
+        other = dual(other)
+        return self.chain(
+            self.value * other.value, (other.value, self), (self.value, other)
+        )
+
+    def __truediv__(self, other):
+        other = dual(other)
+        value = self.value / other.value
+        return self.chain(
+            value, (1.0 / other.value, self), (-value / other.value, other)
+        )
+
+    def __mod__(self, other):
+        other = dual(other)
+        quotient = math.floor(self.value / other.value)
+        return self.chain(self.value % other.value, (1.0, self), (-quotient, other))
+
+    def __pow__(self, other):
+        other = dual(other)
+        value = self.value**other.value
+        base = 0.0 if other.value == 0 else other.value * self.value ** (other.value - 1)
+        exponent = value * math.log(self.value) if self.value > 0 else 0.0
+        return self.chain(value, (base, self), (exponent, other))
+
+    __radd__ = __add__
+    __rmul__ = __mul__
+
+    def __rsub__(self, other):
+        return dual(other) - self
+
+    def __rtruediv__(self, other):
+        return dual(other) / self
+
+    def __rmod__(self, other):
+        return dual(other) % self
+
+    def __rpow__(self, other):
+        return dual(other) ** self
+
+
+variables = ("a", "b", "c", "x", "y", "z", "w")
+
+
+def dual(value):
+    return value if isinstance(value, Dual) else Dual(value, [0.0] * len(variables))
+
+
+def dual_function(function, derivative):
+    def call(x):
+        x = dual(x)
+        return x.chain(function(x.value), (derivative(x.value), x))
+
+    return call
+
+
+dual_globals = {
+    "sin": dual_function(math.sin, math.cos),
+    "cos": dual_function(math.cos, lambda x: -math.sin(x)),
+    "tan": dual_function(math.tan, lambda x: 1 / math.cos(x) ** 2),
+    "sqrt": dual_function(math.sqrt, lambda x: 0.5 / math.sqrt(x)),
+    "pow": lambda x, y: dual(x) ** dual(y),
+    "log": dual_function(math.log, lambda x: 1 / x),
+    "exp": dual_function(math.exp, math.exp),
+    "abs": abs,
+    "pi": math.pi,
+    "e": math.e,
+}
+for index, name in enumerate(variables):
+    dual_globals[name] = Dual(globals[name], [float(i == index) for i in range(7)])
+
+
+def gradient_matches(expression, derivatives):
+    expected = dual(eval(expression, dual_globals))
+
+    return all(
+        abs(got - want) <= 1e-6 * magnitude
+        for got, want, magnitude in zip(
+            derivatives, expected.derivatives, expected.magnitudes
+        )
+    )
+
+
+# Reassociation and balancing round differently, the difference has to stay
+# within the rounding error of evaluating the line in the order it's written
+def within_rounding(expression, actual):
+    expected = eval(expression, bounded_globals)
+    return abs(actual - expected.value) <= 4 * expected.error
+
+
 with open("test_complete.txt") as f:
     for line in f:
         try:
@@ -54,8 +289,19 @@ with open("test_complete.txt") as f:
             p.stdin.flush()
             stdout_data = p.stdout.readline().strip("\r\n")
 
+            if "--gradient" in test_options:
+                stdout_data, *derivatives = stdout_data.split(" ")
+                if not gradient_matches(
+                    line.replace("^", "**"), [float(d) for d in derivatives]
+                ):
+                    print(f"[FAIL] {line.strip()}: gradient({derivatives})")
+                    failed = True
+
             eval_data = eval(line.replace("^", "**"), globals)
-            if not math.isclose(float(stdout_data), float(eval_data)):
+            if not math.isclose(float(stdout_data), float(eval_data)) and not (
+                ("--reassociate" in test_options or "--balance" in test_options)
+                and within_rounding(line.replace("^", "**"), float(stdout_data))
+            ):
                 print(
                     f"[FAIL] {line.strip('\r\n')}:\n\tpython_eval({eval_data}), my_eval({stdout_data})"
                 )